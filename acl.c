@@ -39,12 +39,30 @@ SOFTWARE.
 #include "config.h"
 #include "cache.h"
 #include "http.h"
+#include "retry.h"
+#include "domain.h"
+#include "deadline.h"
+#include "plugin.h"
+#include "group.h"
 
 #define GET_TOKEN(x,y,z,f) y=(x!=NULL?strsep(&x, z):NULL); if(y==NULL && f) wquit("ERROR: Missing ACL parameters on configuration file\n")
 
 static pthread_mutex_t mtx;
 static STAILQ_HEAD(, acl_t) acl_list;
 
+// verdict for unclassified domains under the fail-closed policy
+static struct acl_t acl_failclosed = { .type1 = ACL_ANYNETWORK, .type2 = ACL_CATEGORIZED, .action = T_DENY };
+
+// verdict waits for a background classification
+static struct acl_t acl_pending = { .type1 = ACL_ANYNETWORK, .type2 = ACL_CATEGORIZED, .action = T_PENDING };
+
+enum classify_results
+{
+    CLASSIFY_FAILED,
+    CLASSIFY_DONE,
+    CLASSIFY_PENDING
+};
+
 in_addr_t netmask(int prefix)
 {
     return htonl(0xffffffff << (32-prefix));
@@ -217,6 +235,23 @@ void parse_acl(char *line)
         wlog(LOG_LVL2, "ADD entry mark data: %s, value: %d\n", token, entry->mark);
     }
     else
+    if(!strcmp(token, "group"))
+    {
+#ifdef _NO_DATABASE
+        wquit("Group ACLs need the report database\n");
+#endif
+        GET_TOKEN(acl, token, " ", true);
+        wlog(LOG_LVL2, "acl type1 is client group\n");
+
+        entry->type1 = ACL_GROUP;
+        entry->group = strtoul(token, NULL, 0);
+
+        if(entry->group==0)
+            wquit("Invalid ACL group [%s]\n", token);
+
+        wlog(LOG_LVL2, "ADD entry group: %u\n", entry->group);
+    }
+    else
     if(!strcmp(token, "anynetwork"))
     {
         wlog(LOG_LVL2, "acl type1 is any network\n");
@@ -334,15 +369,101 @@ void parse_acl(char *line)
     STAILQ_INSERT_TAIL(&acl_list, entry, next);
 }
 
+// classification is unavailable, no ACL matches when failing open
+static struct acl_t *acl_failure(char *domain, int mode)
+{
+    if(mode==ACL_DEADLINE && config.deadlinepolicy!=DEADLINE_LAST)
+    {
+        wlog(LOG_LVL2, "Domain %s missed its deadline, %s\n", domain, config.deadlinepolicy==DEADLINE_DENY?"denied":"allowed");
+
+        return config.deadlinepolicy==DEADLINE_DENY?&acl_failclosed:NULL;
+    }
+
+    wlog(LOG_LVL2, "Domain %s unclassified, failing %s\n", domain, config.failpolicy==FAIL_CLOSED?"closed":"open");
+
+    return config.failpolicy==FAIL_CLOSED?&acl_failclosed:NULL;
+}
+
+// classify a key through cache or server
+static int acl_classify(queueinfo_t *qinfo, struct cache_t *cache_entry, char *key, int type, int mode)
+{
+    // try to locate a cached result
+    if(cache_lookup(key, cache_entry))
+    {
+        wlog(LOG_LVL3, "In cache entry %s -> %s\n", key, cache_entry->category);
+
+        // entry is cached, but is a missed response from classification server.
+        // it gets reclassified in background, never on the packet path
+        if(cache_entry->category[0]=='Y' && cache_entry->category[1]=='Y')
+        {
+            retry_schedule(cache_entry->hash, key);
+            return plugin_lookup(key, cache_entry, PLUGIN_AFTER)?CLASSIFY_DONE:CLASSIFY_FAILED;
+        }
+
+        return CLASSIFY_DONE;
+    }
+
+    // in-process classifiers answer before the server is ever involved
+    if(plugin_lookup(key, cache_entry, PLUGIN_BEFORE))
+        return CLASSIFY_DONE;
+
+    if(plugin_only())
+        return CLASSIFY_FAILED;
+
+    // lookup is still running past the deadline, an expired entry is
+    // better than no answer. missed responses are no answer either
+    if(mode==ACL_DEADLINE)
+    {
+        if(plugin_lookup(key, cache_entry, PLUGIN_AFTER))
+            return CLASSIFY_DONE;
+
+        if(config.deadlinepolicy==DEADLINE_LAST && cache_stale(cache_entry) &&
+           !(cache_entry->category[0]=='Y' && cache_entry->category[1]=='Y'))
+        {
+            wlog(LOG_LVL3, "Last known entry %s -> %s\n", key, cache_entry->category);
+            return CLASSIFY_DONE;
+        }
+
+        return CLASSIFY_FAILED;
+    }
+
+    // domain is known to be failing, dont hit the server again. after a
+    // background lookup the engine already queued failures for retry
+    if(mode==ACL_CACHED || retry_pending(cache_entry->hash))
+        return plugin_lookup(key, cache_entry, PLUGIN_AFTER)?CLASSIFY_DONE:CLASSIFY_FAILED;
+
+    if(type==KEY_NAME)
+        domain_miss(key);
+
+    if(mode==ACL_ASYNC)
+        return CLASSIFY_PENDING;
+
+    // lookup category on server
+    if(perform_lookup(qinfo, cache_entry, key))
+    {
+        cache_insert(cache_entry);
+        wlog(LOG_LVL3, "CFS Response: %s -> [%s]\n", key, cache_entry->category);
+
+        return CLASSIFY_DONE;
+    }
+
+    // dont cache server missed records
+    wlog(LOG_LVL2, "Failed to perform a server lookup\n");
+
+    retry_schedule(cache_entry->hash, key);
+    return plugin_lookup(key, cache_entry, PLUGIN_AFTER)?CLASSIFY_DONE:CLASSIFY_FAILED;
+}
+
 //! scan acl list and return matched entry, if any.
-struct acl_t *acl_check(struct iphdr *ip, uint32_t nfmark, queueinfo_t *qinfo, char *domain)
+struct acl_t *acl_check(struct iphdr *ip, uint32_t nfmark, queueinfo_t *qinfo, char *domain, int mode, char *pending, const char **category)
 {
-    struct cache_t *cache_entry;
+    struct cache_t cache_entry;
     struct acl_t *entry;
     struct in_addr *src;
     struct category_t *cats;
 
     src = (struct in_addr *)&ip->daddr;
+    *category = NULL;
 
     // loop acl linked list
     STAILQ_FOREACH(entry, &acl_list, next)
@@ -376,6 +497,20 @@ struct acl_t *acl_check(struct iphdr *ip, uint32_t nfmark, queueinfo_t *qinfo, c
                 continue;
             }
         }
+#ifndef _NO_DATABASE
+        else
+        if(entry->type1==ACL_GROUP)
+        {
+            uint32_t group = group_lookup(src->s_addr);
+
+            wlog(LOG_LVL3, "Current ACL type1 is ACL_GROUP\n");
+
+            if(group==entry->group)
+                wlog(LOG_LVL3, "ACL_GROUP: [%s] is in group %u\n", inet_ntoa(*src), group);
+            else
+                continue;
+        }
+#endif
         else
         if(entry->type1==ACL_ANYNETWORK)
         {
@@ -409,62 +544,38 @@ struct acl_t *acl_check(struct iphdr *ip, uint32_t nfmark, queueinfo_t *qinfo, c
             if(!config.validlicense)
                 continue;
 
-            // try to locate a cached result, or allocate a new one
-            cache_entry = cache_lookup(domain);
+            char key[256];
+            int type = domain_key(domain, key, sizeof(key));
+            int rc = acl_classify(qinfo, &cache_entry, key, type, mode);
 
-            if(cache_entry->category!=NULL && cache_entry->hash!=NULL)
+            // registrable category is too broad, classify the full name
+            if(rc==CLASSIFY_DONE && type==KEY_REGISTRABLE && domain_exact(cache_entry.category))
             {
-                wlog(LOG_LVL3, "In cache entry %s -> %s\n", domain, cache_entry->category);
-
-                // entry is cached, but is a missed response from classification server
-                if(cache_entry->category[0]=='Y' && cache_entry->category[1]=='Y')
-                {
-                    free(cache_entry->category);
-
-                    if(perform_lookup(qinfo, cache_entry, domain))
-                        wlog(LOG_LVL3, "CFS Reclassify Response: %s -> [%s]\n", domain, cache_entry->category);
-                    else
-                    {
-                        cache_entry->category = strdup("YY");
-                        wlog(LOG_LVL3, "CFS Reclassify Failed: %s -> [%s]\n", domain, cache_entry->category);
-
-                        // locate a new server to connect
-                        curl_init(qinfo, true);
-                        return NULL;
-                    }
-                }
+                domain_normalize(domain, key, sizeof(key));
+                rc = acl_classify(qinfo, &cache_entry, key, KEY_NAME, mode);
             }
-            else
-            {
-                // lookup category on server
-                if(perform_lookup(qinfo, cache_entry, domain))
-                {
-                    cache_insert(cache_entry);
-                    wlog(LOG_LVL3, "CFS Response: %s -> [%s]\n", domain, cache_entry->category);
-                }
-                else
-                {
-                    // dont cache server missed records
-                    free(cache_entry);
-
-                    wlog(LOG_LVL2, "Failed to perform a server lookup\n");
-
-                    // locate a new server to connect
-                    curl_init(qinfo, true);
 
-                    return NULL;
-                }
+            if(rc==CLASSIFY_PENDING)
+            {
+                strlcpy(pending, key, 256);
+                return &acl_pending;
             }
 
+            if(rc==CLASSIFY_FAILED)
+                return acl_failure(domain, mode);
+
             bool found = false;
-            assert(cache_entry->category != NULL);
+            assert(cache_entry.category != NULL);
+
+            // interned, it outlives the cache entry
+            *category = cache_entry.category;
 
             SLIST_FOREACH(cats, &entry->category_list, next)
             {
                 // TODO: better rewrite this code
-                if(strcasestr(cache_entry->category, cats->category)!=NULL)
+                if(strcasestr(cache_entry.category, cats->category)!=NULL)
                 {
-                    wlog(LOG_LVL2, "ACL_CATEGORIZED: string [%s] matched [%s]\n", domain, cache_entry->category);
+                    wlog(LOG_LVL2, "ACL_CATEGORIZED: string [%s] matched [%s]\n", domain, cache_entry.category);
                     found = true;
 
                     // stop inner slist loop
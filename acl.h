@@ -48,7 +48,8 @@ enum acltypes_1
     ACL_ANYNETWORK,
     ACL_IPADDR,
     ACL_MARK,
-    ACL_TIME
+    ACL_TIME,
+    ACL_GROUP
 };
 
 enum acltypes_2
@@ -64,7 +65,17 @@ enum aclrules
     T_REDIRECT,
     T_NOMATCH,
     T_IGNORE,
-    T_INVALID
+    T_INVALID,
+    T_PENDING
+};
+
+// how acl_check() classifies domains missing from the cache
+enum aclmodes
+{
+    ACL_SYNC,           // lookup inline
+    ACL_ASYNC,          // return T_PENDING with the domain to classify
+    ACL_CACHED,         // cache only, misses fail
+    ACL_DEADLINE        // cache only, misses get the deadline policy
 };
 
 struct category_t
@@ -84,6 +95,7 @@ struct acl_t
     void *data2;
 
     uint32_t mark;
+    uint32_t group;
     time_t time1;
     time_t time2;
 
@@ -99,7 +111,8 @@ void acl_init();
 
 void parse_acl(char *acl);
 
-struct acl_t *acl_check(struct iphdr *ip, uint32_t nfmark, queueinfo_t *qinfo, char *domain);
+// category is set to the classification of domain when an ACL needed one
+struct acl_t *acl_check(struct iphdr *ip, uint32_t nfmark, queueinfo_t *qinfo, char *domain, int mode, char *pending, const char **category);
 
 #ifdef	__cplusplus
 }
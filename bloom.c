@@ -0,0 +1,104 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "utils.h"
+
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_HASHES 7
+
+/*
+ * 
+ */
+
+// double hashing from the digest bytes not used by cache and store indexes
+static inline void bloom_hashes(const unsigned char *hash, uint32_t *h1, uint32_t *h2)
+{
+    memcpy(h1, hash+8, sizeof(*h1));
+    memcpy(h2, hash+12, sizeof(*h2));
+
+    *h2 |= 1;
+}
+
+bloom_t *bloom_create(uint32_t entries)
+{
+    bloom_t *bf;
+    uint64_t nbits;
+
+    if((bf = calloc(sizeof(*bf), 1))==NULL)
+        wquit("bloom_t malloc() failed.\n");
+
+    for(nbits = 64; nbits<(uint64_t)entries*BLOOM_BITS_PER_ENTRY && nbits<(1ULL<<32); nbits <<= 1);
+
+    if((bf->bits = calloc(nbits/64, sizeof(uint64_t)))==NULL)
+        wquit("bloom_t bits malloc() failed.\n");
+
+    bf->mask = nbits-1;
+    bf->k = BLOOM_HASHES;
+
+    wlog(LOG_LVL3, "Bloom filter init, %u entries, %lu bytes\n", entries, (unsigned long)(nbits/8));
+
+    return bf;
+}
+
+void bloom_free(bloom_t *bf)
+{
+    free(bf->bits);
+    free(bf);
+}
+
+void bloom_add(bloom_t *bf, const unsigned char *hash)
+{
+    uint32_t h1, h2, bit;
+
+    bloom_hashes(hash, &h1, &h2);
+
+    for(int i=0; i<bf->k; i++)
+    {
+        bit = (h1+i*h2) & bf->mask;
+        __atomic_fetch_or(&bf->bits[bit>>6], 1ULL<<(bit&63), __ATOMIC_RELAXED);
+    }
+}
+
+bool bloom_check(bloom_t *bf, const unsigned char *hash)
+{
+    uint32_t h1, h2, bit;
+
+    bloom_hashes(hash, &h1, &h2);
+
+    for(int i=0; i<bf->k; i++)
+    {
+        bit = (h1+i*h2) & bf->mask;
+
+        if(!(__atomic_load_n(&bf->bits[bit>>6], __ATOMIC_RELAXED) & (1ULL<<(bit&63))))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,59 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "md5.h"
+
+#ifndef BLOOM_H
+#define	BLOOM_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// bloom filter over md5 digests, safe for concurrent add and check
+typedef struct
+{
+    uint64_t *bits;
+    uint32_t mask;      // bit count - 1
+    int k;
+} bloom_t;
+
+// sized for about 1% false positives at the given number of entries
+bloom_t *bloom_create(uint32_t entries);
+
+void bloom_free(bloom_t *bf);
+
+void bloom_add(bloom_t *bf, const unsigned char *hash);
+
+bool bloom_check(bloom_t *bf, const unsigned char *hash);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BLOOM_H */
+
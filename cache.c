@@ -25,26 +25,57 @@ SOFTWARE.
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #ifndef _NO_DATABASE
 #include <sqlite3.h>
 #endif
 
 #include "cache.h"
+#include "store.h"
+#include "bloom.h"
+#include "shared.h"
+#include "refresh.h"
+#include "peer.h"
+#include "domain.h"
+#include "epoch.h"
 #include "md5.h"
 #include "utils.h"
 #include "config.h"
 
+#define CACHE_BUCKETS 16384     // must be a power of two
+#define CACHE_MAX_ENTRIES 10000
+#define CACHE_EXPIRE 604800     // seconds a persisted record stays valid
+#define CACHE_SLAB_NODES 1024
+#define CACHE_LIMBO_NODES 256   // replaced nodes retired together
+#define CACHE_CATEGORIES 1024   // distinct category strings, ids fit 16 bits
+#define CACHE_REMOTE 0x8000     // node category flag, learned from a peer
+
+#define CACHE_PENDING_BUCKETS 1024
+#define CACHE_BATCH_SIZE 512    // defaults for cache_batch_size/cache_batch_time
+#define CACHE_BATCH_MSEC 1000
+#define CACHE_WARMUP_CHUNK 256  // rows loaded per writer lock
+#define CACHE_BLOOM_ENTRIES 1048576
+#define CACHE_L1_SLOTS 256      // per thread, must be a power of two
+
 #ifndef _NO_DATABASE
 sqlite3 *db;
+sqlite3 *wdb;                   // write-behind connection, owned by cache_writer()
 sqlite3_stmt *insert;
 sqlite3_stmt *sselect;
 sqlite3_stmt *sstats;
+sqlite3_stmt *sversion;
 
 static const char *ins = "replace into cache(hash,category,stamp) values(?,?,strftime('%s','now'))";
-static const char *sel = "select category from cache where hash=? and (strftime('%s','now')-stamp)<604800";
+static const char *sel = "select category,stamp from cache where hash=? and (strftime('%s','now')-stamp)<604800";
 static const char *stats = "select count(id) from cache";
+static const char *version = "pragma user_version";    // bumped by dnsfilter-import
+static const char *warm = "select hash,category,stamp from cache where stamp>strftime('%s','now')-604800 order by stamp desc limit ?";
+static const char *hashes = "select hash from cache where (strftime('%s','now')-stamp)<604800";
 
 static const char *sql = "PRAGMA journal_mode=WAL; " \
                          "CREATE TABLE IF NOT EXISTS cache ( " \
@@ -52,94 +83,1194 @@ static const char *sql = "PRAGMA journal_mode=WAL; " \
                          "       hash      BLOB NOT NULL, " \
                          "       category  TEXT NOT NULL, " \
                          "       stamp     INTEGER NOT NULL); " \
-                         "CREATE UNIQUE INDEX IF NOT EXISTS idx_hash ON cache(hash);";
+                         "CREATE UNIQUE INDEX IF NOT EXISTS idx_hash ON cache(hash); " \
+                         "CREATE INDEX IF NOT EXISTS idx_stamp ON cache(stamp);";
 #endif
 
+// table node, immutable once published. only the chain link is changed by
+// writers, so readers walking a bucket never see a half built entry.
+struct cache_node
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    uint32_t stamp;             // classification time
+    uint16_t category;          // interned category id
+    uint16_t hits;              // counts up to refresh_hits, then stays
+    struct cache_node *next;
+};
+
+// nodes are carved from slabs and only released with their table
+struct cache_slab
+{
+    struct cache_slab *next;
+    uint32_t used;
+    struct cache_node nodes[CACHE_SLAB_NODES];
+};
+
+// replaced nodes wait here until no reader can still hold them, then
+// node_alloc() hands their slots out again
+struct cache_limbo
+{
+    struct cache_limbo *next;
+    uint64_t retired;           // 0 while it is still filling
+    uint32_t count;
+    struct cache_node *nodes[CACHE_LIMBO_NODES];
+};
+
+// one table generation. an overflow flush publishes a new table and
+// retires the old one as a whole, slabs included
+struct cache_table
+{
+    struct cache_node *buckets[CACHE_BUCKETS];
+    struct cache_slab *slabs;
+    uint32_t nslabs;
+    struct cache_node *free;    // reusable slots, chained by next
+    struct cache_limbo *limbo;  // newest first
+
+    // reclaim list, valid after the table was replaced
+    uint64_t retired;
+    struct cache_table *free_next;
+};
+
+// hits on peer sourced entries, per epoch slot to avoid sharing cachelines
+struct cache_remote
+{
+    uint64_t hits;
+    char pad[64-sizeof(uint64_t)];
+};
+
+// writers (insert, overflow, database access) serialize on this mutex,
+// lookups that hit memory never touch it
 static pthread_mutex_t mtx;
 
-static SLIST_HEAD(, cache_t) cache_entries;
+static struct cache_table *table;
+static struct cache_table *retired;
+
+static struct cache_remote remote[EPOCH_READERS] __attribute__((aligned(64)));
+static uint32_t entries;
+
+// per thread direct mapped copy of recent hits, checked before the shared
+// table. entries of an older generation are ignored
+struct cache_l1
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    uint32_t stamp;
+    uint32_t generation;
+    uint16_t category;
+};
+
+static __thread struct cache_l1 l1[CACHE_L1_SLOTS];
+
+// bumped when the shared table is replaced or a category changes
+static uint32_t generation = 1;
+
+// interned categories, append only. ids are published after their string
+static const char *categories[CACHE_CATEGORIES];
+static uint16_t category_index[CACHE_CATEGORIES*2];     // id+1, 0 is empty
+static uint32_t ncategories;
+static pthread_mutex_t category_mtx;
+static bool categories_full;
+
+// answer while the category table is full, never cached
+static const char *category_unknown = "unknown";
+
+// replaced node slots handed out again
+static uint32_t reused;
+
+// mmap engine, NULL when records are persisted to SQLite
+static store_t *store;
+
+// segment shared with the other dnsfilter processes of this host
+static shared_t *shared;
+static uint32_t shared_hits;
+static bool persist;
+
+// record waiting to be persisted, coalesced by hash
+struct cache_pending
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    uint16_t category;
+    struct cache_pending *next;
+};
+
+static pthread_t writer;
+static pthread_mutex_t pending_mtx;
+static pthread_cond_t pending_cond;
+
+// double buffered, the writer thread commits one table while the other fills
+static struct cache_pending *pending[2][CACHE_PENDING_BUCKETS];
+static int pending_cur;
+static int npending;
+static bool writer_quit;
+
+static pthread_t warmer;
+static bool warmup_running;
+static bool warmup_quit;
+static uint32_t warmup_loaded;
+static double warmup_time;
+
+// definite database misses are answered without touching cache.db. NULL
+// while the filter is built, records inserted meanwhile go to bloom_next
+static bloom_t *bloom;
+static bloom_t *bloom_next;
+#ifndef _NO_DATABASE
+static pthread_t bloomer;
+static bool bloom_enabled;
+static bool bloom_quit;
+static bloom_t *bloom_old;      // replaced filter, freed by the next build
+static uint64_t bloom_retired;
+static uint64_t bloom_avoided;
+static uint64_t bloom_passed;
+static uint64_t bloom_false;
+static int bloom_version;       // cache.db user_version the filter was built from
+#endif
 
 /*
  * 
  */
 
-void cache_init()
+static inline uint32_t bucket_index(const unsigned char *hash)
+{
+    uint32_t idx;
+
+    // md5 output is already uniform, use the first bytes as bucket index
+    memcpy(&idx, hash, sizeof(idx));
+
+    return idx & (CACHE_BUCKETS-1);
+}
+
+static inline uint32_t category_hash(const char *category)
+{
+    uint32_t h = 2166136261u;
+
+    while(*category)
+    {
+        h ^= (uint8_t)*category++;
+        h *= 16777619;
+    }
+
+    return h & (CACHE_CATEGORIES*2-1);
+}
+
+// lock free, returns -1 if the category was never interned
+static int category_find(const char *category)
+{
+    uint32_t idx = category_hash(category);
+    uint16_t id;
+
+    while((id = __atomic_load_n(&category_index[idx], __ATOMIC_ACQUIRE))!=0)
+    {
+        if(!strcmp(categories[id-1], category))
+            return id-1;
+
+        idx = (idx+1) & (CACHE_CATEGORIES*2-1);
+    }
+
+    return -1;
+}
+
+static int category_id(const char *category)
+{
+    uint32_t idx;
+    int id;
+
+    if((id = category_find(category))>=0)
+        return id;
+
+    pthread_mutex_lock(&category_mtx);
+
+    // somebody else may have added it meanwhile
+    if((id = category_find(category))<0 && ncategories<CACHE_CATEGORIES)
+    {
+        id = ncategories++;
+        categories[id] = strdup(category);
+
+        for(idx = category_hash(category); category_index[idx]!=0; idx = (idx+1) & (CACHE_CATEGORIES*2-1));
+
+        __atomic_store_n(&category_index[idx], id+1, __ATOMIC_RELEASE);
+
+        wlog(LOG_LVL4, "Category [%s] interned as %d\n", category, id);
+    }
+
+    // loud once, the server keeps sending categories we cannot cache
+    if(id<0 && !categories_full)
+    {
+        categories_full = true;
+        wlog(LOG_ERROR, "Category table full at %d categories, new ones are classified as %s and not cached\n",
+                CACHE_CATEGORIES, category_unknown);
+    }
+
+    pthread_mutex_unlock(&category_mtx);
+
+    if(id<0)
+        wlog(LOG_LVL3, "Category table full, [%s] not cached\n", category);
+
+    return id;
+}
+
+static inline void remote_hit()
+{
+    int n = epoch_slot();
+
+    __atomic_store_n(&remote[n].hits, remote[n].hits+1, __ATOMIC_RELAXED);
+}
+
+static struct cache_node *node_find(const unsigned char *hash)
+{
+    struct cache_table *t;
+    struct cache_node *node;
+
+    t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    node = __atomic_load_n(&t->buckets[bucket_index(hash)], __ATOMIC_ACQUIRE);
+
+    while(node!=NULL)
+    {
+        if(memcmp(hash, node->hash, MD5_DIGEST_LENGTH)==0)
+            return node;
+
+        node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    }
+
+    return NULL;
+}
+
+static struct cache_table *table_alloc()
+{
+    struct cache_table *t;
+
+    if((t = calloc(sizeof(*t), 1))==NULL)
+        wquit("cache_table malloc() failed.\n");
+
+    return t;
+}
+
+static void table_free(struct cache_table *t)
+{
+    struct cache_slab *slab;
+    struct cache_limbo *l;
+
+    // bulk release, nodes own no memory of their own
+    while((slab = t->slabs)!=NULL)
+    {
+        t->slabs = slab->next;
+        free(slab);
+    }
+
+    while((l = t->limbo)!=NULL)
+    {
+        t->limbo = l->next;
+        free(l);
+    }
+
+    free(t);
+}
+
+// free retired tables no reader can still reference. called with mtx held
+static void reclaim()
+{
+    struct cache_table **prev, *t;
+    uint64_t oldest;
+
+    if(retired==NULL)
+        return;
+
+    oldest = epoch_oldest();
+    prev = &retired;
+
+    while((t = *prev)!=NULL)
+    {
+        if(t->retired<oldest)
+        {
+            *prev = t->free_next;
+            table_free(t);
+        }
+        else
+            prev = &t->free_next;
+    }
+}
+
+// park a node unlinked from the current table, called with mtx held
+static void node_retire(struct cache_node *node)
+{
+    struct cache_limbo *l = table->limbo;
+
+    if(l==NULL || l->retired!=0)
+    {
+        if((l = malloc(sizeof(*l)))==NULL)
+            wquit("cache_limbo malloc() failed.\n");
+
+        l->retired = 0;
+        l->count = 0;
+        l->next = table->limbo;
+        table->limbo = l;
+    }
+
+    l->nodes[l->count++] = node;
+
+    // readers entering from now on cannot reach any node of the batch
+    if(l->count==CACHE_LIMBO_NODES)
+        l->retired = epoch_retire();
+}
+
+// move batches no reader can reference to the free list, called with mtx held
+static void limbo_reclaim()
 {
-    SLIST_INIT(&cache_entries);
+    struct cache_limbo **prev, *l;
+    uint64_t oldest = 0;
+    uint32_t i;
+
+    for(prev = &table->limbo; (l = *prev)!=NULL;)
+    {
+        if(l->retired==0)
+        {
+            prev = &l->next;
+            continue;
+        }
 
+        // readers are only scanned when a batch is waiting
+        if(oldest==0)
+            oldest = epoch_oldest();
+
+        if(l->retired>=oldest)
+        {
+            prev = &l->next;
+            continue;
+        }
+
+        for(i=0; i<l->count; i++)
+        {
+            l->nodes[i]->next = table->free;
+            table->free = l->nodes[i];
+        }
+
+        *prev = l->next;
+        free(l);
+    }
+}
+
+static struct cache_node *node_alloc()
+{
+    struct cache_slab *slab = table->slabs;
+    struct cache_node *node;
+
+    // replaced slots first, a new slab only when none is free
+    if(table->free==NULL && (slab==NULL || slab->used>=CACHE_SLAB_NODES))
+        limbo_reclaim();
+
+    if((node = table->free)!=NULL)
+    {
+        table->free = node->next;
+        reused++;
+
+        return node;
+    }
+
+    if(slab==NULL || slab->used>=CACHE_SLAB_NODES)
+    {
+        if((slab = malloc(sizeof(*slab)))==NULL)
+            wquit("cache_slab malloc() failed.\n");
+
+        slab->used = 0;
+        slab->next = table->slabs;
+        table->slabs = slab;
+        table->nslabs++;
+    }
+
+    return &slab->nodes[slab->used++];
+}
+
+// insert or replace a node, called with mtx held
+static void node_insert(const unsigned char *hash, uint16_t id, uint32_t stamp)
+{
+    struct cache_node *node, *old, **prev;
+    uint32_t idx = bucket_index(hash);
+
+    node = node_alloc();
+
+    memcpy(node->hash, hash, MD5_DIGEST_LENGTH);
+    node->category = id;
+    node->stamp = stamp;
+    node->hits = 0;
+    node->next = table->buckets[idx];
+
+    // publish the new head, readers see either the old or the new chain
+    __atomic_store_n(&table->buckets[idx], node, __ATOMIC_RELEASE);
+
+    // unlink a previous value of the same key, its slot is reused once
+    // readers are done with it
+    for(prev = &node->next; (old = *prev)!=NULL; prev = &old->next)
+    {
+        if(memcmp(hash, old->hash, MD5_DIGEST_LENGTH)==0)
+        {
+            __atomic_store_n(prev, old->next, __ATOMIC_RELEASE);
+            node_retire(old);
+
+            // thread caches may hold the old category
+            if((old->category & ~CACHE_REMOTE)!=(id & ~CACHE_REMOTE))
+                __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+
+    __atomic_fetch_add(&entries, 1, __ATOMIC_RELAXED);
+}
+
+// replace the table, memory is released once readers are done with it
+static void table_clear()
+{
+    struct cache_table *old = table;
+
+    __atomic_store_n(&table, table_alloc(), __ATOMIC_RELEASE);
+    __atomic_store_n(&entries, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+
+    old->retired = epoch_retire();
+    old->free_next = retired;
+    retired = old;
+
+    reclaim();
+}
+
+// queue a record for the writer thread, replacing an older value of same key
+static void pending_insert(const unsigned char *hash, uint16_t category)
+{
+    struct cache_pending *p;
+    struct cache_pending **tab;
+    uint32_t idx = bucket_index(hash) & (CACHE_PENDING_BUCKETS-1);
+
+    pthread_mutex_lock(&pending_mtx);
+
+    tab = pending[pending_cur];
+
+    for(p = tab[idx]; p!=NULL; p = p->next)
+    {
+        if(memcmp(hash, p->hash, MD5_DIGEST_LENGTH)==0)
+        {
+            p->category = category;
+
+            pthread_mutex_unlock(&pending_mtx);
+            return;
+        }
+    }
+
+    if((p = calloc(sizeof(*p), 1))==NULL)
+        wquit("cache_pending malloc() failed.\n");
+
+    memcpy(p->hash, hash, MD5_DIGEST_LENGTH);
+    p->category = category;
+    p->next = tab[idx];
+    tab[idx] = p;
+
+    if(++npending>=config.cachebatch)
+        pthread_cond_signal(&pending_cond);
+
+    pthread_mutex_unlock(&pending_mtx);
+}
+
+// write a swapped out pending table in a single transaction
+static void pending_commit(struct cache_pending **tab)
+{
+    struct cache_pending *p;
+    uint32_t now = time(NULL);
+    int count = 0, full = 0;
+#ifndef _NO_DATABASE
+    // CALL_SQLITE reports errors from this handle
+    sqlite3 *db = wdb;
+
+    if(store==NULL)
+        CALL_SQLITE(exec(db, "begin transaction", 0, 0, NULL));
+#endif
+
+    for(int i=0; i<CACHE_PENDING_BUCKETS; i++)
+    {
+        while((p = tab[i])!=NULL)
+        {
+            tab[i] = p->next;
+
+            if(store!=NULL)
+            {
+                if(!store_insert(store, p->hash, categories[p->category], now, now-CACHE_EXPIRE))
+                    full++;
+            }
 #ifndef _NO_DATABASE
-    wlog(LOG_LVL4, "SQLite3 %s database init\n", sqlite3_libversion());
+            else
+            {
+                CALL_SQLITE(bind_blob(insert, 1, p->hash, MD5_DIGEST_LENGTH, SQLITE_STATIC));
+                CALL_SQLITE(bind_text(insert, 2, categories[p->category], -1, SQLITE_STATIC));
+                CALL_SQLITE_EXPECT(step(insert), DONE);
+                CALL_SQLITE(reset(insert));
+            }
+#endif
+
+            free(p);
+            count++;
+        }
+    }
 
-    CALL_SQLITE(open_v2(config.cachedb, &db, SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL));
-    CALL_SQLITE(exec(db, sql, NULL, NULL, NULL));
+    if(store!=NULL)
+    {
+        store_sync(store);
 
-    // prepare queries
-    CALL_SQLITE(prepare_v2(db, ins, strlen(ins), &insert, NULL));
-    CALL_SQLITE(prepare_v2(db, sel, strlen(sel), &sselect, NULL));
-    CALL_SQLITE(prepare_v2(db, stats, strlen(stats), &sstats, NULL));
+        if(full>0)
+            wlog(LOG_WARN, "Cache store is full, %d records not persisted\n", full);
+    }
+#ifndef _NO_DATABASE
+    else
+        CALL_SQLITE(exec(db, "commit transaction", 0, 0, NULL));
 #endif
 
+    wlog(LOG_LVL4, "Cache writer committed %d records\n", count);
+}
+
+static void *cache_writer(void *arg)
+{
+    struct cache_pending **tab;
+    struct timespec ts;
+
+    pthread_mutex_lock(&pending_mtx);
+
+    while(1)
+    {
+        if(!writer_quit && npending<config.cachebatch)
+        {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += config.cachecommit/1000;
+            ts.tv_nsec += (config.cachecommit%1000)*1000000L;
+
+            if(ts.tv_nsec>=1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+
+            pthread_cond_timedwait(&pending_cond, &pending_mtx, &ts);
+        }
+
+        if(npending>0)
+        {
+            // swap tables, packet threads keep queueing on the other one
+            tab = pending[pending_cur];
+            pending_cur ^= 1;
+            npending = 0;
+
+            pthread_mutex_unlock(&pending_mtx);
+            pending_commit(tab);
+            pthread_mutex_lock(&pending_mtx);
+        }
+        else
+        if(writer_quit)
+            break;
+    }
+
+    pthread_mutex_unlock(&pending_mtx);
+
+    return 0;
+}
+
+// add a warm-up record, called with mtx held. returns false to stop loading
+static bool warmup_add(const unsigned char *hash, const char *category, uint32_t stamp, int *chunk)
+{
+    int id;
+
+    // never overwrite what packet threads inserted meanwhile
+    if(node_find(hash)==NULL && (id = category_id(category))>=0)
+    {
+        node_insert(hash, id, stamp);
+
+        if(++warmup_loaded>=config.cachewarmup)
+            return false;
+    }
+
+    // give writers a chance to run between chunks
+    if(++(*chunk)>=CACHE_WARMUP_CHUNK)
+    {
+        *chunk = 0;
+
+        pthread_mutex_unlock(&mtx);
+        pthread_mutex_lock(&mtx);
+
+        if(__atomic_load_n(&warmup_quit, __ATOMIC_RELAXED) ||
+           __atomic_load_n(&entries, __ATOMIC_RELAXED)>=CACHE_MAX_ENTRIES)
+            return false;
+    }
+
+    return true;
+}
+
+#ifndef _NO_DATABASE
+static void warmup_sqlite()
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    const void *hash;
+    const char *text;
+    int rc, chunk = 0;
+
+    // private read only connection, packet threads keep using theirs
+    CALL_SQLITE(open_v2(config.cachedb, &db, SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_READONLY, NULL));
+    CALL_SQLITE(prepare_v2(db, warm, strlen(warm), &stmt, NULL));
+    CALL_SQLITE(bind_int(stmt, 1, config.cachewarmup));
+
+    // the first step may do all the searching, packet threads insert meanwhile
+    rc = sqlite3_step(stmt);
+
+    pthread_mutex_lock(&mtx);
+
+    for(; rc==SQLITE_ROW; rc = sqlite3_step(stmt))
+    {
+        hash = sqlite3_column_blob(stmt, 0);
+        text = (const char *)sqlite3_column_text(stmt, 1);
+
+        if(hash==NULL || text==NULL || sqlite3_column_bytes(stmt, 0)!=MD5_DIGEST_LENGTH)
+            continue;
+
+        if(!warmup_add(hash, text, sqlite3_column_int64(stmt, 2), &chunk))
+        {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    if(rc!=SQLITE_DONE)
+        wlog(LOG_WARN, "Cache warm-up stopped: %s\n", sqlite3_errmsg(db));
+
+    CALL_SQLITE(finalize(stmt));
+    CALL_SQLITE(close(db));
+}
+#endif
+
+// the store has no ordering, load unexpired records in slot order
+static void warmup_store()
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    char category[STORE_CATEGORY_LEN];
+    uint32_t stamp, now = time(NULL);
+    int chunk = 0;
+
+    pthread_mutex_lock(&mtx);
+
+    for(uint32_t i=0; i<store->slots; i++)
+    {
+        if(!store_get(store, i, hash, category, sizeof(category), &stamp) || now-stamp>=CACHE_EXPIRE)
+            continue;
+
+        if(!warmup_add(hash, category, stamp, &chunk))
+            break;
+    }
+
+    pthread_mutex_unlock(&mtx);
+}
+
+// bulk load the freshest persisted records into memory
+static void *cache_warmup(void *arg)
+{
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(store!=NULL)
+        warmup_store();
+#ifndef _NO_DATABASE
+    else
+        warmup_sqlite();
+#endif
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    warmup_time = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+
+    wlog(LOG_LVL1, "Cache warm-up loaded %u records in %0.3f sec\n", warmup_loaded, warmup_time);
+
+    return 0;
+}
+
+#ifndef _NO_DATABASE
+// build a filter sized from cache.db and swap it in, lookups pass through
+// to cache.db until it completes
+static void *cache_bloom_build(void *arg)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    bloom_t *bf;
+    const void *hash;
+    struct timespec start, end;
+    uint32_t count = 0, rows = 0, size;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    CALL_SQLITE(open_v2(config.cachedb, &db, SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_READONLY, NULL));
+    CALL_SQLITE(prepare_v2(db, stats, strlen(stats), &stmt, NULL));
+
+    if(sqlite3_step(stmt)==SQLITE_ROW)
+        rows = sqlite3_column_int(stmt, 0);
+
+    CALL_SQLITE(finalize(stmt));
+
+    // room for a quarter more rows before false positives climb
+    size = config.cachebloom>0?config.cachebloom:CACHE_BLOOM_ENTRIES;
+
+    if(rows+rows/4>size)
+        size = rows+rows/4;
+
+    bf = bloom_create(size);
+
+    // records inserted from now on are added by cache_insert()
+    pthread_mutex_lock(&mtx);
+    bloom_next = bf;
+    pthread_mutex_unlock(&mtx);
+
+    CALL_SQLITE(prepare_v2(db, hashes, strlen(hashes), &stmt, NULL));
+
+    while((rc = sqlite3_step(stmt))==SQLITE_ROW)
+    {
+        hash = sqlite3_column_blob(stmt, 0);
+
+        if(hash!=NULL && sqlite3_column_bytes(stmt, 0)==MD5_DIGEST_LENGTH)
+        {
+            bloom_add(bf, hash);
+            count++;
+        }
+
+        if(__atomic_load_n(&bloom_quit, __ATOMIC_RELAXED))
+            break;
+    }
+
+    pthread_mutex_lock(&mtx);
+
+    bloom_next = NULL;
+
+    if(rc==SQLITE_DONE)
+        __atomic_store_n(&bloom, bf, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&mtx);
+
+    if(rc==SQLITE_DONE)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        wlog(LOG_LVL1, "Cache bloom filter built from %u records in %0.3f sec, sized for %u\n", count,
+                (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9, size);
+    }
+    else
+    {
+        if(rc!=SQLITE_ROW)
+            wlog(LOG_WARN, "Cache bloom filter build failed, disabled: %s\n", sqlite3_errmsg(db));
+
+        // only this thread and inserters under mtx ever saw it
+        bloom_free(bf);
+    }
+
+    CALL_SQLITE(finalize(stmt));
+    CALL_SQLITE(close(db));
+
+    // lookups still checking the filter this build replaced
+    if(bloom_old!=NULL)
+    {
+        while(bloom_retired>=epoch_oldest())
+            usleep(1000);
+
+        bloom_free(bloom_old);
+        bloom_old = NULL;
+    }
+
+    return 0;
+}
+#endif
+
+void cache_init()
+{
+    table = table_alloc();
+    retired = NULL;
+    reused = 0;
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    store = NULL;
+    shared = NULL;
+    shared_hits = 0;
+    bloom = NULL;
+    persist = false;
+
     pthread_mutex_init(&mtx, NULL);
+    pthread_mutex_init(&category_mtx, NULL);
+
+    if(strlen(config.cacheshm))
+    {
+        if((shared = shared_open(config.cacheshm, config.shmslots>0?config.shmslots:SHARED_DEFAULT_SLOTS))==NULL)
+            wquit("ERROR: could not open shared cache %s\n", config.cacheshm);
+    }
+
+    if(config.cacheengine==CACHE_ENGINE_MMAP)
+    {
+        if(!strlen(config.cachemmap))
+            wquit("ERROR: cache_mmap_file is required by the mmap cache engine!\n");
+
+        // another dnsfilter holding the writer lock shares its store, this
+        // one only reads it and keeps new records in memory
+        if((store = store_open(config.cachemmap, config.mmapslots>0?config.mmapslots:STORE_DEFAULT_SLOTS, true))==NULL)
+        {
+            if((store = store_open(config.cachemmap, 0, false))==NULL)
+                wquit("ERROR: could not open cache store %s\n", config.cachemmap);
+
+            wlog(LOG_LVL1, "Cache store %s opened read only, new records are not persisted\n", config.cachemmap);
+        }
+
+        persist = true;
+    }
+#ifndef _NO_DATABASE
+    else
+    {
+        wlog(LOG_LVL4, "SQLite3 %s database init\n", sqlite3_libversion());
+
+        CALL_SQLITE(open_v2(config.cachedb, &db, SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL));
+        CALL_SQLITE(exec(db, sql, NULL, NULL, NULL));
+
+        // prepare queries
+        CALL_SQLITE(prepare_v2(db, sel, strlen(sel), &sselect, NULL));
+        CALL_SQLITE(prepare_v2(db, stats, strlen(stats), &sstats, NULL));
+        CALL_SQLITE(prepare_v2(db, version, strlen(version), &sversion, NULL));
+
+        // second connection for write-behind, WAL lets both run concurrently
+        CALL_SQLITE(open_v2(config.cachedb, &wdb, SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_READWRITE, NULL));
+        CALL_SQLITE(busy_timeout(wdb, 5000));
+        CALL_SQLITE(prepare_v2(wdb, ins, strlen(ins), &insert, NULL));
+
+        // the mmap store answers misses in a few probes, only sqlite needs a filter
+        if(config.cachebloom>=0)
+        {
+            bloom = bloom_next = bloom_old = NULL;
+            bloom_enabled = true;
+            bloom_quit = false;
+            bloom_avoided = bloom_passed = bloom_false = 0;
+            bloom_version = sqlite3_step(sversion)==SQLITE_ROW?sqlite3_column_int(sversion, 0):0;
+
+            CALL_SQLITE(reset(sversion));
+
+            if(pthread_create(&bloomer, NULL, cache_bloom_build, NULL))
+                wquit("cache_bloom_build pthread_create() failed\n");
+        }
+
+        persist = true;
+    }
+#endif
+
+    if(!persist)
+        return;
+
+    if(config.cachebatch<=0)
+        config.cachebatch = CACHE_BATCH_SIZE;
+
+    if(config.cachecommit<=0)
+        config.cachecommit = CACHE_BATCH_MSEC;
+
+    memset(pending, 0, sizeof(pending));
+    pending_cur = 0;
+    npending = 0;
+    writer_quit = false;
+
+    pthread_mutex_init(&pending_mtx, NULL);
+    pthread_cond_init(&pending_cond, NULL);
+
+    if(pthread_create(&writer, NULL, cache_writer, NULL))
+        wquit("cache_writer pthread_create() failed\n");
+
+    warmup_loaded = 0;
+    warmup_time = 0;
+    warmup_quit = false;
+    warmup_running = false;
+
+    if(config.cachewarmup>0)
+    {
+        if(config.cachewarmup>CACHE_MAX_ENTRIES)
+            config.cachewarmup = CACHE_MAX_ENTRIES;
+
+        if(pthread_create(&warmer, NULL, cache_warmup, NULL))
+            wquit("cache_warmup pthread_create() failed\n");
+
+        warmup_running = true;
+    }
 }
 
+// called on shutdown, after all threads are stopped
 void cache_flush()
 {
-    struct cache_t *entry;
+    struct cache_table *t;
 
-    // remove allocated entries
-    SLIST_FOREACH(entry, &cache_entries, next)
-        if(entry->category!=NULL) free(entry->category);
+    if(persist)
+    {
+        if(warmup_running)
+        {
+            __atomic_store_n(&warmup_quit, true, __ATOMIC_RELAXED);
+            pthread_join(warmer, NULL);
+        }
 
-    // remove linked list array entries
-    while(!SLIST_EMPTY(&cache_entries))
+#ifndef _NO_DATABASE
+        if(bloom_enabled)
+        {
+            __atomic_store_n(&bloom_quit, true, __ATOMIC_RELAXED);
+            pthread_join(bloomer, NULL);
+
+            if(bloom!=NULL)
+                bloom_free(bloom);
+
+            bloom = NULL;
+            bloom_enabled = false;
+        }
+#endif
+
+        // let the writer commit everything still queued
+        pthread_mutex_lock(&pending_mtx);
+        writer_quit = true;
+        pthread_cond_signal(&pending_cond);
+        pthread_mutex_unlock(&pending_mtx);
+
+        pthread_join(writer, NULL);
+
+        pthread_mutex_destroy(&pending_mtx);
+        pthread_cond_destroy(&pending_cond);
+
+        wlog(LOG_LVL3, "Cache writer thread stopped successfully!\n");
+    }
+
+    table_free(table);
+
+    while((t = retired)!=NULL)
     {
-        entry = SLIST_FIRST(&cache_entries);
-        SLIST_REMOVE_HEAD(&cache_entries, next);
-        free(entry);
+        retired = t->free_next;
+        table_free(t);
     }
 
+    // interned strings live until shutdown
+    for(uint32_t i=0; i<ncategories; i++)
+        free((char *)categories[i]);
+
+    ncategories = 0;
+    categories_full = false;
+    memset(category_index, 0, sizeof(category_index));
+
+    if(shared!=NULL)
+    {
+        shared_close(shared);
+        shared = NULL;
+    }
+
+    if(store!=NULL)
+        store_close(store);
 #ifndef _NO_DATABASE
-    CALL_SQLITE(finalize(insert));
-    CALL_SQLITE(finalize(sselect));
-    CALL_SQLITE(finalize(sstats));
-    CALL_SQLITE(close(db));
+    else
+    if(persist)
+    {
+        CALL_SQLITE(finalize(sselect));
+        CALL_SQLITE(finalize(sstats));
+        CALL_SQLITE(finalize(sversion));
+        CALL_SQLITE(close(db));
+
+        {
+            sqlite3 *db = wdb;
+
+            CALL_SQLITE(finalize(insert));
+            CALL_SQLITE(close(db));
+        }
+    }
 #endif
 
     // destroy thread mutex
     pthread_mutex_destroy(&mtx);
+    pthread_mutex_destroy(&category_mtx);
 }
 
-// lookup a cached value in memory
-struct cache_t *cache_lookup(char *domain)
+const char *cache_category(const char *category)
 {
-    struct cache_t *entry;
-    unsigned char digest[MD5_DIGEST_LENGTH];
-    const char *text;
-    MD5_CTX ctx;
+    int id = category_id(category);
 
-    // init md5 context
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, (void *)domain, strlen(domain));
-    MD5_Final(digest, &ctx);
+    return id<0?category_unknown:categories[id];
+}
 
-    // protect code from thread race
-    pthread_mutex_lock(&mtx);
+//! called from threaded code!
+int cache_category_id(const char *category)
+{
+    return category_id(category);
+}
+
+//! called from threaded code!
+const char *cache_category_name(int id)
+{
+    return id>=0 && id<__atomic_load_n(&ncategories, __ATOMIC_ACQUIRE)?categories[id]:NULL;
+}
+
+// count a hit, stops writing to the node once it is considered popular
+static inline uint16_t node_hit(struct cache_node *node)
+{
+    uint16_t hits = __atomic_load_n(&node->hits, __ATOMIC_RELAXED);
+
+    if(hits<config.refreshhits)
+        hits = __atomic_add_fetch(&node->hits, 1, __ATOMIC_RELAXED);
+
+    return hits;
+}
+
+// lookup a cached value in memory, falling back to database cache
+bool cache_lookup(char *domain, struct cache_t *entry)
+{
+    struct cache_node *node;
+    struct cache_l1 *slot;
+    uint32_t stamp = 0, age, gen, idx;
+    uint16_t hits = 0, cid = 0;
+
+    domain_digest(domain, entry->hash);
+
+    entry->category = NULL;
 
-    // scan memory for hash
-    SLIST_FOREACH(entry, &cache_entries, next)
+    // thread local, no synchronization besides the generation check
+    memcpy(&idx, entry->hash, sizeof(idx));
+    slot = &l1[idx & (CACHE_L1_SLOTS-1)];
+    gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+    // near expiry the shared path decides about refresh or expiration
+    if(slot->generation==gen && memcmp(slot->hash, entry->hash, MD5_DIGEST_LENGTH)==0 &&
+       time(NULL)-slot->stamp+config.refreshahead<CACHE_EXPIRE)
     {
-        if(memcmp(digest, entry->hash, MD5_DIGEST_LENGTH)==0)
-            goto found;
+        entry->category = categories[slot->category & ~CACHE_REMOTE];
+
+        if(slot->category & CACHE_REMOTE)
+            remote_hit();
+
+        return true;
     }
 
-    // alloc a new entry on cache slist
-    if((entry = calloc(sizeof(*entry),1))==NULL)
-        wquit("cache_t malloc() failed.\n");
+    // lock free memory scan
+    epoch_enter();
 
-    entry->category = NULL;
-    memcpy(entry->hash, digest, MD5_DIGEST_LENGTH);
+    if((node = node_find(entry->hash))!=NULL)
+    {
+        entry->category = categories[node->category & ~CACHE_REMOTE];
+        cid = node->category;
+        stamp = node->stamp;
+
+        if(cid & CACHE_REMOTE)
+            remote_hit();
+
+        if(config.refreshahead>0)
+            hits = node_hit(node);
+    }
+
+    epoch_exit();
+
+    if(entry->category!=NULL)
+    {
+        age = time(NULL)-stamp;
+
+        if(age+config.refreshahead<CACHE_EXPIRE)
+        {
+            // once popular, hits are no longer counted by the shared node
+            if(config.refreshahead<=0 || hits>=config.refreshhits)
+            {
+                memcpy(slot->hash, entry->hash, MD5_DIGEST_LENGTH);
+                slot->stamp = stamp;
+                slot->category = cid;
+
+                // generation read before the shared lookup, a concurrent
+                // change leaves this slot already invalid
+                slot->generation = gen;
+            }
+
+            return true;
+        }
+
+        // popular entries are refreshed in background, the old value is
+        // served until the new one replaces it, at most refresh_ahead
+        // seconds past expiry
+        if(config.refreshahead>0 && hits>=config.refreshhits && age<CACHE_EXPIRE+config.refreshahead &&
+           refresh_schedule(entry->hash, domain))
+            return true;
+
+        if(age<CACHE_EXPIRE)
+            return true;
+
+        // expired, persisted copies are at least as old
+        entry->category = NULL;
+        return false;
+    }
+
+    if(shared!=NULL)
+    {
+        char category[SHARED_CATEGORY_LEN];
+        uint32_t stamp;
+        int id;
+
+        // lock free, possibly classified by another process
+        if(shared_lookup(shared, entry->hash, category, sizeof(category), &stamp) && time(NULL)-stamp<CACHE_EXPIRE &&
+           (id = category_id(category))>=0)
+        {
+            entry->category = categories[id];
+
+            pthread_mutex_lock(&mtx);
+            node_insert(entry->hash, id, stamp);
+            pthread_mutex_unlock(&mtx);
+
+            __atomic_fetch_add(&shared_hits, 1, __ATOMIC_RELAXED);
+            wlog(LOG_LVL4, "Shared record %s hit: %s\n", dump_hexdigest(entry->hash), entry->category);
+
+            return true;
+        }
+    }
+
+    if(store!=NULL)
+    {
+        char category[STORE_CATEGORY_LEN];
+        uint32_t stamp;
+        int id;
+
+        // lock free, the store is read straight from the mapping
+        if(store_lookup(store, entry->hash, category, sizeof(category), &stamp) && time(NULL)-stamp<CACHE_EXPIRE &&
+           (id = category_id(category))>=0)
+        {
+            entry->category = categories[id];
+
+            // keep record in memory
+            pthread_mutex_lock(&mtx);
+            node_insert(entry->hash, id, stamp);
+            pthread_mutex_unlock(&mtx);
+
+            if(shared!=NULL)
+                shared_insert(shared, entry->hash, entry->category, stamp, time(NULL)-CACHE_EXPIRE);
+
+            wlog(LOG_LVL4, "Stored record %s hit: %s\n", dump_hexdigest(entry->hash), entry->category);
+        }
+
+        return entry->category!=NULL;
+    }
 
 #ifndef _NO_DATABASE
+    const char *text;
+    bool filtered = false;
+    uint32_t dbstamp = 0;
+    int id;
+
+    bloom_t *bf;
+    bool absent = false;
+
+    // a rebuild frees the filter it replaces once readers are gone
+    epoch_enter();
+
+    if((bf = __atomic_load_n(&bloom, __ATOMIC_ACQUIRE))!=NULL)
+    {
+        absent = !bloom_check(bf, entry->hash);
+        filtered = true;
+    }
+
+    epoch_exit();
+
+    if(absent)
+    {
+        __atomic_fetch_add(&bloom_avoided, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if(filtered)
+        __atomic_fetch_add(&bloom_passed, 1, __ATOMIC_RELAXED);
+
+    // database handle is shared with writers
+    pthread_mutex_lock(&mtx);
+
     // scan database cache
     CALL_SQLITE(bind_blob(sselect, 1, entry->hash, MD5_DIGEST_LENGTH, SQLITE_TRANSIENT));
 
@@ -147,81 +1278,210 @@ struct cache_t *cache_lookup(char *domain)
     if(sqlite3_step(sselect)==SQLITE_ROW)
     {
         text = (const char *)sqlite3_column_text(sselect, 0);
-        entry->category = strdup(text);
 
-        // insert record on liked list
-        SLIST_INSERT_HEAD(&cache_entries, entry, next);
+        if(text!=NULL && (id = category_id(text))>=0)
+        {
+            entry->category = categories[id];
+
+            // keep record in memory
+            dbstamp = sqlite3_column_int64(sselect, 1);
+            node_insert(entry->hash, id, dbstamp);
 
-        wlog(LOG_LVL4, "Cached record %s hit: %s\n", dump_hexdigest(entry->hash), entry->category);
+            wlog(LOG_LVL4, "Cached record %s hit: %s\n", dump_hexdigest(entry->hash), entry->category);
+        }
     }
 
     CALL_SQLITE(reset(sselect));
+
+    pthread_mutex_unlock(&mtx);
+
+    // filter said maybe, database said no (or an expired record)
+    if(filtered && entry->category==NULL)
+        __atomic_fetch_add(&bloom_false, 1, __ATOMIC_RELAXED);
+
+    if(shared!=NULL && entry->category!=NULL)
+        shared_insert(shared, entry->hash, entry->category, dbstamp, time(NULL)-CACHE_EXPIRE);
 #endif
 
+    return entry->category!=NULL;
+}
 
-found:
-    pthread_mutex_unlock(&mtx);
+// any category known for entry->hash, expired or not. memory keeps expired
+// nodes until the table is cleared, persisted copies are read regardless
+// of their age. the database is left out, its reads take the shared lock
+bool cache_stale(struct cache_t *entry)
+{
+    struct cache_node *node;
+    char category[STORE_CATEGORY_LEN];
+    uint32_t stamp;
+    int id;
+
+    entry->category = NULL;
+
+    epoch_enter();
+
+    if((node = node_find(entry->hash))!=NULL)
+        entry->category = categories[node->category & ~CACHE_REMOTE];
+
+    epoch_exit();
 
-    return entry;
+    if(entry->category!=NULL)
+        return true;
+
+    if(shared!=NULL && shared_lookup(shared, entry->hash, category, sizeof(category), &stamp) &&
+       (id = category_id(category))>=0)
+        entry->category = categories[id];
+    else
+    if(store!=NULL && store_lookup(store, entry->hash, category, sizeof(category), &stamp) &&
+       (id = category_id(category))>=0)
+        entry->category = categories[id];
+
+    return entry->category!=NULL;
 }
 
 void cache_insert(struct cache_t *entry)
 {
-    // insert new value in memory and database cache
+    int id;
+
+    // the fallback of a full category table is not a classification
+    if(entry->category==category_unknown || (id = category_id(entry->category))<0)
+        return;
+
+    // insert new value in memory, database write is deferred
     pthread_mutex_lock(&mtx);
+    node_insert(entry->hash, id, time(NULL));
 
-    SLIST_INSERT_HEAD(&cache_entries, entry, next);
+    // filters are swapped under mtx, so a record never misses both
+    if(bloom!=NULL)
+        bloom_add(bloom, entry->hash);
+
+    if(bloom_next!=NULL)
+        bloom_add(bloom_next, entry->hash);
 
-#ifndef _NO_DATABASE
-    // insert database cache value
-    CALL_SQLITE(bind_blob(insert, 1, entry->hash, MD5_DIGEST_LENGTH, SQLITE_TRANSIENT));
-    CALL_SQLITE(bind_text(insert, 2, entry->category, strlen(entry->category), SQLITE_TRANSIENT));
-    CALL_SQLITE_EXPECT(step(insert), DONE);
-    CALL_SQLITE(reset(insert));
-#endif
     pthread_mutex_unlock(&mtx);
 
+    if(shared!=NULL && !shared_insert(shared, entry->hash, entry->category, time(NULL), time(NULL)-CACHE_EXPIRE))
+        wlog(LOG_LVL4, "Shared cache is full, record %s kept local\n", dump_hexdigest(entry->hash));
+
+    peer_publish(entry->hash, entry->category, CACHE_EXPIRE);
+
+    if(persist && (store==NULL || store->writable))
+        pending_insert(entry->hash, id);
+
     wlog(LOG_LVL4, "Record %s added to cache: %s\n", dump_hexdigest(entry->hash), entry->category);
 }
 
+//! called from threaded code!
+void cache_remote(const unsigned char *hash, const char *category, uint32_t ttl)
+{
+    struct cache_node *node;
+    uint32_t stamp;
+    int id;
+
+    if(ttl==0 || ttl>CACHE_EXPIRE || (id = category_id(category))<0)
+        return;
+
+    stamp = time(NULL)+ttl-CACHE_EXPIRE;
+
+    // memory only, peers never write to the persistent cache. writers are
+    // serialized by mtx, so the table can be read without an epoch
+    pthread_mutex_lock(&mtx);
+
+    if((node = node_find(hash))==NULL || node->stamp<stamp)
+        node_insert(hash, id|CACHE_REMOTE, stamp);
+
+    pthread_mutex_unlock(&mtx);
+
+    if(shared!=NULL)
+        shared_insert(shared, hash, category, stamp, time(NULL)-CACHE_EXPIRE);
+}
+
 // number of cached items in memory
 int cache_statistics()
 {
-    struct cache_t *entry;
-    int count = 0;
+    size_t bytes;
+    int count;
 
     pthread_mutex_lock(&mtx);
 
+    if(shared!=NULL)
+        wlog(LOG_LVL4, "Shared cache stats: %u of %u slots, %u hits\n", shared_count(shared), shared->slots,
+                __atomic_load_n(&shared_hits, __ATOMIC_RELAXED));
+
+    if(store!=NULL)
+        wlog(LOG_LVL4, "Store cached items stats: %u of %u slots\n", store->count, store->slots);
 #ifndef _NO_DATABASE
-    if(sqlite3_step(sstats)==SQLITE_ROW)
-        wlog(LOG_LVL4, "Database cached items stats: %d\n", sqlite3_column_int(sstats, 0));
+    else
+    if(persist)
+    {
+        if(sqlite3_step(sstats)==SQLITE_ROW)
+            wlog(LOG_LVL4, "Database cached items stats: %d\n", sqlite3_column_int(sstats, 0));
 
-    CALL_SQLITE(reset(sstats));
-#endif
+        CALL_SQLITE(reset(sstats));
 
-    SLIST_FOREACH(entry, &cache_entries, next)
-        count++;
+        // rows bulk loaded behind our back are unknown to the filter and may
+        // outgrow it, build a new one sized for them. lookups pass through to
+        // cache.db meanwhile. a build still running or failed is left alone
+        if(bloom!=NULL && sqlite3_step(sversion)==SQLITE_ROW && sqlite3_column_int(sversion, 0)!=bloom_version)
+        {
+            bloom_version = sqlite3_column_int(sversion, 0);
+            wlog(LOG_LVL1, "cache.db was bulk loaded, rebuilding bloom filter\n");
 
-    if(count>10000)
-    {
-        wlog(LOG_LVL1, "Cache overflow, flushing old data...\n");
+            // the build that set bloom is done with mtx
+            pthread_join(bloomer, NULL);
 
-        // remove allocated entries
-        SLIST_FOREACH(entry, &cache_entries, next)
-            if(entry->category!=NULL) free(entry->category);
+            bloom_old = bloom;
+            __atomic_store_n(&bloom, NULL, __ATOMIC_RELEASE);
+            bloom_retired = epoch_retire();
 
-        // remove linked list array entries
-        while(!SLIST_EMPTY(&cache_entries))
-        {
-            entry = SLIST_FIRST(&cache_entries);
-            SLIST_REMOVE_HEAD(&cache_entries, next);
-            free(entry);
+            if(pthread_create(&bloomer, NULL, cache_bloom_build, NULL))
+                wquit("cache_bloom_build pthread_create() failed\n");
         }
+
+        CALL_SQLITE(reset(sversion));
     }
 
+    if(bloom!=NULL)
+    {
+        uint64_t avoided = __atomic_load_n(&bloom_avoided, __ATOMIC_RELAXED);
+        uint64_t fp = __atomic_load_n(&bloom_false, __ATOMIC_RELAXED);
+
+        // false positive rate among lookups of keys not in cache.db
+        wlog(LOG_LVL4, "Cache bloom filter: %lu queries avoided, %lu passed, %lu false positives (%0.2f%%)\n",
+                (unsigned long)avoided, (unsigned long)__atomic_load_n(&bloom_passed, __ATOMIC_RELAXED),
+                (unsigned long)fp, avoided+fp>0?fp*100.0/(avoided+fp):0.0);
+    }
+#endif
+
+    if(warmup_running)
+        wlog(LOG_LVL1, "Cache warm-up: %u records, %0.3f sec\n", warmup_loaded, warmup_time);
+
+    count = __atomic_load_n(&entries, __ATOMIC_RELAXED);
+    bytes = sizeof(struct cache_table)+table->nslabs*sizeof(struct cache_slab);
+
+    if(count>CACHE_MAX_ENTRIES)
+    {
+        wlog(LOG_LVL1, "Cache overflow, flushing old data...\n");
+        table_clear();
+    }
+
+    // release tables left behind by readers since the last run
+    reclaim();
+
     pthread_mutex_unlock(&mtx);
 
-    wlog(LOG_LVL4, "Memory cached items stats: %d\n", count);
+    wlog(LOG_LVL4, "Memory cached items stats: %d, %u categories, %lu bytes (%lu per entry), %u replaced slots reused\n",
+            count, ncategories, (unsigned long)bytes, (unsigned long)(count>0?bytes/count:0), reused);
+
+    if(config.npeers>0 || strlen(config.peerlisten))
+    {
+        uint64_t hits = 0;
+
+        for(uint32_t i=0; i<EPOCH_READERS; i++)
+            hits += __atomic_load_n(&remote[i].hits, __ATOMIC_RELAXED);
+
+        wlog(LOG_LVL4, "Peer sourced cache hits: %lu\n", (unsigned long)hits);
+    }
 
     return count;
-}
\ No newline at end of file
+}
@@ -29,7 +29,7 @@ SOFTWARE.
  * Created on September 1, 2015, 5:15 PM
  */
 
-#include <sys/queue.h>
+#include <stdbool.h>
 
 #include "md5.h"
 
@@ -40,23 +40,40 @@ SOFTWARE.
 extern "C" {
 #endif
 
-// shared cache among threads
+// classification result, category points to an interned string
 struct cache_t
 {
     unsigned char hash[MD5_DIGEST_LENGTH];
-    char *category;
-    SLIST_ENTRY(cache_t) next;
+    const char *category;
 };
 
 
 void cache_init();
 
-struct cache_t *cache_lookup(char *domain);
+// fills entry with the cached category, returns false on miss
+bool cache_lookup(char *domain, struct cache_t *entry);
 
+// last known category of entry->hash, expired entries included
+bool cache_stale(struct cache_t *entry);
+
+// copies entry into the shared cache, replacing any previous value
 void cache_insert(struct cache_t *entry);
 
 void cache_flush();
 
+// insert a classification learned from a peer node, kept in memory only
+void cache_remote(const unsigned char *hash, const char *category, uint32_t ttl);
+
+// shared copy of a category string, valid until cache_flush(). an
+// uncached "unknown" when the category table is full
+const char *cache_category(const char *category);
+
+// id of an interned category, -1 when the table is full. lock free for
+// categories already seen
+int cache_category_id(const char *category);
+
+const char *cache_category_name(int id);
+
 int cache_statistics();
 
 #ifdef	__cplusplus
@@ -0,0 +1,69 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Interface of in-process classifier plugins, the only header a plugin
+ * needs. A plugin is a shared object exporting a struct classifier_plugin
+ * named dnsfilter_classifier, loaded by the classify_plugin option.
+ */
+
+#ifndef CLASSIFIER_H
+#define	CLASSIFIER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define CLASSIFIER_API_VERSION 1
+#define CLASSIFIER_SYMBOL "dnsfilter_classifier"
+
+struct classifier_query
+{
+    const char *domain;     // lowercase, no trailing dot
+    const char *category;   // set by the plugin, NULL when unknown
+};
+
+struct classifier_plugin
+{
+    int version;            // CLASSIFIER_API_VERSION
+    const char *name;
+
+    // args is the rest of the classify_plugin line. returns the handle
+    // passed to the other calls, NULL on failure
+    void *(*init)(const char *args);
+
+    // answer count queries, returns how many got a category. dnsfilter
+    // asks for one domain per call from the packet path, plugins must
+    // still accept any count. called from many threads at once, must not
+    // block. category strings must stay valid until shutdown
+    int (*classify)(void *handle, struct classifier_query *queries, int count);
+
+    void (*shutdown)(void *handle);
+};
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CLASSIFIER_H */
+
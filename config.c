@@ -30,6 +30,10 @@ SOFTWARE.
 #include "config.h"
 #include "utils.h"
 #include "acl.h"
+#include "retry.h"
+#include "deadline.h"
+#include "proto.h"
+#include "plugin.h"
 
 config_t config;
 
@@ -87,15 +91,61 @@ bool parse_config()
             IFIS(line, "group") strlcpy(config.group, param, sizeof(config.group));
             IFIS(line, "license") strlcpy(config.license, param, sizeof(config.license));
             IFIS(line, "logfile") strlcpy(config.logfile, param, sizeof(config.logfile));
+            IFIS(line, "report_flush_msec") config.logflush = atoi(param);
             IFIS(line, "report_database") strlcpy(config.reportdb, param, sizeof(config.reportdb));
             IFIS(line, "cache_database") strlcpy(config.cachedb, param, sizeof(config.cachedb));
+            IFIS(line, "cache_batch_size") config.cachebatch = atoi(param);
+            IFIS(line, "cache_batch_time") config.cachecommit = atoi(param);
+            IFIS(line, "cache_warmup") config.cachewarmup = atoi(param);
+            IFIS(line, "cache_bloom_entries") config.cachebloom = atoi(param);
+            IFIS(line, "cache_engine") config.cacheengine = !strcmp(param, "mmap")?CACHE_ENGINE_MMAP:CACHE_ENGINE_SQLITE;
+            IFIS(line, "cache_mmap_file") strlcpy(config.cachemmap, param, sizeof(config.cachemmap));
+            IFIS(line, "cache_mmap_slots") config.mmapslots = atoi(param);
+            IFIS(line, "cache_shm_name") strlcpy(config.cacheshm, param, sizeof(config.cacheshm));
+            IFIS(line, "cache_shm_slots") config.shmslots = atoi(param);
+            IFIS(line, "refresh_ahead") config.refreshahead = atoi(param);
+            IFIS(line, "refresh_hits") config.refreshhits = atoi(param);
+            IFIS(line, "refresh_rate") config.refreshrate = atoi(param);
+            IFIS(line, "classify_registrable") config.registrable = read_bool(param);
+            IFIS(line, "classify_exact") strlcpy(config.exactcats, param, sizeof(config.exactcats));
+            IFIS(line, "classify_plugin")
+            {
+                if(config.nplugins<sizeof(config.plugins)/sizeof(config.plugins[0]))
+                    strlcpy(config.plugins[config.nplugins++], param, sizeof(config.plugins[0]));
+                else
+                    fprintf(stdout, "Too many classify_plugin entries, ignoring %s\n", param);
+            }
+            IFIS(line, "classify_order") config.classifyorder = !strcmp(param, "server,plugin")?ORDER_SERVER_PLUGIN:!strcmp(param, "plugin")?ORDER_PLUGIN:ORDER_PLUGIN_SERVER;
+            IFIS(line, "subdomain_flood") config.subdomainflood = atoi(param);
+            IFIS(line, "public_suffix_list") strlcpy(config.suffixfile, param, sizeof(config.suffixfile));
+            IFIS(line, "peer_listen") strlcpy(config.peerlisten, param, sizeof(config.peerlisten));
+            IFIS(line, "peer_key") strlcpy(config.peerkey, param, sizeof(config.peerkey));
+            IFIS(line, "peer_host")
+            {
+                if(config.npeers<sizeof(config.peerhost)/sizeof(config.peerhost[0]))
+                    strlcpy(config.peerhost[config.npeers++], param, sizeof(config.peerhost[0]));
+                else
+                    fprintf(stdout, "Too many peer_host entries, ignoring %s\n", param);
+            }
+            IFIS(line, "fail_policy") config.failpolicy = !strcmp(param, "closed")?FAIL_CLOSED:FAIL_OPEN;
+            IFIS(line, "deadline_msec") config.deadline = atoi(param);
+            IFIS(line, "deadline_policy") config.deadlinepolicy = !strcmp(param, "allow")?DEADLINE_ALLOW:!strcmp(param, "deny")?DEADLINE_DENY:DEADLINE_LAST;
             IFIS(line, "loglevel") config.loglevel = atoi(param);
             IFIS(line, "daemon") config.daemon = read_bool(param);
             IFIS(line, "threads") config.threads = atoi(param);
             IFIS(line, "acl") parse_acl(param);
             IFIS(line, "resolv_retry") config.tries = atoi(param);
             IFIS(line, "rewrite_host") strlcpy(config.rwhost, param, sizeof(config.rwhost));
+            IFIS(line, "engine_inflight") config.engineflight = atoi(param);
+            IFIS(line, "engine_connections") config.engineconns = atoi(param);
+            IFIS(line, "engine_batch_size") config.enginebatch = atoi(param);
+            IFIS(line, "engine_batch_time") config.enginewait = atoi(param);
             IFIS(line, "cfs_server") strlcpy(config.serverdns, param, sizeof(config.serverdns));
+            IFIS(line, "cfs_probe_interval") config.probeinterval = atoi(param);
+            IFIS(line, "cfs_eject_failures") config.ejectfailures = atoi(param);
+            IFIS(line, "cfs_eject_time") config.ejecttime = atoi(param);
+            IFIS(line, "cfs_protocol") config.protocol = !strcmp(param, "udp")?CFS_UDP:CFS_HTTP;
+            IFIS(line, "cfs_udp_port") config.udpport = atoi(param);
         }
 
         if(strlen(config.license)!=40)
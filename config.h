@@ -39,6 +39,12 @@ SOFTWARE.
 extern "C" {
 #endif
 
+enum cache_engines
+{
+    CACHE_ENGINE_SQLITE,
+    CACHE_ENGINE_MMAP
+};
+
 typedef struct
 {
     // config file location
@@ -49,16 +55,63 @@ typedef struct
     bool validlicense;
 
     char reportdb[128];
+    int logflush;       // max msecs report hits wait in memory
     char cachedb[128];
+    int cachebatch;     // records per cache.db transaction
+    int cachecommit;    // max msecs a record waits to be written
+    int cachewarmup;    // records preloaded from cache.db at startup
+    int cachebloom;     // minimum bloom filter capacity, negative disables
+
+    int cacheengine;
+    char cachemmap[128];
+    int mmapslots;
+
+    char cacheshm[64];  // shared memory segment name, empty disables
+    int shmslots;
+
+    // background reclassification of popular entries
+    int refreshahead;   // seconds before expiry, 0 disables
+    int refreshhits;
+    int refreshrate;    // refreshes per second
+
+    // classification sharing with other nodes
+    char peerlisten[64];    // [addr]:port
+    char peerhost[16][64];
+    int npeers;
+    char peerkey[64];
+
+    int failpolicy;     // verdict while a domain cannot be classified
+    int deadline;       // msecs a packet waits for its classification, negative disables
+    int deadlinepolicy; // verdict once the deadline expires
+
+    // classification keys
+    bool registrable;   // classify by eTLD+1
+    char exactcats[256];    // categories still classified by full name
+    char suffixfile[128];   // public suffix list
+    int subdomainflood; // new subdomains per minute that collapse a parent, 0 disables
+
+    // in-process classifiers, "path [args]"
+    char plugins[8][256];
+    int nplugins;
+    int classifyorder;  // plugins before, after or instead of the server
 
     // DNS rewrite ip address
     char rwhost[64];
     struct in_addr rwaddr;
     int tries;
 
-    int serveridx;
+    int engineflight;   // concurrent server lookups, negative disables the engine
+    int engineconns;    // keep-alive connections shared by all lookups
+    int enginebatch;    // domains per server request, 1 disables batching
+    int enginewait;     // max msecs a domain waits for its batch to fill
+
     char serverdns[64];
     struct in_addr serveraddr[32];  // up to 32 redundant hosts
+    int probeinterval;  // seconds between server health probes, negative disables
+    int ejectfailures;  // failures in a row that eject a server
+    int ejecttime;      // seconds a server stays ejected the first time
+    int protocol;       // http or binary udp
+    int udpport;
 
     int threads;
     int loglevel;
@@ -0,0 +1,248 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Classification deadline of deferred packets.
+ *
+ * A packet waiting for a background classification gets its verdict from
+ * the deadline policy once deadline_msec expires, the lookup goes on and
+ * fills the cache. Every deadline has the same duration, so the pending
+ * list is ordered by insertion and the timer only looks at its head.
+ *
+ * Waits are accounted in a histogram, expired ones included, which shows
+ * how a given deadline would cut the classification latency tail.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "deadline.h"
+#include "utils.h"
+#include "config.h"
+
+#define DEADLINE_MSEC 800       // default deadline_msec, below DNS client retries
+
+// histogram bucket upper bounds in msecs, plus one for anything slower
+static const uint32_t bounds[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+
+#define DEADLINE_BUCKETS (sizeof(bounds)/sizeof(bounds[0])+1)
+
+static pthread_t thread;
+static pthread_mutex_t mtx;
+static pthread_cond_t cond;
+static bool running;
+static bool quit;
+
+static deadline_cb expire;
+static struct deadline_t *head, *tail;
+
+static uint32_t histogram[DEADLINE_BUCKETS];
+static uint32_t waits, expired, pending;
+
+/*
+ * 
+ */
+
+static uint64_t now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+static void *deadline_worker(void *arg)
+{
+    struct deadline_t *t;
+    struct timespec ts;
+    uint64_t now, due;
+
+    pthread_mutex_lock(&mtx);
+
+    while(!quit || head!=NULL)
+    {
+        if(head==NULL)
+        {
+            pthread_cond_wait(&cond, &mtx);
+            continue;
+        }
+
+        now = now_msec();
+
+        // on shutdown everything left expires at once
+        if(!quit && head->due>now)
+        {
+            // cond uses the realtime clock
+            clock_gettime(CLOCK_REALTIME, &ts);
+            due = (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000+(head->due-now);
+
+            ts.tv_sec = due/1000;
+            ts.tv_nsec = (due%1000)*1000000;
+
+            pthread_cond_timedwait(&cond, &mtx, &ts);
+            continue;
+        }
+
+        t = head;
+
+        if((head = t->next)==NULL)
+            tail = NULL;
+
+        pending--;
+
+        pthread_mutex_unlock(&mtx);
+
+        expire(t);
+
+        pthread_mutex_lock(&mtx);
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    return 0;
+}
+
+//! called from threaded code!
+bool deadline_start(struct deadline_t *t)
+{
+    t->start = now_msec();
+    t->next = NULL;
+
+    if(!running)
+        return false;
+
+    t->due = t->start+config.deadline;
+
+    pthread_mutex_lock(&mtx);
+
+    if(quit)
+    {
+        pthread_mutex_unlock(&mtx);
+        return false;
+    }
+
+    if(tail!=NULL)
+        tail->next = t;
+    else
+    {
+        head = t;
+        pthread_cond_signal(&cond);
+    }
+
+    tail = t;
+    pending++;
+
+    pthread_mutex_unlock(&mtx);
+
+    return true;
+}
+
+//! called from threaded code!
+void deadline_record(struct deadline_t *t, bool hit)
+{
+    uint64_t wait = now_msec()-t->start;
+    int i;
+
+    for(i=0; i<DEADLINE_BUCKETS-1 && wait>bounds[i]; i++);
+
+    __atomic_fetch_add(&histogram[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&waits, 1, __ATOMIC_RELAXED);
+
+    if(hit)
+        __atomic_fetch_add(&expired, 1, __ATOMIC_RELAXED);
+}
+
+void deadline_init(deadline_cb cb)
+{
+    memset(histogram, 0, sizeof(histogram));
+    waits = expired = pending = 0;
+    head = tail = NULL;
+    expire = cb;
+    quit = false;
+    running = false;
+
+    if(config.deadline<0)
+        return;
+
+    if(config.deadline==0)
+        config.deadline = DEADLINE_MSEC;
+
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    running = true;
+
+    if(pthread_create(&thread, NULL, deadline_worker, NULL))
+        wquit("deadline_worker pthread_create() failed\n");
+
+    wlog(LOG_LVL3, "Classification deadline is %d msecs, then %s\n", config.deadline,
+            config.deadlinepolicy==DEADLINE_ALLOW?"allow":config.deadlinepolicy==DEADLINE_DENY?"deny":"last known category");
+}
+
+void deadline_close()
+{
+    if(!running)
+        return;
+
+    pthread_mutex_lock(&mtx);
+    quit = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mtx);
+
+    pthread_join(thread, NULL);
+
+    running = false;
+
+    wlog(LOG_LVL3, "Deadline thread stopped successfully!\n");
+}
+
+void deadline_statistics()
+{
+    char line[512];
+    uint32_t total = __atomic_load_n(&waits, __ATOMIC_RELAXED);
+    uint32_t hits = __atomic_load_n(&expired, __ATOMIC_RELAXED);
+    size_t pos = 0;
+    int i;
+
+    if(total==0)
+        return;
+
+    wlog(LOG_LVL4, "Deadline: %u deferred verdicts, %u expired (%0.2f%%), %u pending\n",
+            total, hits, hits*100.0/total, running?pending:0);
+
+    for(i=0; i<DEADLINE_BUCKETS && pos<sizeof(line); i++)
+    {
+        if(i<DEADLINE_BUCKETS-1)
+            pos += snprintf(line+pos, sizeof(line)-pos, " <=%ums:%u", bounds[i], histogram[i]);
+        else
+            pos += snprintf(line+pos, sizeof(line)-pos, " >%ums:%u", bounds[i-1], histogram[i]);
+    }
+
+    wlog(LOG_LVL4, "Deadline: wait histogram%s\n", line);
+}
@@ -0,0 +1,71 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef DEADLINE_H
+#define	DEADLINE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// verdict of a packet whose classification missed the deadline
+enum deadline_policy
+{
+    DEADLINE_LAST,      // last known category, else fail_policy
+    DEADLINE_ALLOW,
+    DEADLINE_DENY
+};
+
+// embedded in the object waiting for a verdict
+struct deadline_t
+{
+    uint64_t start;
+    uint64_t due;
+    struct deadline_t *next;
+};
+
+typedef void (*deadline_cb)(struct deadline_t *t);
+
+// cb runs on the timer thread for every expired deadline
+void deadline_init(deadline_cb cb);
+
+// expires every pending deadline before it returns
+void deadline_close();
+
+// stamp the wait start, returns true if the timer was armed
+bool deadline_start(struct deadline_t *t);
+
+// account the wait of a packet that got its verdict
+void deadline_record(struct deadline_t *t, bool expired);
+
+void deadline_statistics();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* DEADLINE_H */
+
@@ -0,0 +1,657 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "domain.h"
+#include "md5.h"
+#include "utils.h"
+#include "config.h"
+
+#define DOMAIN_SUFFIX_FILE "/usr/share/publicsuffix/public_suffix_list.dat"
+#define DOMAIN_EXACT_MAX 32
+#define DOMAIN_FLOOD_SLOTS 4096     // must be a power of two
+#define DOMAIN_FLOOD_WINDOW 60
+#define DOMAIN_FLOOD_HOLD 600       // seconds a flooded parent stays collapsed
+
+// compiled in subset of the public suffix list, in its syntax, used when the
+// full list is not installed. single label TLDs need no entry, the default
+// rule makes the last label a suffix
+static const char *suffixes[] =
+{
+    // wildcards and their exceptions
+    "*.bd", "*.ck", "!www.ck", "*.er", "*.fk", "*.jm", "*.kh", "*.mm", "*.np", "*.pg", "*.nom.br",
+
+    // generic second level registrations
+    "ac.uk", "co.uk", "gov.uk", "ltd.uk", "me.uk", "net.uk", "nhs.uk", "org.uk", "plc.uk", "*.sch.uk",
+    "com.br", "net.br", "org.br", "gov.br", "edu.br", "art.br", "blog.br", "eco.br", "emp.br", "ind.br",
+    "inf.br", "jus.br", "leg.br", "mil.br", "tv.br", "app.br", "dev.br", "log.br", "rec.br", "srv.br",
+    "com.au", "net.au", "org.au", "edu.au", "gov.au", "asn.au", "id.au",
+    "co.nz", "net.nz", "org.nz", "govt.nz", "ac.nz", "school.nz", "geek.nz",
+    "co.jp", "ne.jp", "or.jp", "ac.jp", "ad.jp", "ed.jp", "go.jp", "gr.jp", "lg.jp",
+    "co.kr", "ne.kr", "or.kr", "re.kr", "go.kr", "ac.kr",
+    "com.cn", "net.cn", "org.cn", "gov.cn", "edu.cn", "ac.cn",
+    "com.hk", "net.hk", "org.hk", "edu.hk", "gov.hk",
+    "com.tw", "net.tw", "org.tw", "edu.tw", "gov.tw",
+    "com.sg", "net.sg", "org.sg", "edu.sg", "gov.sg",
+    "com.my", "net.my", "org.my", "edu.my", "gov.my",
+    "co.id", "or.id", "web.id", "ac.id", "go.id",
+    "co.th", "in.th", "or.th", "ac.th", "go.th",
+    "com.vn", "net.vn", "org.vn", "edu.vn", "gov.vn",
+    "com.ph", "net.ph", "org.ph", "edu.ph", "gov.ph",
+    "co.in", "net.in", "org.in", "firm.in", "gen.in", "ind.in", "ac.in", "edu.in", "gov.in",
+    "com.pk", "net.pk", "org.pk", "edu.pk", "gov.pk",
+    "co.il", "org.il", "net.il", "ac.il", "gov.il",
+    "com.tr", "net.tr", "org.tr", "edu.tr", "gov.tr", "gen.tr", "biz.tr",
+    "co.za", "net.za", "org.za", "web.za", "gov.za", "ac.za",
+    "com.eg", "com.ng", "com.gh", "co.ke", "or.ke", "co.tz", "co.ug",
+    "com.ar", "net.ar", "org.ar", "gob.ar", "edu.ar", "int.ar",
+    "com.mx", "net.mx", "org.mx", "gob.mx", "edu.mx",
+    "com.co", "net.co", "org.co", "gov.co", "edu.co",
+    "com.pe", "net.pe", "org.pe", "gob.pe", "edu.pe",
+    "co.ve", "com.ve", "net.ve", "org.ve",
+    "com.uy", "net.uy", "org.uy", "edu.uy", "gub.uy",
+    "com.py", "net.py", "org.py", "edu.py", "gov.py",
+    "com.bo", "net.bo", "org.bo", "gob.bo",
+    "com.ec", "net.ec", "org.ec", "gob.ec",
+    "gob.cl", "gov.cl",
+    "com.pt", "org.pt", "edu.pt", "gov.pt",
+    "com.es", "nom.es", "org.es", "gob.es", "edu.es",
+    "com.pl", "net.pl", "org.pl", "biz.pl", "info.pl", "waw.pl",
+    "co.at", "or.at", "ac.at", "gv.at",
+    "com.gr", "net.gr", "org.gr", "edu.gr", "gov.gr",
+    "com.ru", "net.ru", "org.ru", "msk.ru", "spb.ru",
+    "com.ua", "net.ua", "org.ua", "in.ua", "kiev.ua",
+    "com.sa", "net.sa", "org.sa", "edu.sa", "gov.sa",
+    "co.ae", "net.ae", "org.ae", "gov.ae", "ac.ae",
+    "com.qa", "com.kw", "com.bh", "com.om", "com.lb", "com.jo",
+    "co.it", "gov.it", "edu.it",
+    "com.fr", "asso.fr", "nom.fr", "gouv.fr",
+    "co.no", "priv.no",
+    "co.hu", "org.hu",
+    "co.cr", "fi.cr", "or.cr",
+
+    // private registrations, each customer gets a subdomain
+    "blogspot.com", "blogspot.com.br", "appspot.com", "github.io", "githubusercontent.com",
+    "gitlab.io", "herokuapp.com", "netlify.app", "vercel.app", "pages.dev", "workers.dev",
+    "web.app", "firebaseapp.com", "azurewebsites.net", "cloudapp.net",
+    "cloudfront.net", "s3.amazonaws.com", "elasticbeanstalk.com",
+    "wixsite.com", "myshopify.com", "glitch.me", "ngrok.io",
+    "dyndns.org", "no-ip.org", "duckdns.org", "ddns.net", "hopto.org", "zapto.org",
+    "repl.co", "fly.dev", "onrender.com", "r2.dev",
+};
+
+// public suffix list rules, a name may carry several
+enum suffix_rules
+{
+    RULE_NAME = 1,          // "co.uk"
+    RULE_WILDCARD = 2,      // "*.ck", every child of the name is a suffix
+    RULE_EXCEPTION = 4      // "!www.ck", not a suffix despite a wildcard
+};
+
+struct suffix_slot
+{
+    char *name;
+    int rules;
+};
+
+// open addressing, sized from the list at startup and read only after
+static struct suffix_slot *suffix_index;
+static uint32_t suffix_slots, nsuffixes;
+
+// categories classified by exact name even with classify_registrable
+static char *exact[DOMAIN_EXACT_MAX];
+static int nexact;
+
+// subdomain flood tracking, one parent per slot
+struct flood_slot
+{
+    uint32_t key;
+    uint32_t start;
+    uint32_t count;
+    uint32_t until;
+};
+
+static pthread_mutex_t mtx;
+static struct flood_slot flood[DOMAIN_FLOOD_SLOTS];
+static uint32_t floods, collapsed;
+
+/*
+ * 
+ */
+
+static inline uint32_t domain_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while(*s)
+        h = (h ^ (unsigned char)*s++)*16777619u;
+
+    return h;
+}
+
+// rules listed for a name, 0 if none
+static int suffix_find(const char *s)
+{
+    uint32_t i;
+
+    if(suffix_index==NULL)
+        return 0;
+
+    for(i = domain_hash(s);; i++)
+    {
+        struct suffix_slot *p = &suffix_index[i & (suffix_slots-1)];
+
+        if(p->name==NULL)
+            return 0;
+
+        if(!strcmp(p->name, s))
+            return p->rules;
+    }
+}
+
+static void suffix_add(const char *name, int rule)
+{
+    struct suffix_slot *p;
+    uint32_t i;
+
+    for(i = domain_hash(name);; i++)
+    {
+        p = &suffix_index[i & (suffix_slots-1)];
+
+        if(p->name==NULL)
+            break;
+
+        if(!strcmp(p->name, name))
+        {
+            p->rules |= rule;
+            return;
+        }
+    }
+
+    if((p->name = strdup(name))==NULL)
+        return;
+
+    p->rules = rule;
+    nsuffixes++;
+}
+
+static inline char puny_digit(uint32_t d)
+{
+    return d<26?'a'+d:'0'+d-26;
+}
+
+static uint32_t puny_adapt(uint32_t delta, uint32_t points, bool first)
+{
+    uint32_t k = 0;
+
+    delta = first?delta/700:delta/2;
+    delta += delta/points;
+
+    while(delta>455)
+    {
+        delta /= 35;
+        k += 36;
+    }
+
+    return k+(36*delta)/(delta+38);
+}
+
+// RFC 3492 punycode of one UTF-8 label, as it shows up in queries. labels
+// with only ASCII are copied, false if the label is malformed or too long
+static bool puny_label(const char *label, size_t len, char *out, size_t size)
+{
+    uint32_t cp[64], n = 128, delta = 0, bias = 72, h, b, m, q, t, k;
+    size_t ncp = 0, o = 0, i;
+    const unsigned char *p = (const unsigned char *)label, *end = p+len;
+    int extra;
+
+    while(p<end)
+    {
+        if(ncp==sizeof(cp)/sizeof(cp[0]))
+            return false;
+
+        if(*p<0x80)
+            extra = 0, cp[ncp] = *p;
+        else if((*p & 0xe0)==0xc0)
+            extra = 1, cp[ncp] = *p & 0x1f;
+        else if((*p & 0xf0)==0xe0)
+            extra = 2, cp[ncp] = *p & 0x0f;
+        else if((*p & 0xf8)==0xf0)
+            extra = 3, cp[ncp] = *p & 0x07;
+        else
+            return false;
+
+        for(p++; extra>0; extra--, p++)
+        {
+            if(p>=end || (*p & 0xc0)!=0x80)
+                return false;
+
+            cp[ncp] = (cp[ncp] << 6) | (*p & 0x3f);
+        }
+
+        ncp++;
+    }
+
+    for(i=0, b=0; i<ncp; i++)
+        b += cp[i]<0x80;
+
+    if(b==ncp)
+    {
+        if(len>=size)
+            return false;
+
+        memcpy(out, label, len);
+        out[len] = 0;
+
+        return true;
+    }
+
+    #define PUNY_PUT(c) do { if(o>=size-1) return false; out[o++] = (c); } while(0)
+
+    for(i=0; i<4; i++)
+        PUNY_PUT("xn--"[i]);
+
+    for(i=0; i<ncp; i++)
+    {
+        if(cp[i]<0x80)
+            PUNY_PUT(cp[i]);
+    }
+
+    if(b>0)
+        PUNY_PUT('-');
+
+    for(h=b; h<ncp; delta++, n++)
+    {
+        for(i=0, m=UINT32_MAX; i<ncp; i++)
+        {
+            if(cp[i]>=n && cp[i]<m)
+                m = cp[i];
+        }
+
+        delta += (m-n)*(h+1);
+        n = m;
+
+        for(i=0; i<ncp; i++)
+        {
+            if(cp[i]<n)
+                delta++;
+
+            if(cp[i]!=n)
+                continue;
+
+            for(q=delta, k=36;; k+=36)
+            {
+                t = k<=bias?1:k>=bias+26?26:k-bias;
+
+                if(q<t)
+                    break;
+
+                PUNY_PUT(puny_digit(t+(q-t)%(36-t)));
+                q = (q-t)/(36-t);
+            }
+
+            PUNY_PUT(puny_digit(q));
+
+            bias = puny_adapt(delta, h+1, h==b);
+            delta = 0;
+            h++;
+        }
+    }
+
+    #undef PUNY_PUT
+
+    out[o] = 0;
+
+    return true;
+}
+
+// rule name in the ASCII form of query names
+static bool suffix_ascii(const char *rule, char *buf, size_t size)
+{
+    const char *dot;
+    size_t o = 0, len;
+
+    for(;;)
+    {
+        dot = strchr(rule, '.');
+        len = dot!=NULL?(size_t)(dot-rule):strlen(rule);
+
+        if(!puny_label(rule, len, buf+o, size-o))
+            return false;
+
+        o += strlen(buf+o);
+
+        if(dot==NULL)
+            break;
+
+        if(o>=size-1)
+            return false;
+
+        buf[o++] = '.';
+        rule = dot+1;
+    }
+
+    for(o=0; buf[o]; o++)
+        buf[o] = tolower((unsigned char)buf[o]);
+
+    return true;
+}
+
+// one rule in public suffix list syntax, line is changed in place
+static void suffix_rule(char *line)
+{
+    char *rule, *end;
+    char name[256];
+    int type = RULE_NAME;
+
+    // the rule ends at the first whitespace
+    for(rule = line; *rule==' ' || *rule=='\t'; rule++);
+    for(end = rule; *end && !isspace((unsigned char)*end); end++);
+
+    *end = 0;
+
+    if(!*rule || !strncmp(rule, "//", 2))
+        return;
+
+    if(*rule=='!')
+    {
+        type = RULE_EXCEPTION;
+        rule++;
+    }
+    else if(!strncmp(rule, "*.", 2))
+    {
+        type = RULE_WILDCARD;
+        rule += 2;
+    }
+
+    if(suffix_ascii(rule, name, sizeof(name)))
+        suffix_add(name, type);
+    else
+        wlog(LOG_LVL2, "Skipping public suffix rule %s\n", line);
+}
+
+// at most half full, comments make it less
+static void suffix_alloc(uint32_t rules)
+{
+    for(suffix_slots=1024; suffix_slots<rules*2; suffix_slots*=2);
+
+    if((suffix_index = calloc(suffix_slots, sizeof(*suffix_index)))==NULL)
+        wquit("public suffix list calloc() failed.\n");
+}
+
+// public suffix list from publicsuffix.org, one rule per line
+static bool suffix_load(const char *path)
+{
+    char *line = NULL;
+    size_t size = 0;
+    uint32_t lines = 0;
+    FILE *f;
+
+    if((f = fopen(path, "r"))==NULL)
+        return false;
+
+    while(getline(&line, &size, f)>=0)
+        lines++;
+
+    suffix_alloc(lines);
+    rewind(f);
+
+    while(getline(&line, &size, f)>=0)
+        suffix_rule(line);
+
+    free(line);
+    fclose(f);
+
+    return true;
+}
+
+static void suffix_builtin()
+{
+    char rule[256];
+    size_t n, count = sizeof(suffixes)/sizeof(suffixes[0]);
+
+    suffix_alloc(count);
+
+    for(n=0; n<count; n++)
+    {
+        strlcpy(rule, suffixes[n], sizeof(rule));
+        suffix_rule(rule);
+    }
+}
+
+// true while the registrable domain is collapsing its subdomains
+static bool flood_active(const char *reg)
+{
+    uint32_t h = domain_hash(reg);
+    struct flood_slot *s = &flood[h & (DOMAIN_FLOOD_SLOTS-1)];
+
+    // racy read is fine, worst case one lookup goes the other way
+    return __atomic_load_n(&s->key, __ATOMIC_RELAXED)==h &&
+           __atomic_load_n(&s->until, __ATOMIC_RELAXED)>(uint32_t)time(NULL);
+}
+
+void domain_init()
+{
+    char *list, *token, *p;
+
+    pthread_mutex_init(&mtx, NULL);
+
+    suffix_index = NULL;
+    suffix_slots = nsuffixes = 0;
+
+    // only needed to find registrable domains. without any list every
+    // co.uk name would share one key, so a configured list must load
+    if(config.registrable || config.subdomainflood>0)
+    {
+        if(*config.suffixfile)
+        {
+            if(!suffix_load(config.suffixfile))
+                wquit("Could not open public suffix list %s\n", config.suffixfile);
+        }
+        else
+        if(!suffix_load(DOMAIN_SUFFIX_FILE))
+        {
+            wlog(LOG_LVL1, "%s not installed, using the compiled in public suffixes\n", DOMAIN_SUFFIX_FILE);
+            suffix_builtin();
+        }
+    }
+
+    nexact = 0;
+    list = p = strdup(config.exactcats);
+
+    while((token = strsep(&p, ","))!=NULL && nexact<DOMAIN_EXACT_MAX)
+    {
+        if(*token)
+            exact[nexact++] = strdup(token);
+    }
+
+    free(list);
+
+    memset(flood, 0, sizeof(flood));
+    floods = collapsed = 0;
+
+    wlog(LOG_LVL3, "Domain keys: %u public suffix rules, registrable %s, %d exact categories\n",
+            nsuffixes, config.registrable?"on":"off", nexact);
+}
+
+//! called from threaded code!
+const char *domain_registrable(const char *name)
+{
+    const char *p = name, *prev = NULL, *dot;
+    int rules;
+
+    // the leftmost label starting a suffix gives the longest match
+    for(;;)
+    {
+        rules = suffix_find(p);
+        dot = strchr(p, '.');
+
+        // an exception is a registrable domain of its own
+        if(rules & RULE_EXCEPTION)
+            return p;
+
+        if((rules & RULE_NAME) || (dot!=NULL && (suffix_find(dot+1) & RULE_WILDCARD)))
+            return prev!=NULL?prev:name;
+
+        if(dot==NULL)
+            break;
+
+        prev = p;
+        p = dot+1;
+    }
+
+    // default rule, the last label is the public suffix
+    return prev!=NULL?prev:name;
+}
+
+//! called from threaded code!
+void domain_normalize(const char *name, char *buf, size_t size)
+{
+    size_t i;
+
+    // names are case insensitive, keep one key per name
+    for(i=0; name[i] && i<size-1; i++)
+        buf[i] = tolower((unsigned char)name[i]);
+
+    if(i>0 && buf[i-1]=='.')
+        i--;
+
+    buf[i] = 0;
+}
+
+//! called from threaded code!
+int domain_key(const char *name, char *buf, size_t size)
+{
+    const char *reg;
+
+    domain_normalize(name, buf, size);
+
+    if(!config.registrable && config.subdomainflood<=0)
+        return KEY_NAME;
+
+    if((reg = domain_registrable(buf))==buf)
+        return KEY_NAME;
+
+    // a flooded parent also skips exact name overrides
+    if(config.subdomainflood>0 && flood_active(reg))
+    {
+        memmove(buf, reg, strlen(reg)+1);
+        __atomic_fetch_add(&collapsed, 1, __ATOMIC_RELAXED);
+        return KEY_FLOOD;
+    }
+
+    if(config.registrable)
+    {
+        memmove(buf, reg, strlen(reg)+1);
+        return KEY_REGISTRABLE;
+    }
+
+    return KEY_NAME;
+}
+
+//! called from threaded code!
+void domain_digest(const char *key, unsigned char *hash)
+{
+    MD5_CTX ctx;
+
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, (void *)key, strlen(key));
+    MD5_Final(hash, &ctx);
+}
+
+//! called from threaded code!
+bool domain_exact(const char *category)
+{
+    for(int i=0; i<nexact; i++)
+    {
+        if(strcasestr(category, exact[i])!=NULL)
+            return true;
+    }
+
+    return false;
+}
+
+//! called from threaded code!
+void domain_miss(const char *name)
+{
+    const char *reg;
+    struct flood_slot *s;
+    uint32_t h, now;
+
+    if(config.subdomainflood<=0 || (reg = domain_registrable(name))==name)
+        return;
+
+    h = domain_hash(reg);
+    s = &flood[h & (DOMAIN_FLOOD_SLOTS-1)];
+    now = time(NULL);
+
+    pthread_mutex_lock(&mtx);
+
+    if(s->key!=h)
+    {
+        // slot taken by another parent still collapsing
+        if(s->until>now)
+        {
+            pthread_mutex_unlock(&mtx);
+            return;
+        }
+
+        __atomic_store_n(&s->until, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->key, h, __ATOMIC_RELAXED);
+        s->start = now;
+        s->count = 0;
+    }
+
+    if(now-s->start>=DOMAIN_FLOOD_WINDOW)
+    {
+        s->start = now;
+        s->count = 0;
+    }
+
+    // names missing the cache approximate distinct subdomains
+    if(++s->count>=(uint32_t)config.subdomainflood && s->until<=now)
+    {
+        __atomic_store_n(&s->until, now+DOMAIN_FLOOD_HOLD, __ATOMIC_RELAXED);
+        floods++;
+
+        wlog(LOG_LVL1, "Subdomain flood under %s, %u new names in %d sec, classifying by registrable domain\n",
+                reg, s->count, DOMAIN_FLOOD_WINDOW);
+    }
+
+    pthread_mutex_unlock(&mtx);
+}
+
+void domain_statistics()
+{
+    wlog(LOG_LVL4, "Subdomain floods: %u detected, %u lookups collapsed\n", floods,
+            __atomic_load_n(&collapsed, __ATOMIC_RELAXED));
+}
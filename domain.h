@@ -0,0 +1,70 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef DOMAIN_H
+#define	DOMAIN_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// how a classification key was derived from the query name
+enum domain_keys
+{
+    KEY_NAME,           // full name
+    KEY_REGISTRABLE,    // eTLD+1, classify_registrable
+    KEY_FLOOD           // eTLD+1, parent is under a subdomain flood
+};
+
+void domain_init();
+
+// registrable part (eTLD+1) of a lowercase name, points inside name
+const char *domain_registrable(const char *name);
+
+// lowercase, without the trailing dot
+void domain_normalize(const char *name, char *buf, size_t size);
+
+// lowercased classification key for a query name, written to buf
+int domain_key(const char *name, char *buf, size_t size);
+
+// cache key of a classification key, hash holds MD5_DIGEST_LENGTH bytes
+void domain_digest(const char *key, unsigned char *hash);
+
+// true when a category must be classified by exact name
+bool domain_exact(const char *category);
+
+// account a name missing from the cache, for flood detection
+void domain_miss(const char *name);
+
+void domain_statistics();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* DOMAIN_H */
+
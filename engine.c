@@ -0,0 +1,1133 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Asynchronous classification engine.
+ *
+ * One thread drives a curl multi handle. Packet threads queue requests and
+ * go back to their queue, the engine starts up to engine_inflight transfers
+ * at once over a pool of at most engine_connections keep-alive connections
+ * and completes each request by callback. Requests for a domain already
+ * queued or in flight are attached to the existing transfer.
+ *
+ * Misses are sent in batches: queued domains wait up to engine_batch_time
+ * msecs, or until engine_batch_size of them are queued, and go out in a
+ * single POST. The batch body is the license on the first line followed by
+ * one domain per line, the reply carries one category per line in the same
+ * order. A lone domain still uses the "<license>/<domain>" form, so servers
+ * without batch support keep working once batching is turned off for them.
+ *
+ * With cfs_protocol udp the same batches go out as binary datagrams (see
+ * proto.h) polled next to the curl handles. Every transfer has its own
+ * socket connected to the server, so it gets a fresh source port and the
+ * kernel drops datagrams from anyone else. A datagram not answered in time
+ * is sent again with a new random id, up to ENGINE_UDP_TRIES times with
+ * the timeout doubled on every try.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <curl/curl.h>
+
+#include "engine.h"
+#include "cache.h"
+#include "retry.h"
+#include "pool.h"
+#include "proto.h"
+#include "domain.h"
+#include "utils.h"
+#include "config.h"
+
+#define ENGINE_INFLIGHT 256     // defaults for engine_inflight/engine_connections
+#define ENGINE_CONNECTIONS 16
+#define ENGINE_BATCH_SIZE 32    // defaults for engine_batch_size/engine_batch_time
+#define ENGINE_BATCH_TIME 2
+#define ENGINE_BATCH_MAX 256
+#define ENGINE_QUEUE 4096       // queued and in flight requests
+#define ENGINE_BUCKETS 1024     // must be a power of two
+#define ENGINE_POLL_MSEC 1000
+#define ENGINE_UDP_RTO 150      // msecs before the first retransmit
+#define ENGINE_UDP_TRIES 3
+
+struct engine_waiter
+{
+    engine_cb cb;
+    void *arg;
+    struct engine_waiter *next;
+};
+
+struct engine_req
+{
+    char domain[256];
+    bool classify;              // update cache or retry queue on completion
+    struct timespec queued;
+
+    struct engine_waiter *waiters;
+    struct engine_req *next;    // pending queue
+    struct engine_req *hnext;   // classify requests by domain
+};
+
+// one POST or datagram carrying one or more requests
+struct engine_xfer
+{
+    CURL *easy;
+    char *data;
+    size_t size;
+    struct timespec start;
+    int server;                 // pool member it was sent to
+
+    struct proto_buf *dgram;    // kept for retransmits
+    int fd;                     // connected to the server
+    uint32_t ids[ENGINE_UDP_TRIES];     // one per datagram sent
+    int tries;
+    struct timespec due;
+
+    struct engine_xfer *prev, *next;    // in flight
+    int count;
+    struct engine_req *reqs[];
+};
+
+// blocking caller of engine_lookup()
+struct engine_sync
+{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    bool done;
+    const char *category;
+};
+
+static pthread_t thread;
+static pthread_mutex_t mtx;
+static bool running;
+static bool quit;
+
+static CURLM *multi;
+static struct curl_slist *headers;
+
+static struct engine_req *queue_head, *queue_tail;
+static struct engine_xfer *active;
+static struct engine_req *buckets[ENGINE_BUCKETS];
+static int requests;            // queued plus in flight
+static int queued;
+static int inflight;            // transfers
+
+// cleared when the server answers a batch with the wrong number of lines
+static bool batching;
+
+// easy handles are kept between transfers, connections live in the multi
+static CURL **idle;
+static int nidle;
+
+// sockets of the transfers in flight, for curl_multi_poll()
+static struct curl_waitfd *udpwait;
+static uint32_t retransmits, refused;
+
+static uint32_t submitted, coalesced, completed, failed, rejected, peak;
+static uint32_t batches, batched;
+static double latency;
+
+/*
+ * 
+ */
+
+static inline uint32_t domain_bucket(const char *domain)
+{
+    uint32_t h = 2166136261u;
+
+    while(*domain)
+        h = (h ^ (unsigned char)*domain++)*16777619u;
+
+    return h & (ENGINE_BUCKETS-1);
+}
+
+static inline long elapsed_msec(const struct timespec *since, const struct timespec *now)
+{
+    return (now->tv_sec-since->tv_sec)*1000+(now->tv_nsec-since->tv_nsec)/1000000;
+}
+
+static size_t engine_write(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    struct engine_xfer *xfer = userp;
+    size_t realsize = size*nmemb;
+
+    if((xfer->data = realloc(xfer->data, xfer->size+realsize+1))==NULL)
+        return 0;
+
+    memcpy(xfer->data+xfer->size, contents, realsize);
+    xfer->size += realsize;
+    xfer->data[xfer->size] = 0;
+
+    return realsize;
+}
+
+static CURL *easy_get()
+{
+    CURL *easy;
+
+    if(nidle>0)
+        return idle[--nidle];
+
+    if((easy = curl_easy_init())==NULL)
+        return NULL;
+
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPIDLE, 120);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPINTVL, 60);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 0);
+    curl_easy_setopt(easy, CURLOPT_POST, 1);
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 10);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, 5);
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, "iDB WiFi");
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, engine_write);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+
+    return easy;
+}
+
+static void easy_put(CURL *easy)
+{
+    if(nidle<config.engineflight)
+        idle[nidle++] = easy;
+    else
+        curl_easy_cleanup(easy);
+}
+
+// request body, single or batch form
+static char *xfer_body(struct engine_xfer *xfer)
+{
+    size_t len, pos;
+    char *body;
+    int i;
+
+    if(xfer->count==1)
+    {
+        asprintf(&body, "%s/%s", config.license, xfer->reqs[0]->domain);
+        return body;
+    }
+
+    len = strlen(config.license)+1;
+
+    for(i=0; i<xfer->count; i++)
+        len += strlen(xfer->reqs[i]->domain)+1;
+
+    if((body = malloc(len+1))==NULL)
+        return NULL;
+
+    pos = snprintf(body, len+1, "%s\n", config.license);
+
+    for(i=0; i<xfer->count; i++)
+        pos += snprintf(body+pos, len+1-pos, "%s\n", xfer->reqs[i]->domain);
+
+    return body;
+}
+
+static bool curl_start(struct engine_xfer *xfer)
+{
+    char url[64];
+    char *body;
+
+    if((body = xfer_body(xfer))==NULL)
+        return false;
+
+    if((xfer->easy = easy_get())==NULL)
+    {
+        free(body);
+        return false;
+    }
+
+    xfer->server = pool_pick();
+    pool_url(xfer->server, url, sizeof(url));
+
+    curl_easy_setopt(xfer->easy, CURLOPT_URL, url);
+    curl_easy_setopt(xfer->easy, CURLOPT_COPYPOSTFIELDS, body);
+    curl_easy_setopt(xfer->easy, CURLOPT_WRITEDATA, (void *)xfer);
+    curl_easy_setopt(xfer->easy, CURLOPT_PRIVATE, (void *)xfer);
+
+    free(body);
+
+    clock_gettime(CLOCK_MONOTONIC, &xfer->start);
+
+    if(curl_multi_add_handle(multi, xfer->easy)!=CURLM_OK)
+    {
+        easy_put(xfer->easy);
+        xfer->easy = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static void udp_send(struct engine_xfer *xfer)
+{
+    long rto = ENGINE_UDP_RTO << xfer->tries;
+
+    xfer->ids[xfer->tries] = proto_id();
+    proto_set_id(xfer->dgram, xfer->ids[xfer->tries]);
+
+    // a full socket buffer is just another lost datagram
+    send(xfer->fd, xfer->dgram->data, xfer->dgram->len, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &xfer->due);
+    xfer->due.tv_sec += rto/1000;
+    xfer->due.tv_nsec += (rto%1000)*1000000;
+
+    if(xfer->due.tv_nsec>=1000000000)
+    {
+        xfer->due.tv_sec++;
+        xfer->due.tv_nsec -= 1000000000;
+    }
+
+    xfer->tries++;
+}
+
+static bool udp_start(struct engine_xfer *xfer)
+{
+    struct sockaddr_in sa;
+    int i;
+
+    xfer->server = pool_pick();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(config.udpport);
+    sa.sin_addr = pool_addr(xfer->server);
+
+    // the kernel picks an unused ephemeral port for every transfer
+    if((xfer->fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0))<0)
+        return false;
+
+    if(connect(xfer->fd, (struct sockaddr *)&sa, sizeof(sa))<0 || (xfer->dgram = malloc(sizeof(*xfer->dgram)))==NULL)
+    {
+        close(xfer->fd);
+        xfer->fd = -1;
+
+        return false;
+    }
+
+    // the id is stamped by udp_send()
+    proto_begin(xfer->dgram, PROTO_REQUEST, 0, config.license);
+
+    // xfer_take() already sized the batch to fit
+    for(i=0; i<xfer->count; i++)
+        proto_put(xfer->dgram, xfer->reqs[i]->domain, PROTO_OK);
+
+    xfer->tries = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &xfer->start);
+    udp_send(xfer);
+
+    return true;
+}
+
+// called with mtx held
+static bool xfer_start(struct engine_xfer *xfer)
+{
+    if(!(config.protocol==CFS_UDP?udp_start(xfer):curl_start(xfer)))
+        return false;
+
+    xfer->prev = NULL;
+    xfer->next = active;
+
+    if(active!=NULL)
+        active->prev = xfer;
+
+    active = xfer;
+
+    if(++inflight>peak)
+        peak = inflight;
+
+    if(xfer->count>1)
+    {
+        batches++;
+        batched += xfer->count;
+    }
+
+    return true;
+}
+
+static void request_unlink(struct engine_req *req)
+{
+    struct engine_req **p;
+
+    if(!req->classify)
+        return;
+
+    for(p = &buckets[domain_bucket(req->domain)]; *p!=NULL; p = &(*p)->hnext)
+    {
+        if(*p==req)
+        {
+            *p = req->hnext;
+            break;
+        }
+    }
+}
+
+// run callbacks outside the lock, category is NULL on failure
+static void request_done(struct engine_req *req, const char *category)
+{
+    struct engine_waiter *w, *next;
+    struct cache_t entry;
+
+    if(req->classify && running)
+    {
+        domain_digest(req->domain, entry.hash);
+
+        if(category!=NULL)
+        {
+            entry.category = category;
+            cache_insert(&entry);
+
+            wlog(LOG_LVL3, "CFS Response: %s -> [%s]\n", req->domain, category);
+        }
+        else
+            retry_schedule(entry.hash, req->domain);
+    }
+
+    for(w = req->waiters; w!=NULL; w = next)
+    {
+        next = w->next;
+        w->cb(category, w->arg);
+        free(w);
+    }
+
+    free(req);
+}
+
+// split a reply into one category per request, false if the count differs
+static bool xfer_parse(struct engine_xfer *xfer, const char **categories)
+{
+    char *line, *end;
+    size_t len;
+    int n = 0;
+
+    if(xfer->count==1)
+    {
+        categories[0] = cache_category(xfer->data);
+        return true;
+    }
+
+    for(line = xfer->data; *line && n<xfer->count; line = end)
+    {
+        if((end = strchr(line, '\n'))!=NULL)
+            *end++ = 0;
+        else
+            end = line+strlen(line);
+
+        len = strlen(line);
+
+        if(len>0 && line[len-1]=='\r')
+            line[--len] = 0;
+
+        // an empty line is a domain the server could not classify
+        categories[n++] = len>0?cache_category(line):NULL;
+    }
+
+    return n==xfer->count && *line==0;
+}
+
+// put requests back at the head of the queue, called with mtx held
+static void xfer_requeue(struct engine_xfer *xfer)
+{
+    struct engine_req *req;
+    int i;
+
+    for(i=xfer->count-1; i>=0; i--)
+    {
+        req = xfer->reqs[i];
+
+        if((req->next = queue_head)==NULL)
+            queue_tail = req;
+
+        queue_head = req;
+        queued++;
+    }
+}
+
+// unlink a finished transfer and complete its requests. categories is
+// NULL when the whole transfer failed
+static void xfer_free(struct engine_xfer *xfer)
+{
+    if(xfer->fd>=0)
+        close(xfer->fd);
+
+    free(xfer->data);
+    free(xfer->dgram);
+    free(xfer);
+}
+
+static void xfer_complete(struct engine_xfer *xfer, const char **categories, bool mismatch, double secs)
+{
+    int i;
+
+    pthread_mutex_lock(&mtx);
+
+    if(xfer->easy!=NULL)
+        easy_put(xfer->easy);
+
+    if(xfer->prev!=NULL)
+        xfer->prev->next = xfer->next;
+    else
+        active = xfer->next;
+
+    if(xfer->next!=NULL)
+        xfer->next->prev = xfer->prev;
+
+    inflight--;
+
+    // server does not understand batches, send them one by one from now on
+    if(mismatch)
+    {
+        if(batching)
+            wlog(LOG_WARN, "CFS server did not answer a batch of %d domains, batching disabled\n", xfer->count);
+
+        batching = false;
+        xfer_requeue(xfer);
+
+        pthread_mutex_unlock(&mtx);
+
+        curl_multi_wakeup(multi);
+
+        xfer_free(xfer);
+
+        return;
+    }
+
+    for(i=0; i<xfer->count; i++)
+    {
+        request_unlink(xfer->reqs[i]);
+        requests--;
+
+        if(categories!=NULL && categories[i]!=NULL)
+            completed++;
+        else
+            failed++;
+    }
+
+    // moving average of transfer time
+    latency += (secs-latency)/16;
+
+    pthread_mutex_unlock(&mtx);
+
+    for(i=0; i<xfer->count; i++)
+        request_done(xfer->reqs[i], categories!=NULL?categories[i]:NULL);
+
+    xfer_free(xfer);
+}
+
+static void transfer_done(CURLMsg *msg)
+{
+    struct engine_xfer *xfer;
+    const char *categories[ENGINE_BATCH_MAX];
+    struct timespec end;
+    bool ok = false, mismatch = false;
+    double secs;
+    long code = 0;
+
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&xfer);
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+    curl_multi_remove_handle(multi, msg->easy_handle);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec-xfer->start.tv_sec)+(end.tv_nsec-xfer->start.tv_nsec)/1e9;
+
+    // server errors count against the pool member, unknown domains do not
+    pool_report(xfer->server, msg->data.result==CURLE_OK && code<500, secs);
+
+    memset(categories, 0, sizeof(categories));
+
+    if(msg->data.result==CURLE_OK && code==200 && xfer->data!=NULL)
+    {
+        if(!(ok = xfer_parse(xfer, categories)))
+            mismatch = true;
+    }
+    else
+        wlog(LOG_LVL2, "CFS lookup of %s%s failed: %s (%ld)\n", xfer->reqs[0]->domain,
+                xfer->count>1?" and others":"", curl_easy_strerror(msg->data.result), code);
+
+    xfer_complete(xfer, ok?categories:NULL, mismatch, secs);
+}
+
+// true if id was sent by this transfer, answers to an earlier try still count
+static bool udp_sent(struct engine_xfer *xfer, uint32_t id)
+{
+    int i;
+
+    for(i=0; i<xfer->tries; i++)
+    {
+        if(xfer->ids[i]==id)
+            return true;
+    }
+
+    return false;
+}
+
+// read the answers waiting on the sockets of the transfers in flight
+static void udp_receive()
+{
+    struct engine_xfer *xfer, *next;
+    struct proto_msg m;
+    const char *categories[ENGINE_BATCH_MAX];
+    uint8_t buf[PROTO_DATAGRAM];
+    char category[256];
+    struct timespec end;
+    double secs;
+    ssize_t len;
+    int status, n;
+
+    // active list only changes on this thread
+    for(xfer = active; xfer!=NULL; xfer = next)
+    {
+        next = xfer->next;
+
+        if(xfer->dgram==NULL)
+            continue;
+
+        // connected socket, the kernel already dropped other sources
+        while((len = recv(xfer->fd, buf, sizeof(buf), 0))>=0)
+        {
+            if(!proto_decode(&m, buf, len) || m.type!=PROTO_RESPONSE || !udp_sent(xfer, m.id))
+            {
+                refused++;
+                continue;
+            }
+
+            for(n=0; n<xfer->count && proto_record(&m, category, sizeof(category), &status); n++)
+                categories[n] = status==PROTO_OK && category[0]?cache_category(category):NULL;
+
+            // an answer for other domains than asked is not taken, keep waiting
+            if(m.count!=xfer->count || n!=xfer->count)
+            {
+                wlog(LOG_LVL2, "CFS answer with %d of %d domains refused\n", n, xfer->count);
+                refused++;
+                continue;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            secs = (end.tv_sec-xfer->start.tv_sec)+(end.tv_nsec-xfer->start.tv_nsec)/1e9;
+
+            pool_report(xfer->server, true, secs);
+            xfer_complete(xfer, categories, false, secs);
+
+            break;
+        }
+    }
+}
+
+// retransmit or fail unanswered datagrams, returns msecs to the next timeout
+static long udp_timers(long wait)
+{
+    struct engine_xfer *xfer, *next;
+    struct timespec now;
+    long left;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(xfer = active; xfer!=NULL; xfer = next)
+    {
+        next = xfer->next;
+
+        if(xfer->dgram==NULL)
+            continue;
+
+        if((left = -elapsed_msec(&xfer->due, &now))>0)
+        {
+            if(left<wait)
+                wait = left;
+
+            continue;
+        }
+
+        if(xfer->tries<ENGINE_UDP_TRIES)
+        {
+            retransmits++;
+            udp_send(xfer);
+
+            left = ENGINE_UDP_RTO << (xfer->tries-1);
+
+            if(left<wait)
+                wait = left;
+
+            continue;
+        }
+
+        wlog(LOG_LVL2, "CFS lookup of %s%s timed out\n", xfer->reqs[0]->domain, xfer->count>1?" and others":"");
+
+        pool_report(xfer->server, false, 0);
+        xfer_complete(xfer, NULL, false, (now.tv_sec-xfer->start.tv_sec)+(now.tv_nsec-xfer->start.tv_nsec)/1e9);
+    }
+
+    return wait;
+}
+
+// msecs until the head of the queue has waited long enough, called with mtx held
+static long batch_wait()
+{
+    struct timespec now;
+    long left;
+
+    if(!batching || quit || queued>=config.enginebatch)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    left = config.enginewait-elapsed_msec(&queue_head->queued, &now);
+
+    return left>0?left:0;
+}
+
+// take up to a batch of queued requests, called with mtx held
+static struct engine_xfer *xfer_take()
+{
+    struct engine_xfer *xfer;
+    struct engine_req *req;
+    size_t size = sizeof(struct proto_header)+PROTO_LICENSE;
+    int n = batching?config.enginebatch:1;
+
+    if(n>queued)
+        n = queued;
+
+    if((xfer = calloc(1, sizeof(*xfer)+n*sizeof(xfer->reqs[0])))==NULL)
+        return NULL;
+
+    xfer->fd = -1;
+
+    while(xfer->count<n)
+    {
+        req = queue_head;
+
+        // a batch datagram ends where the next domain does not fit
+        if(config.protocol==CFS_UDP)
+        {
+            size += proto_size(req->domain, PROTO_REQUEST);
+
+            if(xfer->count>0 && size>PROTO_DATAGRAM)
+                break;
+        }
+
+        if((queue_head = req->next)==NULL)
+            queue_tail = NULL;
+
+        req->next = NULL;
+        xfer->reqs[xfer->count++] = req;
+        queued--;
+    }
+
+    return xfer;
+}
+
+static void *engine_worker(void *arg)
+{
+    struct engine_xfer *xfer;
+    struct engine_req *req, *fail = NULL;
+    CURLMsg *msg;
+    long wait;
+    int pending, left, nfds, i;
+
+    pthread_mutex_lock(&mtx);
+
+    while(!quit)
+    {
+        wait = ENGINE_POLL_MSEC;
+
+        // start queued requests while there is room in flight
+        while(queue_head!=NULL && inflight<config.engineflight)
+        {
+            // let a partial batch fill up for a little while
+            if((wait = batch_wait())>0)
+                break;
+
+            wait = ENGINE_POLL_MSEC;
+
+            if((xfer = xfer_take())==NULL)
+                break;
+
+            if(!xfer_start(xfer))
+            {
+                for(i=0; i<xfer->count; i++)
+                {
+                    req = xfer->reqs[i];
+
+                    request_unlink(req);
+                    requests--;
+                    failed++;
+
+                    req->next = fail;
+                    fail = req;
+                }
+
+                xfer_free(xfer);
+            }
+        }
+
+        pthread_mutex_unlock(&mtx);
+
+        while((req = fail)!=NULL)
+        {
+            fail = req->next;
+            request_done(req, NULL);
+        }
+
+        curl_multi_perform(multi, &pending);
+
+        while((msg = curl_multi_info_read(multi, &left))!=NULL)
+        {
+            if(msg->msg==CURLMSG_DONE)
+                transfer_done(msg);
+        }
+
+        nfds = 0;
+
+        if(udpwait!=NULL)
+        {
+            udp_receive();
+            wait = udp_timers(wait);
+
+            for(xfer = active; xfer!=NULL; xfer = xfer->next)
+            {
+                if(xfer->dgram!=NULL)
+                {
+                    udpwait[nfds].fd = xfer->fd;
+                    udpwait[nfds].events = CURL_WAIT_POLLIN;
+                    udpwait[nfds++].revents = 0;
+                }
+            }
+        }
+
+        // woken up early by curl_multi_wakeup() on new requests
+        curl_multi_poll(multi, udpwait, nfds, wait, NULL);
+
+        pthread_mutex_lock(&mtx);
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    return 0;
+}
+
+// queue a request, called with mtx held
+static bool request_queue(const char *domain, bool classify, engine_cb cb, void *arg)
+{
+    struct engine_waiter *w;
+    struct engine_req *req = NULL;
+    uint32_t b = domain_bucket(domain);
+
+    if(!running)
+        return false;
+
+    if((w = malloc(sizeof(*w)))==NULL)
+        return false;
+
+    w->cb = cb;
+    w->arg = arg;
+
+    if(classify)
+    {
+        for(req = buckets[b]; req!=NULL && strcmp(req->domain, domain)!=0; req = req->hnext);
+
+        if(req!=NULL)
+        {
+            w->next = req->waiters;
+            req->waiters = w;
+            coalesced++;
+
+            return true;
+        }
+    }
+
+    if(requests>=ENGINE_QUEUE || (req = calloc(sizeof(*req), 1))==NULL)
+    {
+        free(w);
+        rejected++;
+
+        return false;
+    }
+
+    strlcpy(req->domain, domain, sizeof(req->domain));
+    req->classify = classify;
+
+    w->next = NULL;
+    req->waiters = w;
+
+    if(classify)
+    {
+        req->hnext = buckets[b];
+        buckets[b] = req;
+    }
+
+    if(queue_tail!=NULL)
+        queue_tail->next = req;
+    else
+        queue_head = req;
+
+    queue_tail = req;
+
+    clock_gettime(CLOCK_MONOTONIC, &req->queued);
+
+    requests++;
+    queued++;
+    submitted++;
+
+    // the engine only needs to know when a batch starts or fills up
+    if(!batching || queued==1 || queued>=config.enginebatch)
+        curl_multi_wakeup(multi);
+
+    return true;
+}
+
+//! called from threaded code!
+bool engine_classify(const char *domain, engine_cb cb, void *arg)
+{
+    bool ok;
+
+    pthread_mutex_lock(&mtx);
+    ok = request_queue(domain, true, cb, arg);
+    pthread_mutex_unlock(&mtx);
+
+    return ok;
+}
+
+static void sync_done(const char *category, void *arg)
+{
+    struct engine_sync *sync = arg;
+
+    pthread_mutex_lock(&sync->mtx);
+    sync->category = category;
+    sync->done = true;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->mtx);
+}
+
+//! called from threaded code!
+int engine_lookup(struct cache_t *entry, const char *domain)
+{
+    struct engine_sync sync;
+    bool ok;
+
+    pthread_mutex_init(&sync.mtx, NULL);
+    pthread_cond_init(&sync.cond, NULL);
+    sync.done = false;
+    sync.category = NULL;
+
+    pthread_mutex_lock(&mtx);
+    ok = request_queue(domain, false, sync_done, &sync);
+    pthread_mutex_unlock(&mtx);
+
+    if(ok)
+    {
+        pthread_mutex_lock(&sync.mtx);
+
+        while(!sync.done)
+            pthread_cond_wait(&sync.cond, &sync.mtx);
+
+        pthread_mutex_unlock(&sync.mtx);
+
+        entry->category = sync.category;
+    }
+
+    pthread_mutex_destroy(&sync.mtx);
+    pthread_cond_destroy(&sync.cond);
+
+    if(!ok)
+        return ENGINE_BUSY;
+
+    return entry->category!=NULL?ENGINE_DONE:ENGINE_FAILED;
+}
+
+void engine_init()
+{
+    running = false;
+
+    if(config.engineflight<0)
+        return;
+
+    if(config.engineflight==0)
+        config.engineflight = ENGINE_INFLIGHT;
+
+    if(config.engineconns<=0)
+        config.engineconns = ENGINE_CONNECTIONS;
+
+    if(config.enginebatch==0)
+        config.enginebatch = ENGINE_BATCH_SIZE;
+
+    if(config.enginebatch<1)
+        config.enginebatch = 1;
+
+    if(config.enginebatch>ENGINE_BATCH_MAX)
+        config.enginebatch = ENGINE_BATCH_MAX;
+
+    if(config.enginewait==0)
+        config.enginewait = ENGINE_BATCH_TIME;
+
+    if((multi = curl_multi_init())==NULL)
+        wquit("Failed to initialize curl multi!\n");
+
+    // transfers beyond the pool size wait inside curl for a free connection
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)config.engineconns);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)config.engineconns);
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)config.engineconns);
+
+    headers = curl_slist_append(NULL, "Content-Type: text/plain");
+
+    udpwait = NULL;
+
+    if(config.protocol==CFS_UDP && (udpwait = calloc(config.engineflight, sizeof(*udpwait)))==NULL)
+        wquit("engine poll fds malloc() failed.\n");
+
+    if((idle = calloc(config.engineflight, sizeof(CURL *)))==NULL)
+        wquit("engine idle handles malloc() failed.\n");
+
+    nidle = 0;
+    queue_head = queue_tail = NULL;
+    active = NULL;
+    memset(buckets, 0, sizeof(buckets));
+    requests = queued = inflight = 0;
+    submitted = coalesced = completed = failed = rejected = peak = 0;
+    batches = batched = retransmits = refused = 0;
+    batching = config.enginebatch>1;
+    latency = 0;
+    quit = false;
+
+    pthread_mutex_init(&mtx, NULL);
+
+    running = true;
+
+    if(pthread_create(&thread, NULL, engine_worker, NULL))
+        wquit("engine_worker pthread_create() failed\n");
+
+    wlog(LOG_LVL3, "Classification engine init, %d in flight, %d connections, batches of %d\n",
+            config.engineflight, config.engineconns, config.enginebatch);
+}
+
+void engine_close()
+{
+    struct engine_req *req, *list = NULL;
+    struct engine_xfer *xfer, *next;
+    int n, i;
+
+    if(!running)
+        return;
+
+    pthread_mutex_lock(&mtx);
+    quit = true;
+    pthread_mutex_unlock(&mtx);
+
+    curl_multi_wakeup(multi);
+    pthread_join(thread, NULL);
+
+    pthread_mutex_lock(&mtx);
+
+    // new requests are refused from now on, callers go inline
+    running = false;
+
+    // collect queued and in flight requests
+    while((req = queue_head)!=NULL)
+    {
+        queue_head = req->next;
+        req->next = list;
+        list = req;
+    }
+
+    queue_tail = NULL;
+
+    for(xfer = active; xfer!=NULL; xfer = next)
+    {
+        next = xfer->next;
+
+        if(xfer->easy!=NULL)
+        {
+            curl_multi_remove_handle(multi, xfer->easy);
+            curl_easy_cleanup(xfer->easy);
+        }
+
+        for(i=0; i<xfer->count; i++)
+        {
+            req = xfer->reqs[i];
+            req->next = list;
+            list = req;
+        }
+
+        xfer_free(xfer);
+    }
+
+    active = NULL;
+    queued = inflight = 0;
+    memset(buckets, 0, sizeof(buckets));
+
+    pthread_mutex_unlock(&mtx);
+
+    // waiters must not be left behind, deferred packets get their verdict
+    for(n=0; (req = list)!=NULL; n++)
+    {
+        list = req->next;
+        request_done(req, NULL);
+    }
+
+    while(nidle>0)
+        curl_easy_cleanup(idle[--nidle]);
+
+    free(idle);
+
+    free(udpwait);
+    udpwait = NULL;
+
+    curl_multi_cleanup(multi);
+    curl_slist_free_all(headers);
+
+    wlog(LOG_LVL3, "Classification engine stopped, %d requests failed on shutdown\n", n);
+}
+
+void engine_statistics()
+{
+    if(!running)
+        return;
+
+    pthread_mutex_lock(&mtx);
+
+    wlog(LOG_LVL4, "Engine: %u requests, %u coalesced, %u done, %u failed, %u rejected\n",
+            submitted, coalesced, completed, failed, rejected);
+    wlog(LOG_LVL4, "Engine: %d transfers in flight (peak %u), %d queued, %0.1f ms average\n",
+            inflight, peak, queued, latency*1000);
+
+    if(batches>0)
+        wlog(LOG_LVL4, "Engine: %u batches, %0.1f domains per batch%s\n",
+                batches, (double)batched/batches, batching?"":", batching disabled by server");
+
+    if(udpwait!=NULL)
+        wlog(LOG_LVL4, "Engine: %u datagrams retransmitted, %u answers refused\n", retransmits, refused);
+
+    pthread_mutex_unlock(&mtx);
+}
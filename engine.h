@@ -0,0 +1,67 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdbool.h>
+
+#include "cache.h"
+
+#ifndef ENGINE_H
+#define	ENGINE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+enum engine_results
+{
+    ENGINE_FAILED,
+    ENGINE_DONE,
+    ENGINE_BUSY         // engine stopped or queue full, caller does it inline
+};
+
+// completion callback, runs on the engine thread and must not block.
+// category is NULL when the domain could not be classified
+typedef void (*engine_cb)(const char *category, void *arg);
+
+void engine_init();
+
+// fails every pending request, callbacks run before it returns
+void engine_close();
+
+// classify a domain in background. the result is stored in the cache, or
+// the domain is queued for retry, before cb is called. requests for a
+// domain already in flight share its transfer
+bool engine_classify(const char *domain, engine_cb cb, void *arg);
+
+// blocking lookup through the engine connection pool, no cache update
+int engine_lookup(struct cache_t *entry, const char *domain);
+
+void engine_statistics();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* ENGINE_H */
+
@@ -0,0 +1,135 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "epoch.h"
+#include "utils.h"
+
+// per reader slot, padded to avoid sharing cachelines
+struct epoch_reader
+{
+    uint64_t epoch;             // 0 outside a read section
+    uint32_t used;
+    char pad[64-sizeof(uint64_t)-sizeof(uint32_t)];
+};
+
+static struct epoch_reader readers[EPOCH_READERS] __attribute__((aligned(64)));
+static uint64_t epoch = 1;
+
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static __thread int slot = -1;
+static __thread int depth;
+
+/*
+ * 
+ */
+
+// thread exit, the slot goes to the next thread that needs one
+static void epoch_release(void *arg)
+{
+    int n = (intptr_t)arg-1;
+
+    __atomic_store_n(&readers[n].epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&readers[n].used, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_key()
+{
+    if(pthread_key_create(&key, epoch_release))
+        wquit("epoch pthread_key_create() failed\n");
+}
+
+int epoch_slot()
+{
+    uint32_t free;
+
+    if(slot>=0)
+        return slot;
+
+    pthread_once(&once, epoch_key);
+
+    for(int n=0; n<EPOCH_READERS && slot<0; n++)
+    {
+        free = 0;
+
+        if(__atomic_compare_exchange_n(&readers[n].used, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            slot = n;
+    }
+
+    if(slot<0)
+        wquit("Too many threads reading shared tables (max %d)\n", EPOCH_READERS);
+
+    // the destructor only runs for non NULL values
+    pthread_setspecific(key, (void *)(intptr_t)(slot+1));
+
+    return slot;
+}
+
+// announce the current epoch, memory retired after this point stays valid
+// until the outermost epoch_exit()
+void epoch_enter()
+{
+    int n = epoch_slot();
+
+    if(depth++>0)
+        return;
+
+    __atomic_store_n(&readers[n].epoch, __atomic_load_n(&epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit()
+{
+    if(--depth==0)
+        __atomic_store_n(&readers[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t epoch_retire()
+{
+    return __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+uint64_t epoch_oldest()
+{
+    uint64_t oldest = UINT64_MAX, e;
+
+    // pairs with the fence in epoch_enter()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for(int n=0; n<EPOCH_READERS; n++)
+    {
+        e = __atomic_load_n(&readers[n].epoch, __ATOMIC_ACQUIRE);
+
+        if(e!=0 && e<oldest)
+            oldest = e;
+    }
+
+    return oldest;
+}
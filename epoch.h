@@ -0,0 +1,57 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdint.h>
+
+#ifndef EPOCH_H
+#define	EPOCH_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// max threads inside a read section at the same time, slots of exited
+// threads are reused
+#define EPOCH_READERS 256
+
+// read section, memory retired after epoch_enter() stays valid until the
+// matching epoch_exit(). sections nest
+void epoch_enter();
+
+void epoch_exit();
+
+// slot of the calling thread, for per thread counters
+int epoch_slot();
+
+// stamp for memory unlinked just now, see epoch_oldest()
+uint64_t epoch_retire();
+
+// memory retired with a stamp lower than this can be freed
+uint64_t epoch_oldest();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* EPOCH_H */
@@ -0,0 +1,267 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _NO_DATABASE
+
+/*
+ * Client groups from the report database log_group table, kept in memory
+ * for the report thread and group ACLs. The table is rebuilt by the report
+ * thread when log_group changes and swapped in whole, packet threads read
+ * it without locking inside an epoch read section.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <netinet/in.h>
+
+#include "group.h"
+#include "epoch.h"
+#include "utils.h"
+
+struct group_entry
+{
+    uint32_t ipaddr;            // network order
+    uint32_t group;             // 0 is an empty slot
+};
+
+struct group_map
+{
+    uint32_t mask;
+    uint32_t count;
+
+    // reclaim list, valid after the map was replaced
+    uint64_t retired;
+    struct group_map *free_next;
+
+    struct group_entry entries[];
+};
+
+static struct group_map *map;
+static struct group_map *retired;   // replaced maps, readers may still hold them
+
+// signature of the last loaded log_group, see group_load()
+static sqlite3_int64 seen_count, seen_max;
+static double seen_sum;
+
+static uint32_t loads;
+static uint64_t lookups, hits;
+
+/*
+ * 
+ */
+
+static inline uint32_t group_hash(uint32_t ipaddr)
+{
+    return ipaddr*2654435761u;
+}
+
+static void map_put(struct group_map *m, uint32_t ipaddr, uint32_t group)
+{
+    uint32_t idx;
+
+    for(idx = group_hash(ipaddr); ; idx++)
+    {
+        struct group_entry *e = &m->entries[idx & m->mask];
+
+        if(e->group==0)
+        {
+            e->ipaddr = ipaddr;
+            e->group = group;
+            m->count++;
+            return;
+        }
+
+        // unique index on ipaddr, but be safe
+        if(e->ipaddr==ipaddr)
+        {
+            e->group = group;
+            return;
+        }
+    }
+}
+
+// free replaced maps no reader can still reference
+static void reclaim()
+{
+    struct group_map **prev, *m;
+    uint64_t oldest;
+
+    if(retired==NULL)
+        return;
+
+    oldest = epoch_oldest();
+    prev = &retired;
+
+    while((m = *prev)!=NULL)
+    {
+        if(m->retired<oldest)
+        {
+            *prev = m->free_next;
+            free(m);
+        }
+        else
+            prev = &m->free_next;
+    }
+}
+
+void group_init()
+{
+    map = retired = NULL;
+    seen_count = seen_max = -1;
+    seen_sum = 0;
+    loads = 0;
+    lookups = hits = 0;
+}
+
+// readers are gone by now
+void group_close()
+{
+    struct group_map *m;
+
+    while((m = retired)!=NULL)
+    {
+        retired = m->free_next;
+        free(m);
+    }
+
+    free(map);
+    map = NULL;
+}
+
+bool group_load(struct sqlite3 *db, bool force)
+{
+    struct group_map *m, *old;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 count = 0, max = 0;
+    double sum = 0;
+    uint32_t size;
+
+    // cheap change check, log_group holds one row per client
+    CALL_SQLITE(prepare_v2(db, "select count(*), ifnull(max(id),0), total(ipaddr*31+group_id) from log_group", -1, &stmt, NULL));
+
+    if(sqlite3_step(stmt)==SQLITE_ROW)
+    {
+        count = sqlite3_column_int64(stmt, 0);
+        max = sqlite3_column_int64(stmt, 1);
+        sum = sqlite3_column_double(stmt, 2);
+    }
+
+    CALL_SQLITE(finalize(stmt));
+
+    // maps replaced by earlier loads
+    reclaim();
+
+    if(!force && count==seen_count && max==seen_max && sum==seen_sum)
+        return false;
+
+    for(size = 64; size<count*2; size <<= 1);
+
+    if((m = calloc(1, sizeof(*m)+size*sizeof(m->entries[0])))==NULL)
+    {
+        wlog(LOG_ERROR, "Could not allocate the client group map\n");
+        return false;
+    }
+
+    m->mask = size-1;
+
+    CALL_SQLITE(prepare_v2(db, "select ipaddr, group_id from log_group where group_id<>0", -1, &stmt, NULL));
+
+    // addresses are stored as host order integers by the report writer
+    while(sqlite3_step(stmt)==SQLITE_ROW)
+        map_put(m, htonl((uint32_t)sqlite3_column_int64(stmt, 0)), (uint32_t)sqlite3_column_int64(stmt, 1));
+
+    CALL_SQLITE(finalize(stmt));
+
+    if((old = __atomic_exchange_n(&map, m, __ATOMIC_ACQ_REL))!=NULL)
+    {
+        old->retired = epoch_retire();
+        old->free_next = retired;
+        retired = old;
+    }
+
+    reclaim();
+
+    seen_count = count;
+    seen_max = max;
+    seen_sum = sum;
+    loads++;
+
+    wlog(LOG_LVL1, "Client groups loaded, %u clients in groups\n", m->count);
+
+    return true;
+}
+
+//! called from threaded code!
+uint32_t group_lookup(uint32_t ipaddr)
+{
+    struct group_map *m;
+    uint32_t idx, group = 0;
+
+    __atomic_fetch_add(&lookups, 1, __ATOMIC_RELAXED);
+
+    epoch_enter();
+
+    m = __atomic_load_n(&map, __ATOMIC_ACQUIRE);
+
+    for(idx = group_hash(ipaddr); m!=NULL && m->count>0; idx++)
+    {
+        struct group_entry *e = &m->entries[idx & m->mask];
+
+        if(e->group==0)
+            break;
+
+        if(e->ipaddr==ipaddr)
+        {
+            group = e->group;
+            break;
+        }
+    }
+
+    epoch_exit();
+
+    if(group!=0)
+        __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+
+    return group;
+}
+
+void group_statistics()
+{
+    struct group_map *m;
+    uint32_t count;
+
+    epoch_enter();
+    m = __atomic_load_n(&map, __ATOMIC_ACQUIRE);
+    count = m!=NULL?m->count:0;
+    epoch_exit();
+
+    wlog(LOG_LVL4, "Client groups: %u clients, %u loads, %lu lookups, %lu in a group\n", count, loads,
+            (unsigned long)__atomic_load_n(&lookups, __ATOMIC_RELAXED), (unsigned long)__atomic_load_n(&hits, __ATOMIC_RELAXED));
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef GROUP_H
+#define	GROUP_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+struct sqlite3;
+
+void group_init();
+
+void group_close();
+
+// (re)load the client map from log_group if it changed, or always with force
+bool group_load(struct sqlite3 *db, bool force);
+
+// group of a client address in network order, 0 when it has none
+uint32_t group_lookup(uint32_t ipaddr);
+
+void group_statistics();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* GROUP_H */
@@ -33,34 +33,143 @@ SOFTWARE.
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <curl/curl.h>
 
 #include "config.h"
 #include "http.h"
+#include "engine.h"
+#include "pool.h"
+#include "proto.h"
 #include "utils.h"
 
+#define UDP_RTO 150             // msecs before the first retransmit, doubled on each
+#define UDP_TRIES 3
+
 /*
  * 
  */
 
+// blocking lookup over the binary protocol, same retransmits as the engine
+static bool perform_udp(struct cache_t *entry, char *domain)
+{
+    struct proto_buf req;
+    struct proto_msg m;
+    struct sockaddr_in sa;
+    struct pollfd pfd;
+    struct timespec start, end;
+    uint8_t buf[PROTO_DATAGRAM];
+    char category[256];
+    uint32_t ids[UDP_TRIES];
+    ssize_t len;
+    int server, status, tries, i;
+    bool answered = false;
+
+    entry->category = NULL;
+
+    if((pfd.fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0))<0)
+        return false;
+
+    server = pool_pick();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(config.udpport);
+    sa.sin_addr = pool_addr(server);
+
+    pfd.events = POLLIN;
+
+    proto_begin(&req, PROTO_REQUEST, 0, config.license);
+    proto_put(&req, domain, PROTO_OK);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(connect(pfd.fd, (struct sockaddr *)&sa, sizeof(sa))==0)
+    {
+        for(tries=0; tries<UDP_TRIES && !answered; tries++)
+        {
+            // a new id for every datagram, late answers to earlier tries still count
+            ids[tries] = proto_id();
+            proto_set_id(&req, ids[tries]);
+
+            if(send(pfd.fd, req.data, req.len, 0)!=req.len)
+                break;
+
+            while(!answered && poll(&pfd, 1, UDP_RTO << tries)>0)
+            {
+                if((len = recv(pfd.fd, buf, sizeof(buf), 0))<0)
+                    break;
+
+                if(!proto_decode(&m, buf, len) || m.type!=PROTO_RESPONSE || m.count!=1)
+                    continue;
+
+                for(i=0; i<=tries && ids[i]!=m.id; i++);
+
+                if(i>tries || !proto_record(&m, category, sizeof(category), &status))
+                    continue;
+
+                answered = true;
+
+                if(status==PROTO_OK && category[0])
+                    entry->category = cache_category(category);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(pfd.fd);
+
+    pool_report(server, answered, (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9);
+
+    return entry->category!=NULL;
+}
+
 bool perform_lookup(queueinfo_t *qinfo, struct cache_t *entry, char *domain)
 {
     CURLcode res;
     char *lookup;
+    char url[64];
+    double secs = 0;
+    long code = 0;
+    int server;
+
+    // shared connection pool, own handle only if the engine is unavailable
+    switch(engine_lookup(entry, domain))
+    {
+        case ENGINE_DONE:
+            return true;
+        case ENGINE_FAILED:
+            return false;
+    }
+
+    if(config.protocol==CFS_UDP)
+        return perform_udp(entry, domain);
 
     asprintf(&lookup, "%s/%s", config.license, domain);
 
+    server = pool_pick();
+    pool_url(server, url, sizeof(url));
+
+    curl_easy_setopt(qinfo->handle, CURLOPT_URL, url);
     curl_easy_setopt(qinfo->handle, CURLOPT_POSTFIELDS, lookup);
     res = curl_easy_perform(qinfo->handle);
 
     free(lookup);
 
+    curl_easy_getinfo(qinfo->handle, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(qinfo->handle, CURLINFO_TOTAL_TIME, &secs);
+
+    pool_report(server, res==CURLE_OK && code<500, secs);
+
     if(res==CURLE_OK)
     {
-        // copy response data
-        entry->category = strdup(qinfo->data);
-        return true;
+        // share response data with the cache
+        entry->category = cache_category(qinfo->data);
+        return entry->category!=NULL;
     }
     else
     {
@@ -88,73 +197,56 @@ size_t writefunc(void *contents, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
-// create a new curl instance for each thread
-bool curl_init(queueinfo_t *qinfo, bool reinit)
+// create a new curl instance for each thread, the server is picked per lookup
+bool curl_init(queueinfo_t *qinfo)
 {
-    char *buf;
+    qinfo->handle = curl_easy_init();
+    qinfo->data = (char *)calloc(1, 1);
+    qinfo->headers = NULL;
+    qinfo->size = 0;
 
-    if(!reinit)
+    if(qinfo->handle)
     {
-        qinfo->handle = curl_easy_init();
-        qinfo->data = (char *)malloc(1);
-        qinfo->headers = NULL;
-        qinfo->size = 0;
-
-        if(qinfo->handle)
-        {
-            // each thread connect to a different server
-            if(config.serveraddr[config.serveridx].s_addr == 0)
-                config.serveridx = 0;
-
-            asprintf(&buf, "http://%s:4080", inet_ntoa(config.serveraddr[config.serveridx++]));
-
-            wlog(LOG_LVL3, "Server lookup URL: %s\n", buf);
+        curl_easy_setopt(qinfo->handle, CURLOPT_VERBOSE, 0);
+        curl_easy_setopt(qinfo->handle, CURLOPT_HEADER, 0);
 
-            curl_easy_setopt(qinfo->handle, CURLOPT_VERBOSE, 0);
-            curl_easy_setopt(qinfo->handle, CURLOPT_HEADER, 0);
+        curl_easy_setopt(qinfo->handle, CURLOPT_NOSIGNAL, 1);
 
-            curl_easy_setopt(qinfo->handle, CURLOPT_NOSIGNAL, 1);
+        curl_easy_setopt(qinfo->handle, CURLOPT_TCP_KEEPALIVE, 1);
+        curl_easy_setopt(qinfo->handle, CURLOPT_TCP_KEEPIDLE, 120);
+        curl_easy_setopt(qinfo->handle, CURLOPT_TCP_KEEPINTVL, 60);
 
-            curl_easy_setopt(qinfo->handle, CURLOPT_TCP_KEEPALIVE, 1);
-            curl_easy_setopt(qinfo->handle, CURLOPT_TCP_KEEPIDLE, 120);
-            curl_easy_setopt(qinfo->handle, CURLOPT_TCP_KEEPINTVL, 60);
+        curl_easy_setopt(qinfo->handle, CURLOPT_SSL_VERIFYPEER, 0);
+        curl_easy_setopt(qinfo->handle, CURLOPT_SSL_VERIFYHOST, 0);
 
-            curl_easy_setopt(qinfo->handle, CURLOPT_SSL_VERIFYPEER, 0);
-            curl_easy_setopt(qinfo->handle, CURLOPT_SSL_VERIFYHOST, 0);
+        curl_easy_setopt(qinfo->handle, CURLOPT_FOLLOWLOCATION, 0);
+        curl_easy_setopt(qinfo->handle, CURLOPT_POST, 1);
 
-            curl_easy_setopt(qinfo->handle, CURLOPT_FOLLOWLOCATION, 0);
-            curl_easy_setopt(qinfo->handle, CURLOPT_URL, buf);
-            curl_easy_setopt(qinfo->handle, CURLOPT_POST, 1);
+        // timeout values
+        curl_easy_setopt(qinfo->handle, CURLOPT_CONNECTTIMEOUT, 10);
+        curl_easy_setopt(qinfo->handle, CURLOPT_TIMEOUT, 5);
+        curl_easy_setopt(qinfo->handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        curl_easy_setopt(qinfo->handle, CURLOPT_USERAGENT, "iDB WiFi");
+        curl_easy_setopt(qinfo->handle, CURLOPT_WRITEFUNCTION, writefunc);
+        curl_easy_setopt(qinfo->handle, CURLOPT_WRITEDATA, (void *)qinfo);
 
-            // timeout values
-            curl_easy_setopt(qinfo->handle, CURLOPT_CONNECTTIMEOUT, 10);
-            curl_easy_setopt(qinfo->handle, CURLOPT_TIMEOUT, 5);
-            curl_easy_setopt(qinfo->handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
-            curl_easy_setopt(qinfo->handle, CURLOPT_USERAGENT, "iDB WiFi");
-            curl_easy_setopt(qinfo->handle, CURLOPT_WRITEFUNCTION, writefunc);
-            curl_easy_setopt(qinfo->handle, CURLOPT_WRITEDATA, (void *)qinfo);
+        qinfo->headers = curl_slist_append(qinfo->headers, "Content-Type: text/plain");
+        curl_easy_setopt(qinfo->handle, CURLOPT_HTTPHEADER, qinfo->headers);
 
-            qinfo->headers = curl_slist_append(qinfo->headers, "Content-Type: text/plain");
-            curl_easy_setopt(qinfo->handle, CURLOPT_HTTPHEADER, qinfo->headers);
-
-            free(buf);
-            return true;
-        }
-    }
-    else
-    {
-        if(config.serveraddr[config.serveridx].s_addr == 0)
-            config.serveridx = 0;
-
-        asprintf(&buf, "http://%s:4080", inet_ntoa(config.serveraddr[config.serveridx++]));
-
-        wlog(LOG_LVL3, "Server lookup URL: %s\n", buf);
-
-        curl_easy_setopt(qinfo->handle, CURLOPT_URL, buf);
-        
-        free(buf);
         return true;
     }
 
     return false;
 }
+
+void curl_close(queueinfo_t *qinfo)
+{
+    curl_easy_cleanup(qinfo->handle);
+    curl_slist_free_all(qinfo->headers);
+    free(qinfo->data);
+
+    qinfo->handle = NULL;
+    qinfo->headers = NULL;
+    qinfo->data = NULL;
+    qinfo->size = 0;
+}
@@ -40,7 +40,8 @@ extern "C" {
 #endif
 
 bool perform_lookup(queueinfo_t *qinfo, struct cache_t *entry, char *domain);
-bool curl_init(queueinfo_t *qinfo, bool reinit);
+bool curl_init(queueinfo_t *qinfo);
+void curl_close(queueinfo_t *qinfo);
 
 
 #ifdef __cplusplus
@@ -32,41 +32,112 @@ SOFTWARE.
 #include <pthread.h>
 #include <sqlite3.h>
 #include <netinet/in.h>
-#include <bits/pthreadtypes.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
 
 #include "utils.h"
 #include "log.h"
 #include "config.h"
+#include "cache.h"
+#include "group.h"
+
+#define LOG_RING 65536          // queued records, must be a power of two
+#define LOG_BATCH 1024          // queued records that wake the logger early
+#define LOG_WAIT_MSEC 1000      // consumer wakes at least this often
+#define LOG_NAMES 65536         // interned names per generation, power of two
+#define LOG_NAMES_ARENA 4194304 // name bytes per generation
+#define LOG_PAIRS 65536         // aggregated (client, domain) pairs, power of two
+#define LOG_CLIENTS 4096        // distinct clients per flush, power of two
+#define LOG_FLUSH_MSEC 1000     // default report_flush_msec
+#define LOG_DRAIN_MSEC 5000     // max time a shutdown or reload waits for the drain
+#define LOG_GROUP_SECS 10       // log_group change check interval
+
+// compact queued record, the domain is a reference into the name table
+struct log_record
+{
+    uint32_t ipaddr;
+    uint32_t domain;            // generation<<31 | name slot
+    uint16_t category;          // cache category id, LOG_NO_CATEGORY if none
+    int16_t hitcode;
+};
+
+#define LOG_NO_CATEGORY 0xffff
+
+struct log_slot
+{
+    uint32_t seq;               // publication sequence, see log_push()
+    struct log_record rec;
+};
+
+// insert only name table. producers intern lock free, the logger thread
+// switches to the other generation when one fills and resets the old one
+// once no queued record or producer refers to it anymore
+struct log_names
+{
+    char *slot[LOG_NAMES];
+    sqlite3_int64 id[LOG_NAMES];    // domains.id of the slot, 0 if not resolved yet
+    uint32_t count;
+    uint32_t refs;              // producers inside plus records queued
+    uint32_t used;              // arena bytes
+    char arena[LOG_NAMES_ARENA];
+};
 
-#define MAX_QUEUE 100
+// hits of one client on one domain since the last flush
+struct log_pair
+{
+    uint32_t ipaddr;
+    uint32_t domain;            // name reference, pins its generation once
+    uint32_t hits;              // 0 is an empty slot
+    uint16_t category;
+    int16_t hitcode;
+};
 
-typedef struct
+struct log_client
 {
-    char domain[265];
-    char result[64];
     uint32_t ipaddr;
-    int hitcode;
-} q_buf __attribute__((aligned));
+    bool used;
+};
+
+// what the report thread is asked to do besides logging
+enum log_requests
+{
+    LOG_RUN,
+    LOG_RELOAD,     // drain, commit and reopen report.db
+    LOG_QUIT        // drain, commit and exit
+};
 
 enum stmt_order
 {
-    STMT_LOG_INSERT,
-    STMT_LOG_UPDATE,
-    STMT_GROUP_UPDATE,
-    STMT_IPADDR_INSERT
+    STMT_LOG_UPSERT,
+    STMT_IPADDR_INSERT,
+    STMT_DOMAIN_SELECT,
+    STMT_DOMAIN_INSERT
 };
 
 static sqlite3 *db;
 static sqlite3_stmt *stmt_log[4];
 
 static pthread_t thread;
-static pthread_mutex_t mtx;
 static pthread_mutex_t cond_mtx;
 static pthread_cond_t cond;
+static pthread_cond_t drained;
+static uint32_t request;
+static uint32_t reloads;        // reloads completed
+
+static struct log_slot *ring;
+static uint32_t tail;           // next slot claimed by producers
+static uint32_t head;           // next slot read by the logger thread
+
+static struct log_names *names[2];
+static uint32_t current;
+
+static struct log_pair *pairs;
+static struct log_client clients[LOG_CLIENTS];
+static uint32_t npairs, nclients;
 
-static q_buf queue[2][MAX_QUEUE];
-int rnum = 0;
-int qnum = 0;
+static uint64_t queued, written, rows, dropped, unnamed;
 
 static const char *sql = "PRAGMA journal_mode=WAL; " \
                          "CREATE TABLE IF NOT EXISTS log ( " \
@@ -75,12 +146,21 @@ static const char *sql = "PRAGMA journal_mode=WAL; " \
                          "       hitcount  INTEGER DEFAULT 0, " \
                          "       hitcode   INTEGER DEFAULT 0, " \
                          "       group_id  INTEGER DEFAULT 0, " \
-                         "       domain    TEXT NOT NULL, " \
+                         "       domain_id INTEGER NOT NULL, " \
                          "       category  TEXT NULL, " \
                          "       stamp     INTEGER NOT NULL); " \
-                         "CREATE UNIQUE INDEX IF NOT EXISTS idx_log ON log(ipaddr,domain); " \
+                         "CREATE UNIQUE INDEX IF NOT EXISTS idx_log ON log(ipaddr,domain_id); " \
                          "CREATE INDEX IF NOT EXISTS idx_stamp ON log(stamp); " \
 
+                         "CREATE TABLE IF NOT EXISTS domains (" \
+                         "       id        INTEGER PRIMARY KEY, " \
+                         "       name      TEXT NOT NULL UNIQUE); " \
+
+                         // the log table as it was before domains, for reports
+                         "CREATE VIEW IF NOT EXISTS log_view AS " \
+                         "       SELECT l.id, l.ipaddr, l.hitcount, l.hitcode, l.group_id, d.name AS domain, l.category, l.stamp " \
+                         "       FROM log l JOIN domains d ON d.id=l.domain_id; " \
+
                          "CREATE TABLE IF NOT EXISTS log_ipaddr (" \
                          "       id        INTEGER PRIMARY KEY AUTOINCREMENT, " \
                          "       ipaddr    UNSIGNED INTEGER NOT NULL, " \
@@ -94,59 +174,466 @@ static const char *sql = "PRAGMA journal_mode=WAL; " \
                          "       group_id  INTEGER NOT NULL); " \
                          "CREATE UNIQUE INDEX IF NOT EXISTS idx_group ON log_group(ipaddr); ";
 
+// first hit sets category, action and stamp, later ones only add up
 static const char *queries[] = { 
-    "insert or ignore into log(ipaddr,domain,category,hitcode,stamp) values(?,?,?,?,strftime('%s','now'))",
-    "update log set hitcount=hitcount+1 where ipaddr=? and domain=?",
-    "update log set group_id = (select case when count(l.group_id)>0 then l.group_id else 0 end from log_group l where l.ipaddr=?) where ipaddr=? and domain=?",
-    "insert or ignore into log_ipaddr(ipaddr,group_id,stamp) values(?, (select case when count(l.group_id)>0 then l.group_id else 0 end from log_group l where l.ipaddr=?), strftime('%s',strftime('%Y-%m-%d'),'utc'))"
+    "insert into log(ipaddr,domain_id,category,hitcode,hitcount,group_id,stamp) values(?,?,?,?,?,?,strftime('%s','now')) " \
+    "on conflict(ipaddr,domain_id) do update set hitcount=hitcount+excluded.hitcount, group_id=excluded.group_id",
+    "insert or ignore into log_ipaddr(ipaddr,group_id,stamp) values(?, ?, strftime('%s',strftime('%Y-%m-%d'),'utc'))",
+    "select id from domains where name=?",
+    "insert into domains(name) values(?)"
 };
 
-static void *dbworker(void *arg)
+static inline uint32_t name_hash(const char *s)
 {
-    q_buf *q;
-    uint32_t addr;
+    uint32_t h = 2166136261u;
 
-    while(1)
+    while(*s)
+        h = (h ^ (unsigned char)*s++)*16777619u;
+
+    return h;
+}
+
+//! called from threaded code!
+// slot of name in table t, -1 once the generation is too full
+static int name_intern(struct log_names *t, const char *name)
+{
+    uint32_t idx = name_hash(name) & (LOG_NAMES-1), probes, len, off;
+    char *p, *copy = NULL;
+
+    for(probes=0; probes<LOG_NAMES; probes++, idx = (idx+1) & (LOG_NAMES-1))
     {
-        pthread_mutex_lock(&cond_mtx);
-        pthread_cond_wait(&cond, &cond_mtx);
+        if((p = __atomic_load_n(&t->slot[idx], __ATOMIC_ACQUIRE))==NULL)
+        {
+            if(copy==NULL)
+            {
+                // keep probe chains short, the logger switches generation at half
+                if(__atomic_load_n(&t->count, __ATOMIC_RELAXED)>=LOG_NAMES/4*3)
+                    return -1;
+
+                len = strlen(name)+1;
+                off = __atomic_fetch_add(&t->used, len, __ATOMIC_RELAXED);
+
+                if(off+len>LOG_NAMES_ARENA)
+                    return -1;
+
+                copy = memcpy(t->arena+off, name, len);
+            }
+
+            // a racing producer may take the slot, its name is checked below
+            if(__atomic_compare_exchange_n(&t->slot[idx], &p, copy, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            {
+                __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+                return idx;
+            }
+        }
+
+        // a lost copy stays in the arena until the generation is reset
+        if(!strcmp(p, name))
+            return idx;
+    }
 
-        wlog(LOG_LVL3, "Database thread running on queue %d!\n", qnum^1);
+    return -1;
+}
+
+//! called from threaded code!
+// bounded multi producer queue, each slot carries the position it is
+// ready for. producers claim a position with a CAS on tail and publish the
+// record by advancing the slot sequence, a full ring is never waited on
+static bool log_push(const struct log_record *rec)
+{
+    struct log_slot *slot;
+    uint32_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED), seq;
 
-        q = queue[qnum^1];
-        
-        CALL_SQLITE(exec(db, "begin transaction", 0, 0, NULL));
-        for(int i=0; i<MAX_QUEUE; i++)
+    for(;;)
+    {
+        slot = &ring[pos & (LOG_RING-1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if(seq==pos)
         {
-            addr = ntohl(q->ipaddr);
-
-            CALL_SQLITE(bind_int(stmt_log[STMT_LOG_INSERT], 1, addr));
-            CALL_SQLITE(bind_text(stmt_log[STMT_LOG_INSERT], 2, q->domain, strlen(q->domain), SQLITE_STATIC));
-            CALL_SQLITE(bind_text(stmt_log[STMT_LOG_INSERT], 3, q->result, strlen(q->result), SQLITE_STATIC));
-            CALL_SQLITE(bind_int(stmt_log[STMT_LOG_INSERT], 4, q->hitcode));
-            CALL_SQLITE_EXPECT(step(stmt_log[STMT_LOG_INSERT]), DONE);
-            CALL_SQLITE(reset(stmt_log[STMT_LOG_INSERT]));
-            
-            CALL_SQLITE(bind_int(stmt_log[STMT_LOG_UPDATE], 1, addr));
-            CALL_SQLITE(bind_text(stmt_log[STMT_LOG_UPDATE], 2, q->domain, strlen(q->domain), SQLITE_STATIC));
-            CALL_SQLITE_EXPECT(step(stmt_log[STMT_LOG_UPDATE]), DONE);
-            CALL_SQLITE(reset(stmt_log[STMT_LOG_UPDATE]));
-
-            CALL_SQLITE(bind_int(stmt_log[STMT_GROUP_UPDATE], 1, addr));
-            CALL_SQLITE(bind_int(stmt_log[STMT_GROUP_UPDATE], 2, addr));
-            CALL_SQLITE(bind_text(stmt_log[STMT_GROUP_UPDATE], 3, q->domain, strlen(q->domain), SQLITE_STATIC));
-            CALL_SQLITE_EXPECT(step(stmt_log[STMT_GROUP_UPDATE]), DONE);
-            CALL_SQLITE(reset(stmt_log[STMT_GROUP_UPDATE]));
-
-            CALL_SQLITE(bind_int(stmt_log[STMT_IPADDR_INSERT], 1, addr));
-            CALL_SQLITE(bind_int(stmt_log[STMT_IPADDR_INSERT], 2, addr));
+            if(__atomic_compare_exchange_n(&tail, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else
+        if((int32_t)(seq-pos)<0)
+            return false;
+        else
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    }
+
+    slot->rec = *rec;
+    __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+    // a batch is waiting, wake the logger before its timer does. repeated
+    // every batch in case the logger was not asleep yet
+    if((pos-__atomic_load_n(&head, __ATOMIC_RELAXED))%LOG_BATCH==0)
+        pthread_cond_signal(&cond);
+
+    return true;
+}
+
+// single consumer side of log_push()
+static bool log_pop(struct log_record *rec)
+{
+    struct log_slot *slot = &ring[head & (LOG_RING-1)];
+
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)!=head+1)
+        return false;
+
+    *rec = slot->rec;
+    __atomic_store_n(&slot->seq, head+LOG_RING, __ATOMIC_RELEASE);
+    __atomic_store_n(&head, head+1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// retire the idle generation, switch to it when the current one fills
+static void names_rotate()
+{
+    uint32_t cur = __atomic_load_n(&current, __ATOMIC_RELAXED);
+    struct log_names *old = names[cur^1];
+
+    if(old->count>0 && __atomic_load_n(&old->refs, __ATOMIC_SEQ_CST)==0)
+    {
+        memset(old->slot, 0, sizeof(old->slot));
+        memset(old->id, 0, sizeof(old->id));
+        old->count = 0;
+        old->used = 0;
+    }
+
+    if(old->count==0 && __atomic_load_n(&names[cur]->count, __ATOMIC_RELAXED)>=LOG_NAMES/2)
+    {
+        __atomic_store_n(&current, cur^1, __ATOMIC_SEQ_CST);
+        wlog(LOG_LVL3, "Report name table switched to generation %u\n", cur^1);
+    }
+}
+
+static inline uint32_t pair_hash(uint32_t ipaddr, uint32_t domain)
+{
+    return ((ipaddr*2654435761u) ^ (domain*2246822519u))*2654435761u;
+}
+
+// fold a record into its pair, false when the table is too full
+static bool log_aggregate(const struct log_record *rec)
+{
+    struct log_pair *p;
+    uint32_t idx;
+
+    for(idx = pair_hash(rec->ipaddr, rec->domain); ; idx++)
+    {
+        p = &pairs[idx & (LOG_PAIRS-1)];
+
+        if(p->hits==0)
+            break;
+
+        if(p->ipaddr==rec->ipaddr && p->domain==rec->domain)
+        {
+            // the pair already pins this name
+            p->hits++;
+            __atomic_fetch_sub(&names[rec->domain>>31]->refs, 1, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+
+    // keep probe chains short
+    if(npairs>=LOG_PAIRS/4*3 || nclients>=LOG_CLIENTS/4*3)
+        return false;
+
+    p->ipaddr = rec->ipaddr;
+    p->domain = rec->domain;
+    p->category = rec->category;
+    p->hitcode = rec->hitcode;
+    p->hits = 1;
+    npairs++;
+
+    for(idx = rec->ipaddr*2654435761u; ; idx++)
+    {
+        struct log_client *c = &clients[idx & (LOG_CLIENTS-1)];
+
+        if(!c->used)
+        {
+            c->ipaddr = rec->ipaddr;
+            c->used = true;
+            nclients++;
+            break;
+        }
+
+        if(c->ipaddr==rec->ipaddr)
+            break;
+    }
+
+    return true;
+}
+
+// domains.id of a name, created on first sight. ids are cached in the name
+// table, so each name costs one lookup per generation
+static sqlite3_int64 domain_id(struct log_names *t, uint32_t idx, const char *domain)
+{
+    sqlite3_int64 id;
+
+    if((id = t->id[idx])!=0)
+        return id;
+
+    CALL_SQLITE(bind_text(stmt_log[STMT_DOMAIN_SELECT], 1, domain, -1, SQLITE_STATIC));
+
+    if(sqlite3_step(stmt_log[STMT_DOMAIN_SELECT])==SQLITE_ROW)
+        id = sqlite3_column_int64(stmt_log[STMT_DOMAIN_SELECT], 0);
+
+    CALL_SQLITE(reset(stmt_log[STMT_DOMAIN_SELECT]));
+
+    if(id==0)
+    {
+        CALL_SQLITE(bind_text(stmt_log[STMT_DOMAIN_INSERT], 1, domain, -1, SQLITE_STATIC));
+        CALL_SQLITE_EXPECT(step(stmt_log[STMT_DOMAIN_INSERT]), DONE);
+        CALL_SQLITE(reset(stmt_log[STMT_DOMAIN_INSERT]));
+
+        id = sqlite3_last_insert_rowid(db);
+    }
+
+    return t->id[idx] = id;
+}
+
+static void log_write(const struct log_pair *p)
+{
+    struct log_names *t = names[p->domain>>31];
+    uint32_t idx = p->domain & (LOG_NAMES-1);
+    const char *domain = __atomic_load_n(&t->slot[idx], __ATOMIC_RELAXED);
+    const char *category = cache_category_name(p->category);
+
+    CALL_SQLITE(bind_int(stmt_log[STMT_LOG_UPSERT], 1, ntohl(p->ipaddr)));
+    CALL_SQLITE(bind_int64(stmt_log[STMT_LOG_UPSERT], 2, domain_id(t, idx, domain)));
+    CALL_SQLITE(bind_text(stmt_log[STMT_LOG_UPSERT], 3, category, -1, SQLITE_STATIC));
+    CALL_SQLITE(bind_int(stmt_log[STMT_LOG_UPSERT], 4, p->hitcode));
+    CALL_SQLITE(bind_int(stmt_log[STMT_LOG_UPSERT], 5, p->hits));
+    CALL_SQLITE(bind_int(stmt_log[STMT_LOG_UPSERT], 6, group_lookup(p->ipaddr)));
+    CALL_SQLITE_EXPECT(step(stmt_log[STMT_LOG_UPSERT]), DONE);
+    CALL_SQLITE(reset(stmt_log[STMT_LOG_UPSERT]));
+
+    wlog(LOG_LVL4, "LOG upsert: %s, %s, %u hits\n", domain, category, p->hits);
+
+    // the name may be recycled from now on
+    __atomic_fetch_sub(&t->refs, 1, __ATOMIC_RELEASE);
+}
+
+// one transaction per flush, each distinct pair and client written once
+static void log_flush()
+{
+    uint32_t n, hits = 0;
+
+    if(npairs==0)
+        return;
+
+    CALL_SQLITE(exec(db, "begin transaction", 0, 0, NULL));
+
+    for(n=0; n<LOG_PAIRS; n++)
+    {
+        if(pairs[n].hits>0)
+        {
+            log_write(&pairs[n]);
+            hits += pairs[n].hits;
+        }
+    }
+
+    // CALL_SQLITE declares its own i
+    for(n=0; n<LOG_CLIENTS; n++)
+    {
+        if(clients[n].used)
+        {
+            CALL_SQLITE(bind_int(stmt_log[STMT_IPADDR_INSERT], 1, ntohl(clients[n].ipaddr)));
+            CALL_SQLITE(bind_int(stmt_log[STMT_IPADDR_INSERT], 2, group_lookup(clients[n].ipaddr)));
             CALL_SQLITE_EXPECT(step(stmt_log[STMT_IPADDR_INSERT]), DONE);
             CALL_SQLITE(reset(stmt_log[STMT_IPADDR_INSERT]));
+        }
+    }
+
+    CALL_SQLITE(exec(db, "commit transaction", 0, 0, NULL));
+
+    wlog(LOG_LVL3, "Database thread wrote %u hits as %u rows\n", hits, npairs);
+
+    __atomic_fetch_add(&written, hits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rows, npairs, __ATOMIC_RELAXED);
 
-            wlog(LOG_LVL3, "LOG insert: %s, %s\n", q->domain, q->result);
-            q++;
+    memset(pairs, 0, sizeof(*pairs)*LOG_PAIRS);
+    memset(clients, 0, sizeof(clients));
+    npairs = nclients = 0;
+}
+
+static uint64_t now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+// absolute CLOCK_REALTIME time msec from now
+static void timeout_at(struct timespec *ts, int msec)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += msec/1000;
+    ts->tv_nsec += (msec%1000)*1000000;
+
+    if(ts->tv_nsec>=1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// true when report.db still has the domain TEXT column in log
+static bool log_legacy()
+{
+    sqlite3_stmt *stmt;
+    bool legacy = false;
+
+    CALL_SQLITE(prepare_v2(db, "select 1 from pragma_table_info('log') where name='domain'", -1, &stmt, NULL));
+
+    legacy = sqlite3_step(stmt)==SQLITE_ROW;
+
+    CALL_SQLITE(finalize(stmt));
+
+    return legacy;
+}
+
+static void log_open()
+{
+    CALL_SQLITE(open_v2(config.reportdb, &db, SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL));
+
+    if(log_legacy())
+        wquit("FATAL: %s uses the old log schema, convert it with dnsfilter-migrate\n", config.reportdb);
+
+    CALL_SQLITE(exec(db, sql, NULL, NULL, NULL));
+
+    CALL_SQLITE(prepare_v2(db, queries[STMT_LOG_UPSERT], strlen(queries[STMT_LOG_UPSERT]), &stmt_log[STMT_LOG_UPSERT], NULL));
+    CALL_SQLITE(prepare_v2(db, queries[STMT_IPADDR_INSERT], strlen(queries[STMT_IPADDR_INSERT]), &stmt_log[STMT_IPADDR_INSERT], NULL));
+    CALL_SQLITE(prepare_v2(db, queries[STMT_DOMAIN_SELECT], strlen(queries[STMT_DOMAIN_SELECT]), &stmt_log[STMT_DOMAIN_SELECT], NULL));
+    CALL_SQLITE(prepare_v2(db, queries[STMT_DOMAIN_INSERT], strlen(queries[STMT_DOMAIN_INSERT]), &stmt_log[STMT_DOMAIN_INSERT], NULL));
+
+    // cached domain ids belong to the previous file
+    if(names[0]!=NULL)
+    {
+        memset(names[0]->id, 0, sizeof(names[0]->id));
+        memset(names[1]->id, 0, sizeof(names[1]->id));
+    }
+
+    group_load(db, true);
+}
+
+static void log_release()
+{
+    CALL_SQLITE(finalize(stmt_log[STMT_LOG_UPSERT]));
+    CALL_SQLITE(finalize(stmt_log[STMT_IPADDR_INSERT]));
+    CALL_SQLITE(finalize(stmt_log[STMT_DOMAIN_SELECT]));
+    CALL_SQLITE(finalize(stmt_log[STMT_DOMAIN_INSERT]));
+    CALL_SQLITE(close(db));
+}
+
+// write out everything queued before the request, bounded by LOG_DRAIN_MSEC
+static void log_drain()
+{
+    struct log_record rec;
+    uint32_t end = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    uint64_t due = now_msec()+LOG_DRAIN_MSEC;
+
+    while((int32_t)(end-head)>0 && now_msec()<due)
+    {
+        // a producer claimed the slot but did not publish it yet
+        if(!log_pop(&rec))
+        {
+            sched_yield();
+            continue;
+        }
+
+        if(!log_aggregate(&rec))
+        {
+            log_flush();
+            log_aggregate(&rec);
+        }
+    }
+
+    log_flush();
+
+    if((int32_t)(end-head)>0)
+        wlog(LOG_WARN, "Report drain timed out, %u records not written\n", end-head);
+}
+
+static void *dbworker(void *arg)
+{
+    struct log_record rec;
+    struct timespec ts;
+    uint64_t flushed = now_msec(), polled = flushed, now;
+    int n, wait;
+
+    while(1)
+    {
+        // fold what is queued, a full table is written out first
+        for(n=0; n<LOG_RING && log_pop(&rec); n++)
+        {
+            if(!log_aggregate(&rec))
+            {
+                log_flush();
+                flushed = now_msec();
+                log_aggregate(&rec);
+            }
+        }
+
+        if((now = now_msec())-flushed>=config.logflush)
+        {
+            log_flush();
+            flushed = now;
+        }
+
+        // groups are edited by the report frontend
+        if(now-polled>=LOG_GROUP_SECS*1000)
+        {
+            group_load(db, false);
+            polled = now;
         }
-        CALL_SQLITE(exec(db, "commit transaction", 0, 0, NULL));
+
+        names_rotate();
+
+        switch(__atomic_load_n(&request, __ATOMIC_ACQUIRE))
+        {
+            case LOG_QUIT:
+                log_drain();
+                return 0;
+
+            case LOG_RELOAD:
+                log_drain();
+                flushed = now_msec();
+
+                // report.db may have been moved away
+                log_release();
+                log_open();
+
+                pthread_mutex_lock(&cond_mtx);
+                request = LOG_RUN;
+                reloads++;
+                pthread_cond_broadcast(&drained);
+                pthread_mutex_unlock(&cond_mtx);
+
+                wlog(LOG_LVL1, "Report database reopened\n");
+                continue;
+        }
+
+        // still busy, dont sleep
+        if(n==LOG_RING)
+            continue;
+
+        // sleep until the oldest hit is due, a batch is waiting or a
+        // request comes in
+        wait = config.logflush-(now_msec()-flushed);
+
+        if(wait>LOG_GROUP_SECS*1000-(int)(now_msec()-polled))
+            wait = LOG_GROUP_SECS*1000-(now_msec()-polled);
+
+        timeout_at(&ts, wait>0?wait:0);
+
+        pthread_mutex_lock(&cond_mtx);
+
+        if(request==LOG_RUN && __atomic_load_n(&tail, __ATOMIC_RELAXED)-head<LOG_BATCH)
+            pthread_cond_timedwait(&cond, &cond_mtx, &ts);
 
         pthread_mutex_unlock(&cond_mtx);
     }
@@ -154,78 +641,171 @@ static void *dbworker(void *arg)
     return 0;
 }
 
+// ask the report thread for something, signalled under the lock so the
+// request cant slip in between its check and its sleep
+static void log_request(uint32_t what)
+{
+    pthread_mutex_lock(&cond_mtx);
+    __atomic_store_n(&request, what, __ATOMIC_RELEASE);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&cond_mtx);
+}
+
 void log_init()
 {
-    CALL_SQLITE(open_v2(config.reportdb, &db, SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL));
-    CALL_SQLITE(exec(db, sql, NULL, NULL, NULL));
+    if(config.logflush<=0)
+        config.logflush = LOG_FLUSH_MSEC;
 
-    CALL_SQLITE(prepare_v2(db, queries[STMT_LOG_INSERT], strlen(queries[STMT_LOG_INSERT]), &stmt_log[STMT_LOG_INSERT], NULL));
-    CALL_SQLITE(prepare_v2(db, queries[STMT_LOG_UPDATE], strlen(queries[STMT_LOG_UPDATE]), &stmt_log[STMT_LOG_UPDATE], NULL));
-    CALL_SQLITE(prepare_v2(db, queries[STMT_GROUP_UPDATE], strlen(queries[STMT_GROUP_UPDATE]), &stmt_log[STMT_GROUP_UPDATE], NULL));
-    CALL_SQLITE(prepare_v2(db, queries[STMT_IPADDR_INSERT], strlen(queries[STMT_IPADDR_INSERT]), &stmt_log[STMT_IPADDR_INSERT], NULL));
+    group_init();
+    log_open();
 
-    memset(&queue, 0, sizeof(q_buf)*MAX_QUEUE*2);
+    if((ring = calloc(LOG_RING, sizeof(*ring)))==NULL ||
+       (names[0] = calloc(1, sizeof(struct log_names)))==NULL ||
+       (names[1] = calloc(1, sizeof(struct log_names)))==NULL ||
+       (pairs = calloc(LOG_PAIRS, sizeof(*pairs)))==NULL)
+        wquit("Could not allocate the report queue\n");
+
+    for(uint32_t i=0; i<LOG_RING; i++)
+        ring[i].seq = i;
+
+    head = tail = 0;
+    current = 0;
+    npairs = nclients = 0;
+    memset(clients, 0, sizeof(clients));
+    queued = written = rows = dropped = unnamed = 0;
+    request = LOG_RUN;
+    reloads = 0;
 
-    pthread_mutex_init(&mtx, NULL);
     pthread_mutex_init(&cond_mtx, NULL);
     pthread_cond_init(&cond, NULL);
+    pthread_cond_init(&drained, NULL);
 
     // create thread and pass its queue block
     if(pthread_create(&thread, NULL, dbworker, NULL))
         wquit("dbworker pthread_create() failed\n");
 
-    wlog(LOG_LVL3, "Report thread init.\n");
+    wlog(LOG_LVL3, "Report thread init, flushing every %d msec.\n", config.logflush);
 }
 
-//! called from threaded code!
-void log_insert(uint32_t ipaddr, char *domain, char *cat, int hitcode)
+// commit what is pending and reopen report.db, waits for the drain
+void log_reload()
 {
-    q_buf *q = queue[qnum]+rnum;
+    struct timespec ts;
+    uint32_t target;
 
     pthread_mutex_lock(&cond_mtx);
+    target = reloads+1;
+    pthread_mutex_unlock(&cond_mtx);
 
-    strncpy(q->domain, domain, sizeof(q->domain));
-    strncpy(q->result, cat, sizeof(q->result));
-    q->ipaddr = ipaddr;
-    q->hitcode = hitcode;
-    rnum++;
+    log_request(LOG_RELOAD);
+    timeout_at(&ts, LOG_DRAIN_MSEC*2);
 
-    // queue is full, dump contents to database
-    if(rnum>=MAX_QUEUE)
+    pthread_mutex_lock(&cond_mtx);
+
+    while((int32_t)(reloads-target)<0)
     {
-        // swap queues
-        rnum=0;
-        qnum^=1;
+        if(pthread_cond_timedwait(&drained, &cond_mtx, &ts)==ETIMEDOUT)
+        {
+            wlog(LOG_WARN, "Report reload still running\n");
+            break;
+        }
+    }
 
-        // notify database thread
-        pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&cond_mtx);
+}
+
+//! called from threaded code!
+// never blocks, records are dropped and counted when the logger lags
+void log_insert(uint32_t ipaddr, const char *domain, const char *cat, int hitcode)
+{
+    struct log_record rec;
+    struct log_names *t;
+    uint32_t gen;
+    int idx, cid;
+
+    // pin a generation, the logger may be switching away from it
+    for(;;)
+    {
+        gen = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+        t = names[gen];
+
+        __atomic_fetch_add(&t->refs, 1, __ATOMIC_SEQ_CST);
+
+        if(__atomic_load_n(&current, __ATOMIC_SEQ_CST)==gen)
+            break;
 
-        wlog(LOG_LVL3, "Notify database thread!\n");
+        __atomic_fetch_sub(&t->refs, 1, __ATOMIC_RELEASE);
+    }
+
+    if((idx = name_intern(t, domain))<0)
+    {
+        __atomic_fetch_sub(&t->refs, 1, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&unnamed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    cid = cat!=NULL?cache_category_id(cat):-1;
+
+    rec.ipaddr = ipaddr;
+    rec.domain = gen<<31 | (uint32_t)idx;
+    rec.category = cid<0?LOG_NO_CATEGORY:cid;
+    rec.hitcode = hitcode;
+
+    // the queued record keeps the generation pinned until it is written
+    if(!log_push(&rec))
+    {
+        __atomic_fetch_sub(&t->refs, 1, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
-    pthread_mutex_unlock(&cond_mtx);
+
+    __atomic_fetch_add(&queued, 1, __ATOMIC_RELAXED);
 
     wlog(LOG_LVL4, "Record %s added to database queue\n", domain);
 }
 
+void log_statistics()
+{
+    uint32_t backlog = __atomic_load_n(&tail, __ATOMIC_RELAXED)-__atomic_load_n(&head, __ATOMIC_RELAXED);
+
+    wlog(LOG_LVL4, "Report queue: %lu queued, %lu written as %lu rows, %u pending, %lu dropped full, %lu dropped unnamed\n",
+            (unsigned long)__atomic_load_n(&queued, __ATOMIC_RELAXED), (unsigned long)__atomic_load_n(&written, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&rows, __ATOMIC_RELAXED), backlog, (unsigned long)__atomic_load_n(&dropped, __ATOMIC_RELAXED), (unsigned long)__atomic_load_n(&unnamed, __ATOMIC_RELAXED));
+}
+
 void log_close()
 {
-    void *res;
+    struct timespec ts;
 
-    // cancel active thread
-    pthread_cancel(thread);
-    pthread_join(thread, &res);
+    // producers are gone, let the thread write out what they left
+    log_request(LOG_QUIT);
+    timeout_at(&ts, LOG_DRAIN_MSEC*2);
 
-    if(res==PTHREAD_CANCELED)
+    if(pthread_timedjoin_np(thread, NULL, &ts)!=0)
+    {
+        // stuck inside sqlite, the open transaction is rolled back on close
+        wlog(LOG_WARN, "Database thread did not stop, cancelling it\n");
+
+        pthread_cancel(thread);
+        pthread_join(thread, NULL);
+    }
+    else
         wlog(LOG_LVL3, "Database thread stopped successfully!\n");
 
-    CALL_SQLITE(finalize(stmt_log[STMT_LOG_INSERT]));
-    CALL_SQLITE(finalize(stmt_log[STMT_LOG_UPDATE]));
-    CALL_SQLITE(finalize(stmt_log[STMT_GROUP_UPDATE]));
-    CALL_SQLITE(finalize(stmt_log[STMT_IPADDR_INSERT]));
-    CALL_SQLITE(close(db));
-    
+    log_release();
+    group_close();
+
+    free(ring);
+    free(pairs);
+    free(names[0]);
+    free(names[1]);
+
+    names[0] = names[1] = NULL;
+
     // destroy thread mutex
-    pthread_mutex_destroy(&mtx);
+    pthread_mutex_destroy(&cond_mtx);
+    pthread_cond_destroy(&cond);
+    pthread_cond_destroy(&drained);
 }
 
-#endif
\ No newline at end of file
+#endif
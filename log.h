@@ -42,7 +42,13 @@ void log_init();
 
 void log_close();
 
-void log_insert(uint32_t ipaddr, char *domain, char *cat, int hitcode);
+// commit pending records and reopen the report database
+void log_reload();
+
+// queues a record for the report thread, never blocks
+void log_insert(uint32_t ipaddr, const char *domain, const char *cat, int hitcode);
+
+void log_statistics();
 
 #ifdef	__cplusplus
 }
@@ -60,6 +60,15 @@ SOFTWARE.
 #include "acl.h"
 #include "log.h"
 #include "http.h"
+#include "refresh.h"
+#include "retry.h"
+#include "domain.h"
+#include "peer.h"
+#include "engine.h"
+#include "pool.h"
+#include "deadline.h"
+#include "plugin.h"
+#include "group.h"
 
 #define VERSION "1.0a"
 
@@ -68,44 +77,51 @@ SOFTWARE.
 #endif
 
 static volatile bool quit = 0;
+static volatile bool reload = 0;
 
 static queueinfo_t queue[NUM_THREADS];
 static pthread_t thread[NUM_THREADS];
 
 static pthread_mutex_t veredict_mtx;
 
-// queue_callback is called each time a packet arrives on netfilter, *data is a
-// pointer to the current queue info struct
-static int queue_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data)
+// packet held while its domain is classified in background
+struct deferred
 {
-    struct nfqnl_msg_packet_hdr *ph;
-    uint8_t *packet;
+    struct deadline_t timer;    // first member, the timer hands it back
+    int refs;                   // engine callback and deadline timer
+    bool answered;
+
+    struct nfq_q_handle *qh;
+    queueinfo_t *qinfo;
+    uint32_t id;
     uint32_t nfmark;
-    int payload_len;
+    int len;
+    uint8_t packet[];
+};
+
+static void packet_resume(const char *category, void *arg);
+static bool deferred_claim(struct deferred *d);
+static void deferred_release(struct deferred *d);
+
+// check a DNS answer against the ACLs and set its verdict. returns false
+// when the verdict was deferred to a background classification
+static bool packet_process(struct nfq_q_handle *qh, uint32_t id, uint32_t nfmark, uint8_t *packet, int payload_len,
+                           queueinfo_t *qinfo, int mode, int *result)
+{
     struct iphdr *ip;
-    struct udphdr *udp;
-    struct tcphdr *tcp;
+    struct udphdr *udp = NULL;
+    struct tcphdr *tcp = NULL;
     struct dnshdr *dns;
     struct dnsanswer *answer;
     struct dnstype *question;
     struct in_addr *addr;
     uint8_t *end, *start;
     char domain[256];
+    char pending[256];
+    const char *category;
     size_t dnsize, asize = 0;
 
-    // to measure response times
-    clock_t callback_start = clock();
-    clock_t callback_end;
-
     struct acl_t *acl = NULL;
-    int result;
-
-    // get packet header and nfmark from queue
-    ph = nfq_get_msg_packet_hdr(nfa);
-    nfmark = nfq_get_nfmark(nfa);
-
-    uint32_t id = htonl(ph->packet_id);
-    payload_len = nfq_get_payload(nfa, &packet);
 
     ip = (struct iphdr *)packet;
     
@@ -124,7 +140,11 @@ static int queue_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
     {
         wlog(LOG_WARN, "Unsupported packet type %d received\n", ip->protocol);
 
-        return nfq_set_verdict(qh, id, NF_ACCEPT, payload_len, packet);
+        pthread_mutex_lock(&veredict_mtx);
+        *result = nfq_set_verdict(qh, id, NF_ACCEPT, payload_len, packet);
+        pthread_mutex_unlock(&veredict_mtx);
+
+        return true;
     }
 
     // raw access to DNS bytes
@@ -148,7 +168,43 @@ static int queue_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
     wlog(LOG_LVL4, "Domain: %s, Question type: %d\n",domain, ntohs(question->type));
 
     // check acl match
-    acl = acl_check(ip, nfmark, (queueinfo_t *)data, domain);
+    acl = acl_check(ip, nfmark, qinfo, domain, mode, pending, &category);
+
+    if(acl!=NULL && acl->action==T_PENDING)
+    {
+        struct deferred *d;
+
+        // keep a copy of the packet, the thread goes back to its queue
+        if((d = malloc(sizeof(*d)+payload_len))!=NULL)
+        {
+            d->qh = qh;
+            d->qinfo = qinfo;
+            d->id = id;
+            d->nfmark = nfmark;
+            d->len = payload_len;
+            d->answered = false;
+            memcpy(d->packet, packet, payload_len);
+
+            // armed before queueing, so the wait is measured from here
+            d->refs = deadline_start(&d->timer)?2:1;
+
+            if(engine_classify(pending, packet_resume, d))
+                return false;
+
+            // the timer may have answered already, else it finds the
+            // packet answered when it expires
+            if(!deferred_claim(d))
+            {
+                deferred_release(d);
+                return false;
+            }
+
+            deferred_release(d);
+        }
+
+        // engine is full, classify inline
+        acl = acl_check(ip, nfmark, qinfo, domain, ACL_SYNC, pending, &category);
+    }
 
     if(acl!=NULL)
     {
@@ -206,8 +262,7 @@ static int queue_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 
             // log acl actions
 #ifndef _NO_DATABASE
-            // TODO
-            log_insert(ip->daddr, domain, config.validlicense?entry->category:"5A", acl->action);
+            log_insert(ip->daddr, domain, config.validlicense?category:"5A", acl->action);
 #endif
         }
         else
@@ -218,8 +273,7 @@ static int queue_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
     }
 #ifndef _NO_DATABASE
     else
-        // TODO
-        log_insert(ip->daddr, domain, config.validlicense?entry->category:"5A", T_NOMATCH);
+        log_insert(ip->daddr, domain, config.validlicense?category:"5A", T_NOMATCH);
 #endif
 
     // recompute packet checksums
@@ -234,9 +288,80 @@ bogus:
     pthread_mutex_lock(&veredict_mtx);
 
     // replace packet and set veredict to accept
-    result = nfq_set_verdict(qh, id, NF_ACCEPT, payload_len, packet);
+    *result = nfq_set_verdict(qh, id, NF_ACCEPT, payload_len, packet);
     pthread_mutex_unlock(&veredict_mtx);
 
+    return true;
+}
+
+static void deferred_release(struct deferred *d)
+{
+    if(__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL)==0)
+        free(d);
+}
+
+// first of engine callback and deadline timer sets the verdict
+static bool deferred_claim(struct deferred *d)
+{
+    return !__atomic_exchange_n(&d->answered, true, __ATOMIC_ACQ_REL);
+}
+
+//! called from the engine thread, the domain is cached or failed by now
+static void packet_resume(const char *category, void *arg)
+{
+    struct deferred *d = arg;
+    int result;
+
+    if(deferred_claim(d))
+    {
+        deadline_record(&d->timer, false);
+        packet_process(d->qh, d->id, d->nfmark, d->packet, d->len, d->qinfo, ACL_CACHED, &result);
+    }
+
+    deferred_release(d);
+}
+
+//! called from the deadline thread, the lookup goes on in background
+static void packet_expire(struct deadline_t *t)
+{
+    struct deferred *d = (struct deferred *)t;
+    int result;
+
+    if(deferred_claim(d))
+    {
+        deadline_record(&d->timer, true);
+        wlog(LOG_LVL3, "Packet %u classification deadline expired\n", d->id);
+
+        packet_process(d->qh, d->id, d->nfmark, d->packet, d->len, d->qinfo, ACL_DEADLINE, &result);
+    }
+
+    deferred_release(d);
+}
+
+// queue_callback is called each time a packet arrives on netfilter, *data is a
+// pointer to the current queue info struct
+static int queue_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data)
+{
+    struct nfqnl_msg_packet_hdr *ph;
+    uint8_t *packet;
+    uint32_t nfmark;
+    int payload_len;
+    int result = 0;
+
+    // to measure response times
+    clock_t callback_start = clock();
+    clock_t callback_end;
+
+    // get packet header and nfmark from queue
+    ph = nfq_get_msg_packet_hdr(nfa);
+    nfmark = nfq_get_nfmark(nfa);
+
+    uint32_t id = htonl(ph->packet_id);
+    payload_len = nfq_get_payload(nfa, &packet);
+
+    if(!packet_process(qh, id, nfmark, packet, payload_len, (queueinfo_t *)data, config.engineflight>0?ACL_ASYNC:ACL_SYNC, &result))
+        wlog(LOG_LVL4, "Packet %u verdict deferred\n", id);
+
     callback_end = clock();
     wlog(LOG_LVL4, "callback time: %1.3f sec\n", (float)(callback_end - callback_start) / CLOCKS_PER_SEC);
 
@@ -257,7 +382,7 @@ void *worker(void *arg)
     {
         wlog(LOG_LVL4, "Thread %d received a packet\n", queue->tid);
 
-        nfq_handle_packet(queue->nfq, buf, rv);
+        nfq_handle_packet(queue->nfq, (char *)buf, rv);
         queue->packets++;
     }
 
@@ -272,6 +397,11 @@ void signal_quit()
     quit = true;
 }
 
+void signal_reload()
+{
+    reload = true;
+}
+
 void dns_init()
 {
     struct hostent *rwhost;
@@ -287,14 +417,25 @@ void dns_init()
     rwhost = dnslookup(config.rwhost);
     memcpy(&config.rwaddr, rwhost->h_addr, rwhost->h_length);
 
+    // every address of the classification server joins the pool
     server = dnslookup(config.serverdns);
-    memcpy(&config.serveraddr[0], server->h_addr, server->h_length);
+
+    for(int i=0; server->h_addr_list[i]!=NULL && i<sizeof(config.serveraddr)/sizeof(config.serveraddr[0]); i++)
+        memcpy(&config.serveraddr[i], server->h_addr_list[i], server->h_length);
 }
 
 void startup()
 {
     dns_init();
+    pool_init();
+    plugin_init();
+    deadline_init(packet_expire);
+    domain_init();
+    engine_init();
     cache_init();
+    retry_init();
+    refresh_init();
+    peer_init();
 
 #ifndef _NO_DATABASE
     log_init();
@@ -310,7 +451,7 @@ void startup()
         queue[i].tid = i;
         queue[i].nfq = nfq_open();
 
-        if(!curl_init(&queue[i], false))
+        if(!curl_init(&queue[i]))
             wquit("Failed to initialize curl!\n");
 
         if(!queue[i].nfq)
@@ -347,6 +488,18 @@ void startup()
             wlog(LOG_LVL1, "Cache status:\n");
             wlog(LOG_LVL1, "<----------->\n");
             cache_statistics();
+            refresh_statistics();
+            retry_statistics();
+            domain_statistics();
+            peer_statistics();
+            engine_statistics();
+            pool_statistics();
+            deadline_statistics();
+            plugin_statistics();
+#ifndef _NO_DATABASE
+            log_statistics();
+            group_statistics();
+#endif
 
             wlog(LOG_LVL1, "Thread status:\n");
             wlog(LOG_LVL1, "<----------->\n");
@@ -362,6 +515,16 @@ void startup()
             wlog(LOG_LVL1, "Average thread packets: %0.2f\n", pps2);
         }
 
+        // outside the signal handler, it waits for the report thread
+        if(reload)
+        {
+            reload = false;
+            wlog(LOG_LVL0, "Reloading...\n");
+#ifndef _NO_DATABASE
+            log_reload();
+#endif
+        }
+
         sleep(1);
     }
     // end main code loop
@@ -376,7 +539,15 @@ void startup()
 
         if(res==PTHREAD_CANCELED)
             wlog(LOG_LVL3, "Thread %d stopped successfully!\n", i);
+    }
+
+    // deferred packets get their verdict while the queues are still open
+    engine_close();
+    deadline_close();
+    plugin_close();
 
+    for(int i = 0; i<NUM_THREADS; i++)
+    {
         // close nfqueue handlers
         nfq_destroy_queue(queue[i].nfq_q);
         nfq_close(queue[i].nfq);
@@ -387,6 +558,11 @@ void startup()
 #ifndef _NO_DATABASE
     log_close();
 #endif
+    peer_close();
+    // refresh hands failures to retry, stop it first
+    refresh_close();
+    retry_close();
+    pool_close();
     cache_flush();
 }
 
@@ -430,6 +606,7 @@ int main(int argc, char** argv)
 
     signal(SIGINT, signal_quit);
     signal(SIGTERM, signal_quit);
+    signal(SIGHUP, signal_reload);
     //signal(SIGPIPE, SIG_IGN);
 
     if(config.daemon)
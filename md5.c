@@ -299,6 +299,43 @@ void MD5_Final(unsigned char *result, MD5_CTX *ctx)
     memset(ctx, 0, sizeof(*ctx));
 }
 
+void HMAC_MD5(const void *key, unsigned long keylen, const void *data, unsigned long size, unsigned char *result)
+{
+    MD5_CTX ctx;
+    unsigned char k[MD5_BLOCK_LENGTH], pad[MD5_BLOCK_LENGTH];
+
+    // keys longer than a block are hashed first
+    memset(k, 0, sizeof(k));
+
+    if(keylen>MD5_BLOCK_LENGTH)
+    {
+        MD5_Init(&ctx);
+        MD5_Update(&ctx, key, keylen);
+        MD5_Final(k, &ctx);
+    }
+    else
+        memcpy(k, key, keylen);
+
+    for(int i = 0; i<MD5_BLOCK_LENGTH; i++)
+        pad[i] = k[i]^0x36;
+
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, pad, MD5_BLOCK_LENGTH);
+    MD5_Update(&ctx, data, size);
+    MD5_Final(result, &ctx);
+
+    for(int i = 0; i<MD5_BLOCK_LENGTH; i++)
+        pad[i] = k[i]^0x5c;
+
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, pad, MD5_BLOCK_LENGTH);
+    MD5_Update(&ctx, result, MD5_DIGEST_LENGTH);
+    MD5_Final(result, &ctx);
+
+    memset(k, 0, sizeof(k));
+    memset(pad, 0, sizeof(pad));
+}
+
 char *dump_hexdigest(unsigned char *digest)
 {
     static char buf[33];
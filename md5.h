@@ -44,6 +44,9 @@ void MD5_Init(MD5_CTX *ctx);
 void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size);
 void MD5_Final(unsigned char *result, MD5_CTX *ctx);
 
+// RFC 2104 keyed digest
+void HMAC_MD5(const void *key, unsigned long keylen, const void *data, unsigned long size, unsigned char *result);
+
 char *dump_hexdigest(unsigned char *digest);
 
 #endif
@@ -0,0 +1,561 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Classification sharing between dnsfilter nodes.
+ *
+ * New results are queued and sent in batches to every peer_host, which
+ * may be unicast or multicast addresses. A datagram carries a header and
+ * a list of (hash, ttl, category) records, signed with an HMAC of peer_key.
+ * Each record goes out in two consecutive batches, so a single lost
+ * datagram costs nothing. Anything lost beyond that only means the receiver
+ * classifies the domain itself.
+ *
+ * Multicast groups accept any source, the signature is what authenticates
+ * a sender. Replays are refused by the per node sequence, and datagrams
+ * sent more than PEER_WINDOW seconds away from the receiver clock are
+ * refused, so nodes must keep their clocks in sync.
+ *
+ * Datagram layout, integers in network order:
+ *
+ *   magic[4] "DFPR", version(1), count(1), reserved(2), node(4), seq(4), stamp(4)
+ *   count x { hash[16], ttl(4), len(1), category[len] }
+ *   hmac_md5(key, datagram)[16]
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "peer.h"
+#include "cache.h"
+#include "utils.h"
+#include "config.h"
+
+#define PEER_MAGIC "DFPR"
+#define PEER_VERSION 2
+#define PEER_PORT 4081
+#define PEER_DATAGRAM 1400
+#define PEER_HEADER_SIZE 20
+#define PEER_CATEGORY_LEN 36
+#define PEER_BATCH 2048         // records queued per interval
+#define PEER_BATCH_MSEC 100
+#define PEER_NODES 64           // senders tracked for replays and losses
+#define PEER_WINDOW 30          // max seconds between send and receive
+
+struct peer_record
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    uint32_t expire;
+    char category[PEER_CATEGORY_LEN];
+};
+
+// last sequence seen from each remote node
+struct peer_node
+{
+    uint32_t node;
+    uint32_t seq;
+    uint32_t stamp;             // receive time, 0 for a free slot
+};
+
+static int sock = -1;
+static bool listening;
+static struct sockaddr_in peers[sizeof(config.peerhost)/sizeof(config.peerhost[0])];
+static int npeers;
+static uint32_t node_id;
+static uint32_t sequence;
+
+static pthread_t sender, receiver;
+static pthread_mutex_t mtx;
+static pthread_cond_t cond;
+static bool quit;
+
+// double buffered queue, the sender drains one while the other fills.
+// the last batch sent is kept to go out once more
+static struct peer_record batch[2][PEER_BATCH];
+static int nbatch[2];
+static int cur;
+static struct peer_record last[PEER_BATCH];
+static int nlast;
+
+static struct peer_node nodes[PEER_NODES];
+
+static uint32_t sent_datagrams, sent_records, queue_dropped;
+static uint32_t recv_datagrams, recv_records, rejected, replayed, lost;
+
+/*
+ * 
+ */
+
+static void datagram_sign(const uint8_t *buf, size_t len, unsigned char *digest)
+{
+    HMAC_MD5(config.peerkey, strlen(config.peerkey), buf, len, digest);
+}
+
+// constant time, a mismatch position tells nothing about the key
+static bool digest_equal(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char diff = 0;
+
+    for(int i=0; i<MD5_DIGEST_LENGTH; i++)
+        diff |= a[i]^b[i];
+
+    return diff==0;
+}
+
+static void datagram_send(uint8_t *buf, size_t len, int count)
+{
+    uint32_t seq = htonl(sequence++), stamp = htonl(time(NULL));
+
+    buf[5] = count;
+    memcpy(buf+12, &seq, sizeof(seq));
+    memcpy(buf+16, &stamp, sizeof(stamp));
+
+    datagram_sign(buf, len, buf+len);
+    len += MD5_DIGEST_LENGTH;
+
+    for(int i=0; i<npeers; i++)
+    {
+        if(sendto(sock, buf, len, 0, (struct sockaddr *)&peers[i], sizeof(peers[i]))<0)
+            wlog(LOG_LVL3, "Peer send to %s failed: %s\n", inet_ntoa(peers[i].sin_addr), strerror(errno));
+    }
+
+    sent_datagrams++;
+    sent_records += count;
+}
+
+// pack records into as few datagrams as possible
+static void batch_send(struct peer_record *recs, int n)
+{
+    uint8_t buf[PEER_DATAGRAM+MD5_DIGEST_LENGTH];
+    uint32_t now = time(NULL), ttl, node = htonl(node_id);
+    size_t len = PEER_HEADER_SIZE, clen;
+    int count = 0;
+
+    memset(buf, 0, PEER_HEADER_SIZE);
+    memcpy(buf, PEER_MAGIC, 4);
+    buf[4] = PEER_VERSION;
+    memcpy(buf+8, &node, sizeof(node));
+
+    for(int i=0; i<n; i++)
+    {
+        if(recs[i].expire<=now)
+            continue;
+
+        clen = strlen(recs[i].category);
+
+        if(len+MD5_DIGEST_LENGTH+5+clen>PEER_DATAGRAM || count==255)
+        {
+            datagram_send(buf, len, count);
+            len = PEER_HEADER_SIZE;
+            count = 0;
+        }
+
+        ttl = htonl(recs[i].expire-now);
+
+        memcpy(buf+len, recs[i].hash, MD5_DIGEST_LENGTH);
+        memcpy(buf+len+MD5_DIGEST_LENGTH, &ttl, sizeof(ttl));
+        buf[len+MD5_DIGEST_LENGTH+4] = clen;
+        memcpy(buf+len+MD5_DIGEST_LENGTH+5, recs[i].category, clen);
+
+        len += MD5_DIGEST_LENGTH+5+clen;
+        count++;
+    }
+
+    if(count>0)
+        datagram_send(buf, len, count);
+}
+
+static void *peer_sender(void *arg)
+{
+    struct timespec ts;
+    int full;
+
+    pthread_mutex_lock(&mtx);
+
+    while(!quit)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PEER_BATCH_MSEC*1000000L;
+        ts.tv_sec += ts.tv_nsec/1000000000L;
+        ts.tv_nsec %= 1000000000L;
+
+        // a full batch wakes the sender early
+        if(nbatch[cur]<PEER_BATCH)
+            pthread_cond_timedwait(&cond, &mtx, &ts);
+
+        if(nbatch[cur]==0 && nlast==0)
+            continue;
+
+        full = cur;
+        cur ^= 1;
+
+        pthread_mutex_unlock(&mtx);
+
+        // repeat of the previous interval, then the new records
+        batch_send(last, nlast);
+        batch_send(batch[full], nbatch[full]);
+
+        memcpy(last, batch[full], nbatch[full]*sizeof(struct peer_record));
+        nlast = nbatch[full];
+
+        pthread_mutex_lock(&mtx);
+        nbatch[full] = 0;
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    return 0;
+}
+
+static bool peer_known(struct sockaddr_in *addr)
+{
+    for(int i=0; i<npeers; i++)
+    {
+        // multicast groups accept any member
+        if(IN_MULTICAST(ntohl(peers[i].sin_addr.s_addr)) || peers[i].sin_addr.s_addr==addr->sin_addr.s_addr)
+            return true;
+    }
+
+    return false;
+}
+
+// accept only increasing sequences from a node, counting the gaps. a node
+// idle for PEER_WINDOW frees its slot, its old datagrams fail the stamp check
+static bool peer_sequence(uint32_t node, uint32_t seq, uint32_t now)
+{
+    struct peer_node *n, *slot = NULL;
+
+    for(int i=0; i<PEER_NODES; i++)
+    {
+        n = &nodes[i];
+
+        if(n->stamp!=0 && n->node==node)
+        {
+            if((int32_t)(seq-n->seq)<=0)
+                return false;
+
+            if(seq-n->seq-1<1024)
+                lost += seq-n->seq-1;
+
+            n->seq = seq;
+            n->stamp = now;
+            return true;
+        }
+
+        if(slot==NULL && (n->stamp==0 || n->stamp+PEER_WINDOW<now))
+            slot = n;
+    }
+
+    // too many live senders, one more could push out a node to replay
+    if(slot==NULL)
+        return false;
+
+    slot->node = node;
+    slot->seq = seq;
+    slot->stamp = now;
+
+    return true;
+}
+
+static void datagram_receive(uint8_t *buf, size_t len, struct sockaddr_in *from)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char category[PEER_CATEGORY_LEN];
+    uint32_t node, seq, stamp, ttl, now;
+    size_t pos, clen;
+    int count;
+
+    if(!peer_known(from) || len<PEER_HEADER_SIZE+MD5_DIGEST_LENGTH || memcmp(buf, PEER_MAGIC, 4)!=0 || buf[4]!=PEER_VERSION)
+    {
+        rejected++;
+        return;
+    }
+
+    len -= MD5_DIGEST_LENGTH;
+    datagram_sign(buf, len, digest);
+
+    if(!digest_equal(digest, buf+len))
+    {
+        rejected++;
+        return;
+    }
+
+    memcpy(&node, buf+8, sizeof(node));
+    memcpy(&seq, buf+12, sizeof(seq));
+    memcpy(&stamp, buf+16, sizeof(stamp));
+    node = ntohl(node);
+    stamp = ntohl(stamp);
+    now = time(NULL);
+
+    // multicast loops back our own datagrams
+    if(node==node_id)
+        return;
+
+    if(stamp+PEER_WINDOW<now || stamp>now+PEER_WINDOW || !peer_sequence(node, ntohl(seq), now))
+    {
+        replayed++;
+        return;
+    }
+
+    recv_datagrams++;
+
+    count = buf[5];
+    pos = PEER_HEADER_SIZE;
+
+    for(int i=0; i<count; i++)
+    {
+        if(pos+MD5_DIGEST_LENGTH+5>len || pos+MD5_DIGEST_LENGTH+5+buf[pos+MD5_DIGEST_LENGTH+4]>len)
+        {
+            rejected++;
+            return;
+        }
+
+        memcpy(&ttl, buf+pos+MD5_DIGEST_LENGTH, sizeof(ttl));
+        clen = buf[pos+MD5_DIGEST_LENGTH+4];
+
+        if(clen>0 && clen<sizeof(category))
+        {
+            memcpy(category, buf+pos+MD5_DIGEST_LENGTH+5, clen);
+            category[clen] = 0;
+
+            cache_remote(buf+pos, category, ntohl(ttl));
+            recv_records++;
+        }
+
+        pos += MD5_DIGEST_LENGTH+5+clen;
+    }
+}
+
+static void *peer_receiver(void *arg)
+{
+    uint8_t buf[PEER_DATAGRAM+MD5_DIGEST_LENGTH];
+    struct sockaddr_in from;
+    struct pollfd pfd;
+    socklen_t fromlen;
+    ssize_t len;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    while(!__atomic_load_n(&quit, __ATOMIC_RELAXED))
+    {
+        if(poll(&pfd, 1, 500)<=0)
+            continue;
+
+        fromlen = sizeof(from);
+
+        if((len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen))>0)
+            datagram_receive(buf, len, &from);
+    }
+
+    return 0;
+}
+
+// host or host:port, port defaults to PEER_PORT
+static bool peer_address(const char *str, struct sockaddr_in *addr)
+{
+    char host[64];
+    char *port;
+    struct hostent *he;
+
+    strlcpy(host, str, sizeof(host));
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(PEER_PORT);
+
+    if((port = strchr(host, ':'))!=NULL)
+    {
+        *port++ = 0;
+        addr->sin_port = htons(atoi(port));
+    }
+
+    if(!*host)
+        addr->sin_addr.s_addr = INADDR_ANY;
+    else
+    if((he = dnslookup(host))!=NULL)
+        memcpy(&addr->sin_addr, he->h_addr, sizeof(addr->sin_addr));
+    else
+        return false;
+
+    return true;
+}
+
+void peer_init()
+{
+    struct sockaddr_in addr;
+    struct timespec ts;
+    int on = 1;
+
+    npeers = 0;
+    listening = false;
+    sock = -1;
+
+    for(int i=0; i<config.npeers; i++)
+    {
+        if(!peer_address(config.peerhost[i], &peers[npeers]))
+            wquit("ERROR: could not resolve peer %s\n", config.peerhost[i]);
+
+        npeers++;
+    }
+
+    if(npeers==0 && !strlen(config.peerlisten))
+        return;
+
+    // unsigned datagrams would let anyone on the path feed our cache
+    if(!strlen(config.peerkey))
+        wquit("ERROR: peer_key is required to share classifications\n");
+
+    if((sock = socket(AF_INET, SOCK_DGRAM, 0))<0)
+        wquit("ERROR: peer socket() failed\n");
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    // source port is the listening one, datagrams go out from the same socket
+    if(strlen(config.peerlisten))
+    {
+        if(!peer_address(config.peerlisten, &addr))
+            wquit("ERROR: invalid peer_listen %s\n", config.peerlisten);
+
+        if(bind(sock, (struct sockaddr *)&addr, sizeof(addr))<0)
+            wquit("ERROR: could not bind peer socket %s\n", config.peerlisten);
+
+        // join multicast groups listed as peers
+        for(int i=0; i<npeers; i++)
+        {
+            if(IN_MULTICAST(ntohl(peers[i].sin_addr.s_addr)))
+            {
+                struct ip_mreq mreq;
+
+                mreq.imr_multiaddr = peers[i].sin_addr;
+                mreq.imr_interface.s_addr = INADDR_ANY;
+
+                if(setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))<0)
+                    wlog(LOG_WARN, "Could not join peer group %s\n", inet_ntoa(peers[i].sin_addr));
+            }
+        }
+
+        listening = true;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    node_id = ts.tv_nsec ^ (getpid()<<16) ^ ts.tv_sec;
+    sequence = 0;
+
+    memset(nodes, 0, sizeof(nodes));
+    nbatch[0] = nbatch[1] = nlast = 0;
+    cur = 0;
+    quit = false;
+
+    sent_datagrams = sent_records = queue_dropped = 0;
+    recv_datagrams = recv_records = rejected = replayed = lost = 0;
+
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    if(npeers>0 && pthread_create(&sender, NULL, peer_sender, NULL))
+        wquit("peer_sender pthread_create() failed\n");
+
+    if(listening && pthread_create(&receiver, NULL, peer_receiver, NULL))
+        wquit("peer_receiver pthread_create() failed\n");
+
+    wlog(LOG_LVL3, "Peer sharing init, node %08x, %d peers, listening on %s\n", node_id, npeers,
+            listening?config.peerlisten:"none");
+}
+
+void peer_close()
+{
+    if(sock<0)
+        return;
+
+    pthread_mutex_lock(&mtx);
+    quit = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mtx);
+
+    if(npeers>0)
+        pthread_join(sender, NULL);
+
+    if(listening)
+        pthread_join(receiver, NULL);
+
+    close(sock);
+    sock = -1;
+
+    pthread_mutex_destroy(&mtx);
+    pthread_cond_destroy(&cond);
+
+    wlog(LOG_LVL3, "Peer threads stopped successfully!\n");
+}
+
+//! called from threaded code!
+void peer_publish(const unsigned char *hash, const char *category, uint32_t ttl)
+{
+    struct peer_record *rec;
+
+    if(npeers==0 || strlen(category)>=PEER_CATEGORY_LEN)
+        return;
+
+    pthread_mutex_lock(&mtx);
+
+    if(nbatch[cur]>=PEER_BATCH)
+    {
+        queue_dropped++;
+        pthread_mutex_unlock(&mtx);
+        return;
+    }
+
+    rec = &batch[cur][nbatch[cur]++];
+
+    memcpy(rec->hash, hash, MD5_DIGEST_LENGTH);
+    strlcpy(rec->category, category, sizeof(rec->category));
+    rec->expire = time(NULL)+ttl;
+
+    if(nbatch[cur]>=PEER_BATCH)
+        pthread_cond_signal(&cond);
+
+    pthread_mutex_unlock(&mtx);
+}
+
+void peer_statistics()
+{
+    if(sock<0)
+        return;
+
+    wlog(LOG_LVL4, "Peer sent: %u datagrams, %u records, %u dropped\n", sent_datagrams, sent_records, queue_dropped);
+    wlog(LOG_LVL4, "Peer received: %u datagrams, %u records, %u rejected, %u replayed or late, %u lost\n",
+            recv_datagrams, recv_records, rejected, replayed, lost);
+}
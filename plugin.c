@@ -0,0 +1,200 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Classifier plugins.
+ *
+ * Shared objects listed by classify_plugin are loaded at startup and asked
+ * in configuration order, the first one with an answer wins. classify_order
+ * places them before the server, after it as a fallback, or instead of it.
+ * Plugin answers are not cached, they are expected to be as fast as the
+ * cache itself and the plugin data may change underneath.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "plugin.h"
+#include "utils.h"
+#include "config.h"
+
+struct plugin
+{
+    void *dl;
+    const struct classifier_plugin *ops;
+    void *handle;
+
+    uint32_t queries, answers;
+    uint64_t nsecs;
+};
+
+static struct plugin plugins[sizeof(config.plugins)/sizeof(config.plugins[0])];
+static int nplugins;
+
+/*
+ * 
+ */
+
+static uint64_t now_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static bool plugin_load(struct plugin *p, char *line)
+{
+    char *args;
+
+    // path first, the rest of the line belongs to the plugin
+    if((args = strchr(line, ' '))!=NULL)
+        *args++ = 0;
+    else
+        args = "";
+
+    if((p->dl = dlopen(line, RTLD_NOW|RTLD_LOCAL))==NULL)
+    {
+        wlog(LOG_ERROR, "Could not load classifier %s: %s\n", line, dlerror());
+        return false;
+    }
+
+    if((p->ops = dlsym(p->dl, CLASSIFIER_SYMBOL))==NULL || p->ops->version!=CLASSIFIER_API_VERSION ||
+       p->ops->classify==NULL)
+    {
+        wlog(LOG_ERROR, "%s is not a version %d classifier\n", line, CLASSIFIER_API_VERSION);
+        dlclose(p->dl);
+        return false;
+    }
+
+    p->handle = p->ops->init!=NULL?p->ops->init(args):p;
+
+    if(p->handle==NULL)
+    {
+        wlog(LOG_ERROR, "Classifier %s failed to initialize\n", p->ops->name);
+        dlclose(p->dl);
+        return false;
+    }
+
+    wlog(LOG_LVL1, "Classifier %s loaded from %s\n", p->ops->name, line);
+
+    return true;
+}
+
+//! called from threaded code!
+bool plugin_lookup(const char *domain, struct cache_t *entry, int stage)
+{
+    struct classifier_query q;
+    struct plugin *p;
+    uint64_t start;
+    int got;
+
+    if(nplugins==0)
+        return false;
+
+    if(stage==PLUGIN_BEFORE && config.classifyorder==ORDER_SERVER_PLUGIN)
+        return false;
+
+    if(stage==PLUGIN_AFTER && config.classifyorder!=ORDER_SERVER_PLUGIN)
+        return false;
+
+    for(p = plugins; p<plugins+nplugins; p++)
+    {
+        q.domain = domain;
+        q.category = NULL;
+
+        start = now_nsec();
+        got = p->ops->classify(p->handle, &q, 1);
+
+        __atomic_fetch_add(&p->nsecs, now_nsec()-start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&p->queries, 1, __ATOMIC_RELAXED);
+
+        if(got>0 && q.category!=NULL && q.category[0])
+        {
+            __atomic_fetch_add(&p->answers, 1, __ATOMIC_RELAXED);
+
+            entry->category = cache_category(q.category);
+            wlog(LOG_LVL3, "Classifier %s response: %s -> [%s]\n", p->ops->name, domain, entry->category);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool plugin_only()
+{
+    return nplugins>0 && config.classifyorder==ORDER_PLUGIN;
+}
+
+void plugin_init()
+{
+    char line[sizeof(config.plugins[0])];
+    int i;
+
+    nplugins = 0;
+
+    for(i=0; i<config.nplugins; i++)
+    {
+        strlcpy(line, config.plugins[i], sizeof(line));
+
+        if(plugin_load(&plugins[nplugins], line))
+            nplugins++;
+    }
+
+    if(config.classifyorder==ORDER_PLUGIN && nplugins==0)
+        wlog(LOG_WARN, "classify_order is plugin but no classifier is loaded, using the server\n");
+}
+
+void plugin_close()
+{
+    struct plugin *p;
+
+    for(p = plugins; p<plugins+nplugins; p++)
+    {
+        if(p->ops->shutdown!=NULL)
+            p->ops->shutdown(p->handle);
+
+        dlclose(p->dl);
+    }
+
+    nplugins = 0;
+}
+
+void plugin_statistics()
+{
+    struct plugin *p;
+
+    for(p = plugins; p<plugins+nplugins; p++)
+    {
+        wlog(LOG_LVL4, "Classifier %s: %u queries, %u answered, %0.2f us average\n", p->ops->name,
+                p->queries, p->answers, p->queries>0?p->nsecs/1000.0/p->queries:0.0);
+    }
+}
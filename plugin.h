@@ -0,0 +1,68 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdbool.h>
+
+#include "cache.h"
+#include "classifier.h"
+
+#ifndef PLUGIN_H
+#define	PLUGIN_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// classify_order values
+enum classify_orders
+{
+    ORDER_PLUGIN_SERVER,    // plugins first, server for what they miss
+    ORDER_SERVER_PLUGIN,    // server first, plugins when it fails
+    ORDER_PLUGIN            // plugins only, the server is never asked
+};
+
+// where plugin_lookup() is called from
+enum plugin_stages
+{
+    PLUGIN_BEFORE,          // before the server lookup
+    PLUGIN_AFTER            // after the server failed
+};
+
+void plugin_init();
+
+void plugin_close();
+
+// ask the plugins if stage matches classify_order, the first answer wins
+bool plugin_lookup(const char *domain, struct cache_t *entry, int stage);
+
+// true when the server must not be asked
+bool plugin_only();
+
+void plugin_statistics();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* PLUGIN_H */
+
@@ -0,0 +1,269 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Sample classifier plugin answering from a "domain category" text file,
+ * one pair per line. The file is memory mapped read only and indexed at
+ * load time, lookups are a binary search that falls back to parent
+ * domains, so example.com also answers www.example.com.
+ *
+ *   classify_plugin /usr/lib/dnsfilter/dnsfilter-textmap.so /etc/dnsfilter/categories.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "classifier.h"
+
+#define TEXTMAP_CATEGORIES 4096
+
+struct textmap_entry
+{
+    uint32_t offset;    // domain position in the mapping
+    uint16_t length;
+    uint16_t category;  // index into categories
+};
+
+struct textmap
+{
+    char *map;
+    size_t size;
+
+    struct textmap_entry *entries;
+    uint32_t count;
+
+    // categories are few, keep them as C strings
+    char *categories[TEXTMAP_CATEGORIES];
+    int ncategories;
+};
+
+// qsort has no context argument in C99
+static const char *sort_map;
+
+/*
+ * 
+ */
+
+static int entry_compare(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int rc = memcmp(a, b, alen<blen?alen:blen);
+
+    if(rc==0)
+        rc = alen<blen?-1:alen>blen?1:0;
+
+    return rc;
+}
+
+static int entry_sort(const void *a, const void *b)
+{
+    const struct textmap_entry *x = a, *y = b;
+
+    return entry_compare(sort_map+x->offset, x->length, sort_map+y->offset, y->length);
+}
+
+static int category_index(struct textmap *tm, const char *name, size_t len)
+{
+    int i;
+
+    for(i=0; i<tm->ncategories; i++)
+    {
+        if(!strncmp(tm->categories[i], name, len) && tm->categories[i][len]==0)
+            return i;
+    }
+
+    if(tm->ncategories==TEXTMAP_CATEGORIES)
+        return -1;
+
+    tm->categories[i] = strndup(name, len);
+    return tm->ncategories++;
+}
+
+static void *textmap_shutdown_partial(struct textmap *tm)
+{
+    int i;
+
+    for(i=0; i<tm->ncategories; i++)
+        free(tm->categories[i]);
+
+    if(tm->map!=NULL && tm->map!=MAP_FAILED)
+        munmap(tm->map, tm->size);
+
+    free(tm->entries);
+    free(tm);
+
+    return NULL;
+}
+
+static void *textmap_init(const char *args)
+{
+    struct textmap *tm;
+    struct stat st;
+    const char *p, *end, *dom, *cat;
+    size_t dlen, clen, alloc = 0;
+    int fd, idx;
+
+    if((tm = calloc(1, sizeof(*tm)))==NULL)
+        return NULL;
+
+    if((fd = open(args, O_RDONLY))<0 || fstat(fd, &st)<0 || st.st_size==0 || st.st_size>UINT32_MAX)
+    {
+        fprintf(stderr, "textmap: cannot use %s\n", args);
+
+        if(fd>=0)
+            close(fd);
+
+        return textmap_shutdown_partial(tm);
+    }
+
+    tm->size = st.st_size;
+    tm->map = mmap(NULL, tm->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(tm->map==MAP_FAILED)
+        return textmap_shutdown_partial(tm);
+
+    for(p = tm->map, end = tm->map+tm->size; p<end; p++)
+    {
+        // domain, blanks, category, anything else up to the newline
+        while(p<end && (*p==' ' || *p=='\t' || *p=='\r'))
+            p++;
+
+        for(dom = p; p<end && *p>' '; p++);
+        dlen = p-dom;
+
+        while(p<end && (*p==' ' || *p=='\t'))
+            p++;
+
+        for(cat = p; p<end && *p>' '; p++);
+        clen = p-cat;
+
+        while(p<end && *p!='\n')
+            p++;
+
+        if(dlen==0 || *dom=='#' || clen==0 || dlen>UINT16_MAX)
+            continue;
+
+        if((idx = category_index(tm, cat, clen))<0)
+        {
+            fprintf(stderr, "textmap: more than %d categories in %s\n", TEXTMAP_CATEGORIES, args);
+            return textmap_shutdown_partial(tm);
+        }
+
+        if(tm->count==alloc)
+        {
+            struct textmap_entry *grown;
+
+            alloc = alloc?alloc*2:65536;
+
+            if((grown = realloc(tm->entries, alloc*sizeof(*grown)))==NULL)
+                return textmap_shutdown_partial(tm);
+
+            tm->entries = grown;
+        }
+
+        tm->entries[tm->count].offset = dom-tm->map;
+        tm->entries[tm->count].length = dlen;
+        tm->entries[tm->count].category = idx;
+        tm->count++;
+    }
+
+    sort_map = tm->map;
+    qsort(tm->entries, tm->count, sizeof(*tm->entries), entry_sort);
+
+    // lookups touch a single line each, readahead is wasted
+    madvise(tm->map, tm->size, MADV_RANDOM);
+
+    fprintf(stdout, "textmap: %u domains, %d categories from %s\n", tm->count, tm->ncategories, args);
+
+    return tm;
+}
+
+static const char *textmap_find(struct textmap *tm, const char *domain, size_t len)
+{
+    uint32_t lo = 0, hi = tm->count, mid;
+    int rc;
+
+    while(lo<hi)
+    {
+        mid = lo+(hi-lo)/2;
+        rc = entry_compare(domain, len, tm->map+tm->entries[mid].offset, tm->entries[mid].length);
+
+        if(rc==0)
+            return tm->categories[tm->entries[mid].category];
+
+        if(rc<0)
+            hi = mid;
+        else
+            lo = mid+1;
+    }
+
+    return NULL;
+}
+
+//! called from threaded code!
+static int textmap_classify(void *handle, struct classifier_query *queries, int count)
+{
+    struct textmap *tm = handle;
+    const char *name;
+    int i, answered = 0;
+
+    for(i=0; i<count; i++)
+    {
+        queries[i].category = NULL;
+
+        // strip one label at a time until something matches
+        for(name = queries[i].domain; name!=NULL && *name; name = strchr(name, '.'))
+        {
+            if(*name=='.')
+                name++;
+
+            if((queries[i].category = textmap_find(tm, name, strlen(name)))!=NULL)
+            {
+                answered++;
+                break;
+            }
+        }
+    }
+
+    return answered;
+}
+
+static void textmap_shutdown(void *handle)
+{
+    textmap_shutdown_partial(handle);
+}
+
+const struct classifier_plugin dnsfilter_classifier =
+{
+    .version = CLASSIFIER_API_VERSION,
+    .name = "textmap",
+    .init = textmap_init,
+    .classify = textmap_classify,
+    .shutdown = textmap_shutdown
+};
@@ -0,0 +1,412 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Pool of classification servers.
+ *
+ * Every address cfs_server resolves to is a pool member. Requests go to the
+ * member with the lowest moving average latency, members without samples
+ * are tried first so every one gets measured. A member failing
+ * cfs_eject_failures requests in a row is ejected for cfs_eject_time
+ * seconds, doubled on each failure after it comes back, up to
+ * POOL_EJECT_MAX. A background thread probes every member each
+ * cfs_probe_interval seconds, which keeps idle latencies current and lets
+ * ejected members return as soon as they answer again.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+
+#include "pool.h"
+#include "proto.h"
+#include "utils.h"
+#include "config.h"
+
+#define POOL_PROBE_INTERVAL 10  // defaults for cfs_probe_interval/cfs_eject_*
+#define POOL_EJECT_FAILURES 3
+#define POOL_EJECT_TIME 10
+#define POOL_EJECT_MAX 300
+#define POOL_PROBE_TIMEOUT 2
+
+struct pool_server
+{
+    struct in_addr addr;
+    double latency;             // moving average, seconds
+    uint32_t samples;
+
+    int failures;               // in a row
+    int ejections;              // in a row, scales the eject time
+    uint64_t ejected;           // msec timestamp until which it is skipped
+
+    uint32_t requests, errors;
+    uint32_t lastrequests, lasterrors;  // at previous statistics
+};
+
+static struct pool_server servers[sizeof(config.serveraddr)/sizeof(config.serveraddr[0])];
+static int nservers;
+
+static pthread_t thread;
+static pthread_mutex_t mtx;
+static pthread_cond_t cond;
+static bool probing;
+static bool quit;
+
+/*
+ * 
+ */
+
+static uint64_t now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+// called with mtx held
+static void server_update(struct pool_server *s, bool ok, double secs)
+{
+    uint64_t eject;
+
+    if(ok)
+    {
+        // first sample seeds the average
+        if(s->samples++==0)
+            s->latency = secs;
+        else
+            s->latency += (secs-s->latency)/8;
+
+        if(s->ejected!=0)
+            wlog(LOG_LVL1, "CFS server %s is back\n", inet_ntoa(s->addr));
+
+        s->failures = 0;
+        s->ejections = 0;
+        s->ejected = 0;
+
+        return;
+    }
+
+    // still ejected, nothing new to learn
+    if(s->ejected>now_msec())
+        return;
+
+    // a member on trial after ejection goes out again on the first failure
+    if(++s->failures>=config.ejectfailures || s->ejections>0)
+    {
+        eject = (uint64_t)config.ejecttime*1000 << (s->ejections<5?s->ejections:5);
+
+        if(eject>POOL_EJECT_MAX*1000)
+            eject = POOL_EJECT_MAX*1000;
+
+        s->ejected = now_msec()+eject;
+        s->ejections++;
+        s->failures = 0;
+
+        wlog(LOG_WARN, "CFS server %s ejected for %u seconds\n", inet_ntoa(s->addr), (unsigned)(eject/1000));
+    }
+}
+
+//! called from threaded code!
+int pool_pick()
+{
+    struct pool_server *s;
+    uint64_t now = now_msec();
+    int i, best = -1, fallback = 0;
+
+    pthread_mutex_lock(&mtx);
+
+    for(i=0; i<nservers; i++)
+    {
+        s = &servers[i];
+
+        if(s->ejected>now)
+        {
+            // the one coming back first, if all of them are out
+            if(s->ejected<servers[fallback].ejected)
+                fallback = i;
+
+            continue;
+        }
+
+        if(best<0 || s->samples==0 || (servers[best].samples!=0 && s->latency<servers[best].latency))
+            best = i;
+
+        if(s->samples==0)
+            break;
+    }
+
+    if(best<0)
+        best = fallback;
+
+    servers[best].requests++;
+
+    pthread_mutex_unlock(&mtx);
+
+    return best;
+}
+
+void pool_url(int server, char *buf, size_t size)
+{
+    char addr[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &servers[server].addr, addr, sizeof(addr));
+    snprintf(buf, size, "http://%s:4080", addr);
+}
+
+struct in_addr pool_addr(int server)
+{
+    return servers[server].addr;
+}
+
+//! called from threaded code!
+void pool_report(int server, bool ok, double secs)
+{
+    if(server<0 || server>=nservers)
+        return;
+
+    pthread_mutex_lock(&mtx);
+
+    if(!ok)
+        servers[server].errors++;
+
+    server_update(&servers[server], ok, secs);
+
+    pthread_mutex_unlock(&mtx);
+}
+
+static size_t probe_write(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    return size*nmemb;
+}
+
+// any http answer but the ones proxies give for a dead backend means the
+// server is alive, it does not need to handle GET itself
+static bool probe(CURL *easy, int server, double *secs)
+{
+    char url[64];
+    long code = 0;
+
+    pool_url(server, url, sizeof(url));
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+
+    if(curl_easy_perform(easy)!=CURLE_OK)
+        return false;
+
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, secs);
+
+    return code>0 && code!=502 && code!=503 && code!=504;
+}
+
+// an empty request gets an empty response
+static bool probe_udp(int server, double *secs)
+{
+    struct proto_buf req;
+    struct proto_msg m;
+    struct sockaddr_in sa;
+    struct pollfd pfd;
+    struct timespec start, end;
+    uint8_t buf[PROTO_DATAGRAM];
+    uint32_t id = proto_id();
+    ssize_t len;
+    bool ok = false;
+
+    if((pfd.fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0))<0)
+        return false;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(config.udpport);
+    sa.sin_addr = servers[server].addr;
+
+    pfd.events = POLLIN;
+
+    proto_begin(&req, PROTO_REQUEST, id, config.license);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // connected, so errors from the port come back on recv()
+    if(connect(pfd.fd, (struct sockaddr *)&sa, sizeof(sa))==0 && send(pfd.fd, req.data, req.len, 0)==req.len)
+    {
+        while(!ok && poll(&pfd, 1, POOL_PROBE_TIMEOUT*1000)>0)
+        {
+            if((len = recv(pfd.fd, buf, sizeof(buf), 0))<0)
+                break;
+
+            ok = proto_decode(&m, buf, len) && m.type==PROTO_RESPONSE && m.id==id && m.count==0;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *secs = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+
+    close(pfd.fd);
+
+    return ok;
+}
+
+static void *pool_worker(void *arg)
+{
+    struct timespec ts;
+    CURL *easy;
+    double secs;
+    bool ok;
+    int i;
+
+    if((easy = curl_easy_init())==NULL)
+        return 0;
+
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(easy, CURLOPT_HTTPGET, 1);
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, POOL_PROBE_TIMEOUT);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, POOL_PROBE_TIMEOUT);
+    curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 1);
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, "iDB WiFi");
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, probe_write);
+
+    pthread_mutex_lock(&mtx);
+
+    while(!quit)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += config.probeinterval;
+
+        while(!quit && pthread_cond_timedwait(&cond, &mtx, &ts)==0);
+
+        for(i=0; i<nservers && !quit; i++)
+        {
+            pthread_mutex_unlock(&mtx);
+
+            secs = 0;
+            ok = config.protocol==CFS_UDP?probe_udp(i, &secs):probe(easy, i, &secs);
+
+            pthread_mutex_lock(&mtx);
+
+            // probe failures only count against members that are in use
+            if(ok || servers[i].ejected==0)
+                server_update(&servers[i], ok, secs);
+        }
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    curl_easy_cleanup(easy);
+
+    return 0;
+}
+
+void pool_init()
+{
+    int i;
+
+    memset(servers, 0, sizeof(servers));
+
+    for(nservers=0; nservers<sizeof(servers)/sizeof(servers[0]) && config.serveraddr[nservers].s_addr!=0; nservers++)
+        servers[nservers].addr = config.serveraddr[nservers];
+
+    // nothing resolved, requests fail against 0.0.0.0 as they used to
+    if(nservers==0)
+        nservers = 1;
+
+    if(config.probeinterval==0)
+        config.probeinterval = POOL_PROBE_INTERVAL;
+
+    if(config.ejectfailures<=0)
+        config.ejectfailures = POOL_EJECT_FAILURES;
+
+    if(config.ejecttime<=0)
+        config.ejecttime = POOL_EJECT_TIME;
+
+    if(config.udpport<=0)
+        config.udpport = PROTO_PORT;
+
+    quit = false;
+
+    // first curl user, before any other thread exists
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    probing = config.probeinterval>0;
+
+    if(probing && pthread_create(&thread, NULL, pool_worker, NULL))
+        wquit("pool_worker pthread_create() failed\n");
+
+    for(i=0; i<nservers; i++)
+        wlog(LOG_LVL3, "CFS server pool member: %s\n", inet_ntoa(servers[i].addr));
+}
+
+void pool_close()
+{
+    if(probing)
+    {
+        pthread_mutex_lock(&mtx);
+        quit = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mtx);
+
+        // an in flight probe is bounded by its timeout
+        pthread_join(thread, NULL);
+    }
+
+    wlog(LOG_LVL3, "CFS server pool stopped\n");
+}
+
+void pool_statistics()
+{
+    struct pool_server *s;
+    uint64_t now = now_msec();
+    uint32_t requests, errors;
+    int i;
+
+    pthread_mutex_lock(&mtx);
+
+    for(i=0; i<nservers; i++)
+    {
+        s = &servers[i];
+
+        // error rate over the last statistics interval
+        requests = s->requests-s->lastrequests;
+        errors = s->errors-s->lasterrors;
+
+        s->lastrequests = s->requests;
+        s->lasterrors = s->errors;
+
+        wlog(LOG_LVL4, "Pool: %s %s, %0.1f ms average, %u requests, %0.1f%% errors (%u total)\n",
+                inet_ntoa(s->addr), s->ejected>now?"ejected":"up", s->latency*1000,
+                requests, requests>0?errors*100.0/requests:0.0, s->errors);
+    }
+
+    pthread_mutex_unlock(&mtx);
+}
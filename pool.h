@@ -0,0 +1,56 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#ifndef POOL_H
+#define	POOL_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+void pool_init();
+
+void pool_close();
+
+// fastest healthy server, any server if every one is ejected
+int pool_pick();
+
+void pool_url(int server, char *buf, size_t size);
+
+struct in_addr pool_addr(int server);
+
+// outcome of a request sent to server, feeds latency and circuit breaker
+void pool_report(int server, bool ok, double secs);
+
+void pool_statistics();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* POOL_H */
+
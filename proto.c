@@ -0,0 +1,166 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+
+#include "proto.h"
+
+/*
+ * 
+ */
+
+void proto_begin(struct proto_buf *b, int type, uint32_t id, const char *license)
+{
+    struct proto_header *h = (struct proto_header *)b->data;
+
+    memcpy(h->magic, "DF", 2);
+    h->version = PROTO_VERSION;
+    h->type = type;
+    h->id = htonl(id);
+    h->count = 0;
+
+    b->len = sizeof(*h);
+    b->count = 0;
+
+    if(type==PROTO_REQUEST)
+    {
+        memset(b->data+b->len, 0, PROTO_LICENSE);
+        memcpy(b->data+b->len, license, strnlen(license, PROTO_LICENSE));
+        b->len += PROTO_LICENSE;
+    }
+}
+
+uint32_t proto_id()
+{
+    uint32_t id;
+
+    // only blocks at boot until the kernel pool is seeded. a guessable id
+    // would let anyone on the path forge answers, so there is no fallback
+    while(getrandom(&id, sizeof(id), 0)!=sizeof(id))
+    {
+        if(errno!=EINTR)
+            abort();
+    }
+
+    return id;
+}
+
+void proto_set_id(struct proto_buf *b, uint32_t id)
+{
+    ((struct proto_header *)b->data)->id = htonl(id);
+}
+
+bool proto_put(struct proto_buf *b, const char *text, int status)
+{
+    struct proto_header *h = (struct proto_header *)b->data;
+    size_t len = text!=NULL?strlen(text):0;
+
+    if(len>255 || b->len+len+2>sizeof(b->data))
+        return false;
+
+    if(h->type==PROTO_RESPONSE)
+        b->data[b->len++] = text!=NULL?status:PROTO_FAILED;
+
+    b->data[b->len++] = len;
+
+    if(len>0)
+        memcpy(b->data+b->len, text, len);
+
+    b->len += len;
+
+    h->count = htons(++b->count);
+
+    return true;
+}
+
+bool proto_decode(struct proto_msg *m, const uint8_t *buf, size_t len)
+{
+    const struct proto_header *h = (const struct proto_header *)buf;
+
+    if(len<sizeof(*h) || memcmp(h->magic, "DF", 2)!=0 || h->version!=PROTO_VERSION)
+        return false;
+
+    if(h->type!=PROTO_REQUEST && h->type!=PROTO_RESPONSE)
+        return false;
+
+    m->type = h->type;
+    m->id = ntohl(h->id);
+    m->count = ntohs(h->count);
+    m->next = buf+sizeof(*h);
+    m->end = buf+len;
+    m->read = 0;
+    m->license[0] = 0;
+
+    if(m->type==PROTO_REQUEST)
+    {
+        if(m->end-m->next<PROTO_LICENSE)
+            return false;
+
+        memcpy(m->license, m->next, PROTO_LICENSE);
+        m->license[PROTO_LICENSE] = 0;
+        m->next += PROTO_LICENSE;
+    }
+
+    return true;
+}
+
+bool proto_record(struct proto_msg *m, char *text, size_t size, int *status)
+{
+    size_t len;
+
+    if(m->read>=m->count)
+        return false;
+
+    *status = PROTO_OK;
+
+    if(m->type==PROTO_RESPONSE)
+    {
+        if(m->next>=m->end)
+            return false;
+
+        *status = *m->next++;
+    }
+
+    if(m->next>=m->end)
+        return false;
+
+    len = *m->next++;
+
+    if(len>m->end-m->next || len>=size)
+        return false;
+
+    memcpy(text, m->next, len);
+    text[len] = 0;
+
+    m->next += len;
+    m->read++;
+
+    return true;
+}
@@ -0,0 +1,131 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef PROTO_H
+#define	PROTO_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary classification protocol over UDP, an alternative to the HTTP POST.
+ *
+ * Every datagram starts with a header: "DF", version, type, request id and
+ * record count, all integers big endian. Requests carry the 40 byte license
+ * after the header and one record per domain: length byte and name.
+ * Responses echo the request id and answer every domain in request order
+ * with a record of status byte, length byte and category.
+ *
+ * Request ids are random and drawn again for every datagram sent, clients
+ * only take an answer from the server they asked, carrying one of their
+ * ids and exactly as many records as the request.
+ */
+
+#define PROTO_VERSION 1
+#define PROTO_PORT 4082
+#define PROTO_DATAGRAM 1400     // stays below common path MTUs
+#define PROTO_LICENSE 40
+
+// cfs_protocol values
+enum cfs_protocols
+{
+    CFS_HTTP,
+    CFS_UDP
+};
+
+enum proto_types
+{
+    PROTO_REQUEST = 1,
+    PROTO_RESPONSE
+};
+
+enum proto_status
+{
+    PROTO_OK,
+    PROTO_FAILED        // domain could not be classified
+};
+
+struct proto_header
+{
+    char magic[2];
+    uint8_t version;
+    uint8_t type;
+    uint32_t id;
+    uint16_t count;
+} __attribute__((packed));
+
+// datagram being built
+struct proto_buf
+{
+    uint8_t data[PROTO_DATAGRAM];
+    size_t len;
+    int count;
+};
+
+// datagram being read
+struct proto_msg
+{
+    int type;
+    uint32_t id;
+    int count;
+    char license[PROTO_LICENSE+1];
+
+    const uint8_t *next, *end;
+    int read;
+};
+
+void proto_begin(struct proto_buf *b, int type, uint32_t id, const char *license);
+
+// random request id from the kernel
+uint32_t proto_id();
+
+// restamp the id of a built datagram before sending it again
+void proto_set_id(struct proto_buf *b, uint32_t id);
+
+// append a record, false if the datagram has no room left
+bool proto_put(struct proto_buf *b, const char *text, int status);
+
+// room needed by a record carrying text
+static inline size_t proto_size(const char *text, int type)
+{
+    return strlen(text)+(type==PROTO_REQUEST?1:2);
+}
+
+// validates the header, false for anything not a protocol datagram
+bool proto_decode(struct proto_msg *m, const uint8_t *buf, size_t len);
+
+// next record, false when done or truncated. status is unused for requests
+bool proto_record(struct proto_msg *m, char *text, size_t size, int *status);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* PROTO_H */
+
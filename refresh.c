@@ -0,0 +1,235 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "refresh.h"
+#include "cache.h"
+#include "queue.h"
+#include "http.h"
+#include "retry.h"
+#include "utils.h"
+#include "config.h"
+
+#define REFRESH_QUEUE 256
+#define REFRESH_HITS 8          // defaults for refresh_hits/refresh_rate
+#define REFRESH_RATE 5
+
+struct refresh_req
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    char domain[256];
+};
+
+static pthread_t thread;
+static pthread_mutex_t mtx;
+static pthread_cond_t cond;
+static bool quit;
+
+// ring of queued requests, the head entry stays until it is refreshed
+static struct refresh_req queue[REFRESH_QUEUE];
+static int head;
+static int count;
+
+// own server connection, packet threads never wait on a refresh
+static queueinfo_t qinfo;
+
+static uint32_t refreshed, failed, dropped;
+
+/*
+ * 
+ */
+
+static void *refresh_worker(void *arg)
+{
+    struct refresh_req req;
+    struct cache_t entry;
+    struct timespec delay;
+
+    // token bucket with a single token, spaces refreshes evenly
+    delay.tv_sec = 1/config.refreshrate;
+    delay.tv_nsec = (1000000000L/config.refreshrate)%1000000000L;
+
+    pthread_mutex_lock(&mtx);
+
+    while(!quit)
+    {
+        if(count==0)
+        {
+            pthread_cond_wait(&cond, &mtx);
+            continue;
+        }
+
+        req = queue[head];
+        pthread_mutex_unlock(&mtx);
+
+        memcpy(entry.hash, req.hash, MD5_DIGEST_LENGTH);
+
+        if(!perform_lookup(&qinfo, &entry, req.domain))
+        {
+            // the old value is kept, retries back off until one answers
+            failed++;
+            retry_schedule(req.hash, req.domain);
+
+            wlog(LOG_LVL3, "CFS Refresh Failed: %s\n", req.domain);
+        }
+        else
+        if(entry.category[0]=='Y' && entry.category[1]=='Y')
+        {
+            // a miss never replaces a known category
+            failed++;
+            wlog(LOG_LVL3, "CFS Refresh Missed: %s\n", req.domain);
+        }
+        else
+        {
+            // replaces the stale value, readers switch over atomically
+            cache_insert(&entry);
+            refreshed++;
+
+            wlog(LOG_LVL3, "CFS Refresh Response: %s -> [%s]\n", req.domain, entry.category);
+        }
+
+        nanosleep(&delay, NULL);
+
+        pthread_mutex_lock(&mtx);
+
+        head = (head+1)%REFRESH_QUEUE;
+        count--;
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    return 0;
+}
+
+void refresh_init()
+{
+    if(config.refreshahead<=0)
+        return;
+
+    if(config.refreshhits<=0)
+        config.refreshhits = REFRESH_HITS;
+
+    if(config.refreshrate<=0)
+        config.refreshrate = REFRESH_RATE;
+
+    head = 0;
+    count = 0;
+    quit = false;
+
+    memset(&qinfo, 0, sizeof(qinfo));
+
+    if(!curl_init(&qinfo))
+        wquit("Failed to initialize curl!\n");
+
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    if(pthread_create(&thread, NULL, refresh_worker, NULL))
+        wquit("refresh_worker pthread_create() failed\n");
+
+    wlog(LOG_LVL3, "Refresh thread init, %d sec ahead, %d hits, %d/sec\n",
+            config.refreshahead, config.refreshhits, config.refreshrate);
+}
+
+void refresh_close()
+{
+    if(config.refreshahead<=0)
+        return;
+
+    pthread_mutex_lock(&mtx);
+    quit = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mtx);
+
+    // an in flight lookup is bounded by the curl timeout
+    pthread_join(thread, NULL);
+
+    curl_close(&qinfo);
+
+    pthread_mutex_destroy(&mtx);
+    pthread_cond_destroy(&cond);
+
+    wlog(LOG_LVL3, "Refresh thread stopped successfully!\n");
+}
+
+//! called from threaded code!
+bool refresh_schedule(const unsigned char *hash, const char *domain)
+{
+    struct refresh_req *req;
+
+    if(config.refreshahead<=0)
+        return false;
+
+    // a failed refresh is already being retried
+    if(retry_pending(hash))
+        return true;
+
+    pthread_mutex_lock(&mtx);
+
+    for(int i=0; i<count; i++)
+    {
+        if(memcmp(queue[(head+i)%REFRESH_QUEUE].hash, hash, MD5_DIGEST_LENGTH)==0)
+        {
+            pthread_mutex_unlock(&mtx);
+            return true;
+        }
+    }
+
+    // queue is full, the entry expires normally
+    if(count>=REFRESH_QUEUE)
+    {
+        dropped++;
+        pthread_mutex_unlock(&mtx);
+        return false;
+    }
+
+    req = &queue[(head+count)%REFRESH_QUEUE];
+    memcpy(req->hash, hash, MD5_DIGEST_LENGTH);
+    strlcpy(req->domain, domain, sizeof(req->domain));
+    count++;
+
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mtx);
+
+    wlog(LOG_LVL4, "Record %s scheduled for refresh: %s\n", dump_hexdigest((unsigned char *)hash), domain);
+
+    return true;
+}
+
+void refresh_statistics()
+{
+    if(config.refreshahead<=0)
+        return;
+
+    wlog(LOG_LVL1, "Refresh stats: %u refreshed, %u failed, %u dropped, %d queued\n",
+            refreshed, failed, dropped, count);
+}
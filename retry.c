@@ -0,0 +1,495 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "retry.h"
+#include "cache.h"
+#include "queue.h"
+#include "http.h"
+#include "epoch.h"
+#include "utils.h"
+#include "config.h"
+
+#define RETRY_SLOTS 4096        // must be a power of two
+#define RETRY_MAX_LOAD 3072
+#define RETRY_BASE_MSEC 1000
+#define RETRY_MAX_MSEC 300000
+#define RETRY_ATTEMPTS 12       // then the next packet tries inline again
+#define RETRY_KEYS 8192         // must be a power of two
+#define RETRY_KEY_EMPTY 0
+#define RETRY_KEY_DELETED 1
+
+struct retry_entry
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    char domain[256];
+
+    bool used;
+    bool busy;                  // lookup in flight
+    int attempts;
+    uint64_t due;               // msecs, monotonic clock
+};
+
+static pthread_t thread;
+static pthread_mutex_t mtx;
+static pthread_cond_t cond;
+static bool quit;
+
+// membership of the scheduled hashes for retry_pending(), read without
+// mtx. writers hold mtx and rebuild the set once deleted keys pile up
+struct retry_keys
+{
+    uint32_t used;              // live and deleted keys
+    uint64_t keys[RETRY_KEYS];
+
+    // reclaim list, valid after the set was replaced
+    uint64_t retired;
+    struct retry_keys *free_next;
+};
+
+static struct retry_entry table[RETRY_SLOTS];
+static int count;
+static unsigned int seed;
+
+static struct retry_keys *keys;
+static struct retry_keys *retired;
+
+// own server connection, packet threads never wait on a retry
+static queueinfo_t qinfo;
+
+static uint32_t recovered, failed, dropped;
+
+/*
+ * 
+ */
+
+static uint64_t now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+// exponential backoff with +-25% jitter, called with mtx held
+static uint64_t backoff(int attempts)
+{
+    uint64_t delay = RETRY_BASE_MSEC;
+
+    while(attempts-->0 && delay<RETRY_MAX_MSEC)
+        delay <<= 1;
+
+    if(delay>RETRY_MAX_MSEC)
+        delay = RETRY_MAX_MSEC;
+
+    return delay*3/4+rand_r(&seed)%(delay/2+1);
+}
+
+// 64 bits of the digest, never one of the markers
+static inline uint64_t hash_key(const unsigned char *hash)
+{
+    uint64_t k;
+
+    memcpy(&k, hash+MD5_DIGEST_LENGTH-sizeof(k), sizeof(k));
+
+    return k>RETRY_KEY_DELETED?k:k+2;
+}
+
+//! called from threaded code!
+static bool keys_find(struct retry_keys *set, uint64_t k)
+{
+    uint64_t v;
+    uint32_t idx;
+
+    for(idx = k & (RETRY_KEYS-1); (v = __atomic_load_n(&set->keys[idx], __ATOMIC_ACQUIRE))!=RETRY_KEY_EMPTY;
+        idx = (idx+1) & (RETRY_KEYS-1))
+    {
+        if(v==k)
+            return true;
+    }
+
+    return false;
+}
+
+// free sets no reader can still reference, called with mtx held
+static void keys_reclaim()
+{
+    struct retry_keys **prev, *set;
+    uint64_t oldest;
+
+    if(retired==NULL)
+        return;
+
+    oldest = epoch_oldest();
+    prev = &retired;
+
+    while((set = *prev)!=NULL)
+    {
+        if(set->retired<oldest)
+        {
+            *prev = set->free_next;
+            free(set);
+        }
+        else
+            prev = &set->free_next;
+    }
+}
+
+// called with mtx held
+static void keys_add(struct retry_keys *set, uint64_t k)
+{
+    uint32_t idx, slot = RETRY_KEYS;
+    uint64_t v;
+
+    for(idx = k & (RETRY_KEYS-1); (v = set->keys[idx])!=RETRY_KEY_EMPTY; idx = (idx+1) & (RETRY_KEYS-1))
+    {
+        if(v==k)
+            return;
+
+        if(v==RETRY_KEY_DELETED && slot==RETRY_KEYS)
+            slot = idx;
+    }
+
+    // a deleted key is reused, a reader passing it just keeps probing
+    if(slot==RETRY_KEYS)
+    {
+        slot = idx;
+        set->used++;
+    }
+
+    __atomic_store_n(&set->keys[slot], k, __ATOMIC_RELEASE);
+}
+
+// called with mtx held
+static void keys_remove(uint64_t k)
+{
+    uint32_t idx;
+    uint64_t v;
+
+    for(idx = k & (RETRY_KEYS-1); (v = keys->keys[idx])!=RETRY_KEY_EMPTY; idx = (idx+1) & (RETRY_KEYS-1))
+    {
+        if(v==k)
+        {
+            __atomic_store_n(&keys->keys[idx], RETRY_KEY_DELETED, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+// a fresh set with the live keys only, called with mtx held
+static void keys_rebuild()
+{
+    struct retry_keys *set, *old = keys;
+
+    if((set = calloc(1, sizeof(*set)))==NULL)
+        wquit("retry_keys malloc() failed.\n");
+
+    for(int i=0; i<RETRY_SLOTS; i++)
+    {
+        if(table[i].used)
+            keys_add(set, hash_key(table[i].hash));
+    }
+
+    __atomic_store_n(&keys, set, __ATOMIC_RELEASE);
+
+    old->retired = epoch_retire();
+    old->free_next = retired;
+    retired = old;
+
+    keys_reclaim();
+}
+
+// locate a slot by hash, or the free slot where it would go
+static struct retry_entry *slot_find(const unsigned char *hash)
+{
+    uint32_t idx;
+
+    memcpy(&idx, hash, sizeof(idx));
+
+    for(idx &= RETRY_SLOTS-1; table[idx].used; idx = (idx+1) & (RETRY_SLOTS-1))
+    {
+        if(memcmp(table[idx].hash, hash, MD5_DIGEST_LENGTH)==0)
+            break;
+    }
+
+    return &table[idx];
+}
+
+// backward shift deletion keeps probe chains intact
+static void slot_remove(struct retry_entry *e)
+{
+    uint32_t i = e-table, j = i, k;
+
+    keys_remove(hash_key(e->hash));
+    table[i].used = false;
+
+    for(;;)
+    {
+        j = (j+1) & (RETRY_SLOTS-1);
+
+        if(!table[j].used)
+            break;
+
+        memcpy(&k, table[j].hash, sizeof(k));
+        k &= RETRY_SLOTS-1;
+
+        // move j into the hole unless its home lies cyclically in (i, j]
+        if((i<=j)?(i<k && k<=j):(i<k || k<=j))
+            continue;
+
+        table[i] = table[j];
+        table[j].used = false;
+        i = j;
+    }
+
+    count--;
+}
+
+static struct retry_entry *next_due()
+{
+    struct retry_entry *e = NULL;
+
+    for(int i=0; i<RETRY_SLOTS; i++)
+    {
+        if(table[i].used && !table[i].busy && (e==NULL || table[i].due<e->due))
+            e = &table[i];
+    }
+
+    return e;
+}
+
+static void *retry_worker(void *arg)
+{
+    struct retry_entry *e;
+    struct cache_t entry;
+    struct timespec ts;
+    char domain[256];
+    uint64_t now;
+    bool ok;
+
+    pthread_mutex_lock(&mtx);
+
+    while(!quit)
+    {
+        if((e = next_due())==NULL)
+        {
+            pthread_cond_wait(&cond, &mtx);
+            continue;
+        }
+
+        now = now_msec();
+
+        if(e->due>now)
+        {
+            // new entries may be due earlier, wake up on signal too
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += (e->due-now)/1000;
+            ts.tv_nsec += ((e->due-now)%1000)*1000000L;
+
+            if(ts.tv_nsec>=1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+
+            pthread_cond_timedwait(&cond, &mtx, &ts);
+            continue;
+        }
+
+        e->busy = true;
+        memcpy(entry.hash, e->hash, MD5_DIGEST_LENGTH);
+        strlcpy(domain, e->domain, sizeof(domain));
+
+        pthread_mutex_unlock(&mtx);
+
+        ok = perform_lookup(&qinfo, &entry, domain);
+
+        // the server missed again, the cached marker stays and the slot
+        // backs off like a failure
+        if(ok && entry.category[0]=='Y' && entry.category[1]=='Y')
+        {
+            ok = false;
+            wlog(LOG_LVL3, "CFS Retry Missed: %s\n", domain);
+        }
+        else
+        if(ok)
+        {
+            cache_insert(&entry);
+            wlog(LOG_LVL3, "CFS Retry Response: %s -> [%s]\n", domain, entry.category);
+        }
+        else
+            wlog(LOG_LVL3, "CFS Retry Failed: %s\n", domain);
+
+        pthread_mutex_lock(&mtx);
+
+        // slots only move on removal, which is done by this thread
+        e = slot_find(entry.hash);
+        e->busy = false;
+
+        if(ok)
+        {
+            recovered++;
+            slot_remove(e);
+        }
+        else
+        if(++e->attempts>=RETRY_ATTEMPTS)
+        {
+            dropped++;
+            slot_remove(e);
+        }
+        else
+        {
+            failed++;
+            e->due = now_msec()+backoff(e->attempts);
+        }
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    return 0;
+}
+
+void retry_init()
+{
+    memset(table, 0, sizeof(table));
+    count = 0;
+
+    if((keys = calloc(1, sizeof(*keys)))==NULL)
+        wquit("retry_keys malloc() failed.\n");
+
+    retired = NULL;
+    quit = false;
+    seed = time(NULL);
+
+    memset(&qinfo, 0, sizeof(qinfo));
+
+    if(!curl_init(&qinfo))
+        wquit("Failed to initialize curl!\n");
+
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    if(pthread_create(&thread, NULL, retry_worker, NULL))
+        wquit("retry_worker pthread_create() failed\n");
+
+    wlog(LOG_LVL3, "Retry thread init, failure policy is fail-%s\n", config.failpolicy==FAIL_CLOSED?"closed":"open");
+}
+
+void retry_close()
+{
+    struct retry_keys *set;
+
+    pthread_mutex_lock(&mtx);
+    quit = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mtx);
+
+    // an in flight lookup is bounded by the curl timeout
+    pthread_join(thread, NULL);
+
+    curl_close(&qinfo);
+
+    while((set = retired)!=NULL)
+    {
+        retired = set->free_next;
+        free(set);
+    }
+
+    free(keys);
+    keys = NULL;
+
+    pthread_mutex_destroy(&mtx);
+    pthread_cond_destroy(&cond);
+
+    wlog(LOG_LVL3, "Retry thread stopped successfully!\n");
+}
+
+//! called from threaded code!
+bool retry_schedule(const unsigned char *hash, const char *domain)
+{
+    struct retry_entry *e;
+
+    pthread_mutex_lock(&mtx);
+
+    e = slot_find(hash);
+
+    if(!e->used)
+    {
+        if(count>=RETRY_MAX_LOAD)
+        {
+            pthread_mutex_unlock(&mtx);
+            return false;
+        }
+
+        memcpy(e->hash, hash, MD5_DIGEST_LENGTH);
+        strlcpy(e->domain, domain, sizeof(e->domain));
+
+        e->used = true;
+        e->busy = false;
+        e->attempts = 0;
+        e->due = now_msec()+backoff(0);
+        count++;
+
+        // the set stays at most half full, deleted keys included
+        if(keys->used>=RETRY_KEYS/2)
+            keys_rebuild();
+        else
+            keys_add(keys, hash_key(hash));
+
+        pthread_cond_signal(&cond);
+
+        wlog(LOG_LVL3, "Domain %s scheduled for retry\n", domain);
+    }
+
+    pthread_mutex_unlock(&mtx);
+
+    return true;
+}
+
+//! called from threaded code!
+bool retry_pending(const unsigned char *hash)
+{
+    bool pending;
+
+    // every cache miss asks, so no mtx. the set may be replaced meanwhile
+    epoch_enter();
+    pending = keys_find(__atomic_load_n(&keys, __ATOMIC_ACQUIRE), hash_key(hash));
+    epoch_exit();
+
+    return pending;
+}
+
+void retry_statistics()
+{
+    wlog(LOG_LVL1, "Retry stats: %d pending, %u recovered, %u failed, %u given up\n",
+            count, recovered, failed, dropped);
+}
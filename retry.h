@@ -0,0 +1,59 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdbool.h>
+
+#include "md5.h"
+
+#ifndef RETRY_H
+#define	RETRY_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+enum fail_policy
+{
+    FAIL_OPEN,
+    FAIL_CLOSED
+};
+
+void retry_init();
+
+void retry_close();
+
+// queue a failed classification for background retries
+bool retry_schedule(const unsigned char *hash, const char *domain);
+
+// true while the domain waits for a retry
+bool retry_pending(const unsigned char *hash);
+
+void retry_statistics();
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* RETRY_H */
+
@@ -26,33 +26,65 @@ SOFTWARE.
 
 error_reporting(0);
 
+// classify a single domain, returns the category code
+function classify($license,$url)
+{
+    if(filter_var($url,FILTER_VALIDATE_IP))
+    {
+        error_log('['.$license.'] Filtered IP address query: '.$url, 4);
+        return '5A';
+    }
+
+    //
+    // SERVER CODE GOES HERE
+    //
+
+    return '';
+}
+
 if($_SERVER['REQUEST_METHOD']==='POST')
 {
     $time=microtime(TRUE);
 
     header("Content-Type: text/plain");
 
-    list($license,$url)=explode('/',file_get_contents('php://input'));
+    $query=file_get_contents('php://input');
 
-    // ignore invalid query
-    if(empty($license) || empty($url))
+    // batch form: license on the first line, then one domain per line.
+    // the reply has one category per line in the same order, empty when
+    // a domain could not be classified
+    if(strpos($query,"\n")!==FALSE)
     {
-        error_log('-----> Bad query received: '.$url.' License: ['.$license.'] <------', 4);
-        print('BAD');
+        $lines=explode("\n",rtrim($query,"\r\n"));
+        $license=trim(array_shift($lines));
+
+        if(empty($license) || count($lines)==0)
+        {
+            error_log('-----> Bad batch query received, License: ['.$license.'] <------', 4);
+            print('BAD');
+            return;
+        }
+
+        foreach($lines as $url)
+        {
+            $url=trim($url);
+            print((empty($url)?'':classify($license,$url))."\n");
+        }
+
         return;
     }
 
-    if(filter_var($url,FILTER_VALIDATE_IP))
+    list($license,$url)=explode('/',$query);
+
+    // ignore invalid query
+    if(empty($license) || empty($url))
     {
-        error_log('['.$license.'] Filtered IP address query: '.$url, 4);
-        print('5A');
+        error_log('-----> Bad query received: '.$url.' License: ['.$license.'] <------', 4);
+        print('BAD');
         return;
     }
 
-    //
-    // SERVER CODE GOES HERE
-    //
-
+    print(classify($license,$url));
 }
 
 ?>
\ No newline at end of file
@@ -0,0 +1,544 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Classification cache shared by all dnsfilter processes of a host.
+ *
+ * The segment starts with a header page, followed by a page of writer
+ * stripes and the record table. Records use the same seqlock scheme as
+ * the mmap store: readers never lock, they copy a record and retry when
+ * its sequence changed. Slot keys never move, probe chains only grow, so
+ * a lookup needs no coordination with writers of other processes.
+ *
+ * Writers lock the stripe of the key home slot, which serializes writers
+ * of the same key across processes. A record is claimed by moving its
+ * sequence from even to odd with a CAS, so writers of different stripes
+ * racing for one slot never both win. Stripe mutexes are robust: when a
+ * process dies holding one, the next writer fences off the record it was
+ * changing.
+ *
+ * The header carries a layout number. A process finding a segment of a
+ * different layout unlinks it and creates a new one, processes still
+ * attached to the old segment keep using it until they restart. The
+ * segment survives any process exit, it is gone on reboot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+#include "utils.h"
+
+#define SHARED_MAGIC 0x444e534653484d31ULL     // "DNSFSHM1"
+#define SHARED_LAYOUT 1
+#define SHARED_PAGE 4096
+#define SHARED_HEADER_SIZE (2*SHARED_PAGE)
+#define SHARED_STRIPES 64
+#define SHARED_MAX_LOAD 90
+#define SHARED_READ_RETRIES 64
+#define SHARED_CLAIM_RETRIES 16
+#define SHARED_ATTACH_WAIT 50           // 100ms steps waiting for the creator
+#define SHARED_NO_SLOT 0xffffffff
+
+struct shared_header
+{
+    uint64_t magic;             // stored last by the creator
+    uint32_t layout;
+    uint32_t recsize;
+    uint32_t slots;
+    uint32_t count;
+    uint64_t epoch;             // creation time, tells segments apart
+    uint32_t attached;
+};
+
+struct shared_stripe
+{
+    pthread_mutex_t mtx;
+    uint32_t slot;              // record being written by the owner
+} __attribute__((aligned(64)));
+
+struct shared_record
+{
+    uint32_t seq;
+    uint32_t stamp;
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    char category[SHARED_CATEGORY_LEN];
+    uint32_t check;
+};
+
+/*
+ * 
+ */
+
+static uint32_t record_check(struct shared_record *rec)
+{
+    const uint8_t *p = (const uint8_t *)&rec->stamp;
+    size_t len = offsetof(struct shared_record, check)-offsetof(struct shared_record, stamp);
+    uint32_t h = 2166136261u;
+
+    while(len--)
+        h = (h ^ *p++)*16777619u;
+
+    return h;
+}
+
+static inline struct shared_header *header(shared_t *sh)
+{
+    return (struct shared_header *)sh->map;
+}
+
+static inline struct shared_stripe *stripe(shared_t *sh, uint32_t idx)
+{
+    return (struct shared_stripe *)(sh->map+SHARED_PAGE)+(idx & (SHARED_STRIPES-1));
+}
+
+static inline struct shared_record *record(shared_t *sh, uint32_t slot)
+{
+    return (struct shared_record *)(sh->map+SHARED_HEADER_SIZE)+slot;
+}
+
+static inline uint32_t slot_index(shared_t *sh, const unsigned char *hash)
+{
+    uint32_t idx;
+
+    memcpy(&idx, hash+4, sizeof(idx));
+
+    return idx & (sh->slots-1);
+}
+
+static bool record_read(struct shared_record *rec, struct shared_record *out)
+{
+    uint32_t s1, s2;
+
+    for(int i=0; i<SHARED_READ_RETRIES; i++)
+    {
+        s1 = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+        if(s1&1)
+            continue;
+
+        memcpy(out, rec, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        s2 = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+
+        if(s1==s2)
+        {
+            out->seq = s1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// take a record for writing, fails if another writer got it first
+static inline bool record_claim(struct shared_record *rec, uint32_t seq)
+{
+    return __atomic_compare_exchange_n(&rec->seq, &seq, seq+1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void record_release(struct shared_record *rec, uint32_t seq)
+{
+    __atomic_store_n(&rec->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+static void stripe_lock(shared_t *sh, struct shared_stripe *s)
+{
+    struct shared_record *rec;
+    uint32_t seq;
+    int rc = pthread_mutex_lock(&s->mtx);
+
+    if(rc==EOWNERDEAD)
+    {
+        // previous owner died, the record it was writing may be torn. keep
+        // the slot taken so probe chains stay intact, the bad checksum
+        // makes readers skip it and writers reuse it
+        if(s->slot!=SHARED_NO_SLOT && s->slot<sh->slots)
+        {
+            rec = record(sh, s->slot);
+            seq = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+
+            if(seq&1)
+            {
+                rec->check = ~record_check(rec);
+                __atomic_store_n(&rec->seq, seq+1, __ATOMIC_RELEASE);
+
+                wlog(LOG_WARN, "Shared cache writer died, record %u fenced off\n", s->slot);
+            }
+        }
+
+        s->slot = SHARED_NO_SLOT;
+        pthread_mutex_consistent(&s->mtx);
+    }
+    else
+    if(rc!=0)
+        wquit("Shared cache stripe lock failed: %d\n", rc);
+}
+
+static void stripe_unlock(struct shared_stripe *s)
+{
+    s->slot = SHARED_NO_SLOT;
+    pthread_mutex_unlock(&s->mtx);
+}
+
+// first process to create the segment formats it, others wait for the magic
+static bool segment_format(shared_t *sh, uint32_t slots)
+{
+    struct shared_header *hdr = header(sh);
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+    for(int i=0; i<SHARED_STRIPES; i++)
+    {
+        if(pthread_mutex_init(&stripe(sh, i)->mtx, &attr))
+        {
+            pthread_mutexattr_destroy(&attr);
+            return false;
+        }
+
+        stripe(sh, i)->slot = SHARED_NO_SLOT;
+    }
+
+    pthread_mutexattr_destroy(&attr);
+
+    hdr->layout = SHARED_LAYOUT;
+    hdr->recsize = sizeof(struct shared_record);
+    hdr->slots = slots;
+    hdr->count = 0;
+    hdr->epoch = time(NULL);
+    hdr->attached = 0;
+
+    // record table is zero filled by ftruncate()
+    __atomic_store_n(&hdr->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static bool segment_map(shared_t *sh, int fd, size_t size)
+{
+    sh->map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(sh->map==MAP_FAILED)
+    {
+        sh->map = NULL;
+        return false;
+    }
+
+    sh->size = size;
+    return true;
+}
+
+static void segment_unmap(shared_t *sh)
+{
+    if(sh->map!=NULL)
+        munmap(sh->map, sh->size);
+
+    sh->map = NULL;
+}
+
+// map an existing segment once its creator is done, -1 on error, 0 when
+// the layout does not match
+static int segment_attach(shared_t *sh, int fd)
+{
+    struct shared_header *hdr;
+    struct timespec ts = {0, 100000000};
+    struct stat sb;
+    size_t size;
+
+    for(int i=0; i<SHARED_ATTACH_WAIT; i++)
+    {
+        if(fstat(fd, &sb)<0)
+            return -1;
+
+        if(sb.st_size>=SHARED_HEADER_SIZE)
+        {
+            if(!segment_map(sh, fd, SHARED_HEADER_SIZE))
+                return -1;
+
+            if(__atomic_load_n(&header(sh)->magic, __ATOMIC_ACQUIRE)==SHARED_MAGIC)
+                break;
+
+            segment_unmap(sh);
+        }
+
+        nanosleep(&ts, NULL);
+    }
+
+    if(sh->map==NULL)
+    {
+        wlog(LOG_ERROR, "Shared cache %s was never initialized\n", sh->name);
+        return 0;
+    }
+
+    hdr = header(sh);
+
+    if(hdr->layout!=SHARED_LAYOUT || hdr->recsize!=sizeof(struct shared_record) ||
+       hdr->slots==0 || (hdr->slots&(hdr->slots-1))!=0)
+    {
+        wlog(LOG_WARN, "Shared cache %s has layout %u, expected %u\n", sh->name, hdr->layout, SHARED_LAYOUT);
+        segment_unmap(sh);
+        return 0;
+    }
+
+    sh->slots = hdr->slots;
+    sh->epoch = hdr->epoch;
+    size = SHARED_HEADER_SIZE+(size_t)sh->slots*sizeof(struct shared_record);
+
+    segment_unmap(sh);
+
+    if((size_t)sb.st_size<size)
+    {
+        wlog(LOG_WARN, "Shared cache %s is truncated\n", sh->name);
+        return 0;
+    }
+
+    return segment_map(sh, fd, size)?1:-1;
+}
+
+shared_t *shared_open(const char *name, uint32_t slots)
+{
+    shared_t *sh;
+    size_t size;
+    int fd, rc;
+
+    if((sh = calloc(sizeof(*sh), 1))==NULL)
+        wquit("shared_t malloc() failed.\n");
+
+    strlcpy(sh->name, name, sizeof(sh->name));
+
+    // a stale segment is replaced at most once
+    for(int tries=0; tries<2; tries++)
+    {
+        if((fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600))>=0)
+        {
+            for(sh->slots = 1024; sh->slots<slots; sh->slots <<= 1);
+
+            size = SHARED_HEADER_SIZE+(size_t)sh->slots*sizeof(struct shared_record);
+
+            if(ftruncate(fd, size)<0 || !segment_map(sh, fd, size) || !segment_format(sh, sh->slots))
+            {
+                wlog(LOG_ERROR, "Could not create shared cache %s\n", name);
+                segment_unmap(sh);
+                shm_unlink(name);
+                close(fd);
+                break;
+            }
+
+            sh->epoch = header(sh)->epoch;
+            close(fd);
+
+            wlog(LOG_LVL3, "Shared cache %s created: %u slots\n", name, sh->slots);
+        }
+        else
+        if(errno==EEXIST && (fd = shm_open(name, O_RDWR, 0))>=0)
+        {
+            rc = segment_attach(sh, fd);
+            close(fd);
+
+            if(rc<0)
+            {
+                wlog(LOG_ERROR, "Could not map shared cache %s\n", name);
+                break;
+            }
+
+            // start a new segment, current users keep the old one
+            if(rc==0)
+            {
+                shm_unlink(name);
+                continue;
+            }
+
+            wlog(LOG_LVL3, "Shared cache %s attached: %u slots, %u records\n", name, sh->slots,
+                    __atomic_load_n(&header(sh)->count, __ATOMIC_RELAXED));
+        }
+        else
+        {
+            wlog(LOG_ERROR, "Could not open shared cache %s\n", name);
+            break;
+        }
+
+        __atomic_fetch_add(&header(sh)->attached, 1, __ATOMIC_RELAXED);
+
+        return sh;
+    }
+
+    free(sh);
+
+    return NULL;
+}
+
+void shared_close(shared_t *sh)
+{
+    segment_unmap(sh);
+    free(sh);
+}
+
+//! called from threaded code!
+bool shared_lookup(shared_t *sh, const unsigned char *hash, char *category, size_t size, uint32_t *stamp)
+{
+    struct shared_record rec;
+    uint32_t idx = slot_index(sh, hash);
+
+    for(uint32_t i=0; i<sh->slots; i++)
+    {
+        // a record being rewritten is skipped like a foreign key
+        if(record_read(record(sh, idx), &rec))
+        {
+            if(rec.seq==0)
+                return false;
+
+            if(memcmp(rec.hash, hash, MD5_DIGEST_LENGTH)==0 && rec.check==record_check(&rec))
+            {
+                rec.category[SHARED_CATEGORY_LEN-1] = 0;
+                strlcpy(category, rec.category, size);
+
+                if(stamp!=NULL)
+                    *stamp = rec.stamp;
+
+                return true;
+            }
+        }
+
+        idx = (idx+1) & (sh->slots-1);
+    }
+
+    return false;
+}
+
+//! called from threaded code!
+bool shared_insert(shared_t *sh, const unsigned char *hash, const char *category, uint32_t stamp, uint32_t oldest)
+{
+    struct shared_header *hdr = header(sh);
+    struct shared_stripe *s;
+    struct shared_record *rec, *target;
+    uint32_t home = slot_index(sh, hash), idx, seq, tseq, tidx;
+    bool empty, match, done = false;
+
+    s = stripe(sh, home);
+    stripe_lock(sh, s);
+
+    for(int tries=0; tries<SHARED_CLAIM_RETRIES && !done; tries++)
+    {
+        target = NULL;
+        tseq = tidx = 0;
+        empty = match = false;
+        idx = home;
+
+        // existing key first, then a stale record, then the free slot
+        for(uint32_t i=0; i<sh->slots; i++)
+        {
+            rec = record(sh, idx);
+            seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+            if(seq==0)
+            {
+                if(target==NULL)
+                {
+                    target = rec;
+                    tseq = seq;
+                    tidx = idx;
+                    empty = true;
+                }
+                break;
+            }
+
+            if(!(seq&1))
+            {
+                if(memcmp(rec->hash, hash, MD5_DIGEST_LENGTH)==0 && rec->check==record_check(rec))
+                {
+                    target = rec;
+                    tseq = seq;
+                    tidx = idx;
+                    empty = false;
+                    match = true;
+                    break;
+                }
+
+                if(target==NULL && (rec->stamp<oldest || rec->check!=record_check(rec)))
+                {
+                    target = rec;
+                    tseq = seq;
+                    tidx = idx;
+                }
+            }
+
+            idx = (idx+1) & (sh->slots-1);
+        }
+
+        if(target==NULL)
+            break;
+
+        if(empty && __atomic_load_n(&hdr->count, __ATOMIC_RELAXED)>=(uint64_t)sh->slots*SHARED_MAX_LOAD/100)
+            break;
+
+        s->slot = tidx;
+
+        if(!record_claim(target, tseq))
+            continue;
+
+        // another stripe may have reused the record meanwhile
+        if((match && memcmp(target->hash, hash, MD5_DIGEST_LENGTH)!=0) ||
+           (!empty && !match && !(target->stamp<oldest || target->check!=record_check(target))))
+        {
+            record_release(target, tseq);
+            continue;
+        }
+
+        memcpy(target->hash, hash, MD5_DIGEST_LENGTH);
+        memset(target->category, 0, sizeof(target->category));
+        strlcpy(target->category, category, sizeof(target->category));
+        target->stamp = stamp;
+        target->check = record_check(target);
+
+        record_release(target, tseq);
+
+        if(empty)
+            __atomic_fetch_add(&hdr->count, 1, __ATOMIC_RELAXED);
+
+        done = true;
+    }
+
+    stripe_unlock(s);
+
+    return done;
+}
+
+uint32_t shared_count(shared_t *sh)
+{
+    return __atomic_load_n(&header(sh)->count, __ATOMIC_RELAXED);
+}
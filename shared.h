@@ -0,0 +1,72 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "md5.h"
+
+#ifndef SHARED_H
+#define	SHARED_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define SHARED_CATEGORY_LEN 36
+#define SHARED_DEFAULT_SLOTS 262144
+
+// classification cache in a POSIX shared memory segment, read and written
+// by every dnsfilter process on the host. see shared.c for the layout
+typedef struct
+{
+    char name[64];
+    uint32_t slots;
+    uint64_t epoch;
+
+    size_t size;
+    uint8_t *map;
+} shared_t;
+
+// attach to the named segment, creating it when missing or incompatible.
+// slots is only used when the segment is created
+shared_t *shared_open(const char *name, uint32_t slots);
+
+// detach, the segment stays for the other processes
+void shared_close(shared_t *sh);
+
+bool shared_lookup(shared_t *sh, const unsigned char *hash, char *category, size_t size, uint32_t *stamp);
+
+// insert or update a record, records stamped before oldest may be reused
+bool shared_insert(shared_t *sh, const unsigned char *hash, const char *category, uint32_t stamp, uint32_t oldest);
+
+uint32_t shared_count(shared_t *sh);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SHARED_H */
+
@@ -0,0 +1,482 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Fixed record hash file shared through mmap().
+ *
+ * The first page holds two copies of the header, each one carrying a
+ * generation number and a checksum. Updates are written to the copy not
+ * in use, so a crash while writing the header leaves the other one valid.
+ * Records follow the header page and are located by linear probing from
+ * the md5 hash. A slot is never freed, expired records are overwritten in
+ * place by new keys, so probe chains stay intact for readers without any
+ * locking.
+ *
+ * Each record is guarded by a sequence number, odd while the writer is
+ * changing it. Readers copy the record and retry if the sequence changed,
+ * and a checksum catches records torn by a crash. Only one process may
+ * open the file for writing, any number can map it read only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "utils.h"
+
+#define STORE_MAGIC "DNSFSTOR"
+#define STORE_VERSION 1
+#define STORE_HEADER_SIZE 4096
+#define STORE_MAX_LOAD 90       // percent of slots in use before inserts fail
+#define STORE_READ_RETRIES 64
+
+struct store_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recsize;
+    uint32_t slots;
+    uint32_t count;
+    uint64_t generation;
+    uint32_t clean;             // set when the writer closed the file
+    uint32_t check;
+};
+
+struct store_record
+{
+    uint32_t seq;
+    uint32_t stamp;
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    char category[STORE_CATEGORY_LEN];
+    uint32_t check;
+};
+
+/*
+ * 
+ */
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while(len--)
+    {
+        h ^= *p++;
+        h *= 16777619;
+    }
+
+    return h;
+}
+
+static uint32_t header_check(struct store_header *hdr)
+{
+    return fnv1a(2166136261u, hdr, offsetof(struct store_header, check));
+}
+
+static uint32_t record_check(struct store_record *rec)
+{
+    return fnv1a(2166136261u, &rec->stamp, offsetof(struct store_record, check)-offsetof(struct store_record, stamp));
+}
+
+static inline struct store_header *header_copy(store_t *st, int n)
+{
+    return (struct store_header *)(st->map+n*(STORE_HEADER_SIZE/2));
+}
+
+static inline struct store_record *record(store_t *st, uint32_t slot)
+{
+    return (struct store_record *)(st->map+STORE_HEADER_SIZE)+slot;
+}
+
+static inline uint32_t slot_index(store_t *st, const unsigned char *hash)
+{
+    uint32_t idx;
+
+    memcpy(&idx, hash+4, sizeof(idx));
+
+    return idx & (st->slots-1);
+}
+
+// pick the newest valid header copy
+static struct store_header *header_read(store_t *st)
+{
+    struct store_header *best = NULL;
+    struct store_header *hdr;
+
+    for(int i=0; i<2; i++)
+    {
+        hdr = header_copy(st, i);
+
+        if(memcmp(hdr->magic, STORE_MAGIC, sizeof(hdr->magic))!=0 || hdr->check!=header_check(hdr))
+            continue;
+
+        if(best==NULL || hdr->generation>best->generation)
+            best = hdr;
+    }
+
+    return best;
+}
+
+static void header_write(store_t *st, bool clean)
+{
+    struct store_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STORE_MAGIC, sizeof(hdr.magic));
+
+    hdr.version = STORE_VERSION;
+    hdr.recsize = sizeof(struct store_record);
+    hdr.slots = st->slots;
+    hdr.count = st->count;
+    hdr.generation = ++st->generation;
+    hdr.clean = clean;
+    hdr.check = header_check(&hdr);
+
+    // never overwrite the copy currently in use
+    memcpy(header_copy(st, hdr.generation&1), &hdr, sizeof(hdr));
+}
+
+// copy a record while no write is in progress, false if it keeps changing
+static bool record_read(struct store_record *rec, struct store_record *out)
+{
+    uint32_t s1, s2;
+
+    for(int i=0; i<STORE_READ_RETRIES; i++)
+    {
+        s1 = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+        if(s1&1)
+            continue;
+
+        memcpy(out, rec, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        s2 = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+
+        if(s1==s2)
+        {
+            out->seq = s1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void record_write(struct store_record *rec, const unsigned char *hash, const char *category, uint32_t stamp)
+{
+    uint32_t seq = rec->seq;
+
+    // odd sequence marks the record as being written
+    __atomic_store_n(&rec->seq, seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(rec->hash, hash, MD5_DIGEST_LENGTH);
+    memset(rec->category, 0, sizeof(rec->category));
+    strlcpy(rec->category, category, sizeof(rec->category));
+    rec->stamp = stamp;
+    rec->check = record_check(rec);
+
+    __atomic_store_n(&rec->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+// recount records and fence off the ones torn by a crash
+static void store_repair(store_t *st)
+{
+    struct store_record *rec;
+    uint32_t torn = 0;
+
+    st->count = 0;
+
+    for(uint32_t i=0; i<st->slots; i++)
+    {
+        rec = record(st, i);
+
+        if(rec->seq==0)
+            continue;
+
+        if((rec->seq&1) || rec->check!=record_check(rec))
+        {
+            // keep the slot taken so probe chains stay intact, the bad
+            // checksum makes readers skip it
+            rec->seq = (rec->seq|1)+1;
+            rec->check = ~record_check(rec);
+            torn++;
+        }
+
+        st->count++;
+    }
+
+    wlog(LOG_WARN, "Store was not closed cleanly, %u records checked, %u damaged\n", st->count, torn);
+}
+
+store_t *store_open(const char *path, uint32_t slots, bool writable)
+{
+    struct store_header *hdr;
+    struct stat sb;
+    store_t *st;
+
+    if((st = calloc(sizeof(*st), 1))==NULL)
+        wquit("store_t malloc() failed.\n");
+
+    st->writable = writable;
+    st->fd = open(path, writable?O_RDWR|O_CREAT:O_RDONLY, 0644);
+
+    if(st->fd<0)
+    {
+        wlog(LOG_ERROR, "Could not open store %s\n", path);
+        goto fail;
+    }
+
+    if(writable && flock(st->fd, LOCK_EX|LOCK_NB)<0)
+    {
+        wlog(LOG_ERROR, "Store %s is already open for writing by another process\n", path);
+        goto fail;
+    }
+
+    fstat(st->fd, &sb);
+
+    if(sb.st_size==0)
+    {
+        if(!writable)
+        {
+            wlog(LOG_ERROR, "Store %s is empty\n", path);
+            goto fail;
+        }
+
+        // round slot count to a power of two
+        for(st->slots = 1024; st->slots<slots; st->slots <<= 1);
+
+        if(ftruncate(st->fd, STORE_HEADER_SIZE+(off_t)st->slots*sizeof(struct store_record))<0)
+        {
+            wlog(LOG_ERROR, "Could not allocate store %s\n", path);
+            goto fail;
+        }
+
+        fstat(st->fd, &sb);
+    }
+
+    st->size = sb.st_size;
+    st->map = mmap(NULL, st->size, writable?PROT_READ|PROT_WRITE:PROT_READ, MAP_SHARED, st->fd, 0);
+
+    if(st->map==MAP_FAILED)
+    {
+        st->map = NULL;
+        wlog(LOG_ERROR, "Could not map store %s\n", path);
+        goto fail;
+    }
+
+    if(st->slots!=0)
+    {
+        // freshly created file
+        st->count = 0;
+        st->generation = 0;
+        header_write(st, true);
+        header_write(st, true);
+    }
+
+    if((hdr = header_read(st))==NULL || hdr->version!=STORE_VERSION || hdr->recsize!=sizeof(struct store_record))
+    {
+        wlog(LOG_ERROR, "Store %s has no valid header\n", path);
+        goto fail;
+    }
+
+    st->slots = hdr->slots;
+    st->count = hdr->count;
+    st->generation = hdr->generation;
+
+    if((st->slots&(st->slots-1))!=0 || st->size<STORE_HEADER_SIZE+(size_t)st->slots*sizeof(struct store_record))
+    {
+        wlog(LOG_ERROR, "Store %s is truncated\n", path);
+        goto fail;
+    }
+
+    if(writable)
+    {
+        if(!hdr->clean)
+            store_repair(st);
+
+        // stays dirty until store_close()
+        header_write(st, false);
+        msync(st->map, STORE_HEADER_SIZE, MS_SYNC);
+    }
+
+    wlog(LOG_LVL3, "Store %s: %u slots, %u records\n", path, st->slots, st->count);
+
+    return st;
+
+fail:
+    if(st->map!=NULL)
+        munmap(st->map, st->size);
+
+    if(st->fd>=0)
+        close(st->fd);
+
+    free(st);
+
+    return NULL;
+}
+
+void store_close(store_t *st)
+{
+    if(st->writable)
+    {
+        msync(st->map, st->size, MS_SYNC);
+
+        header_write(st, true);
+        msync(st->map, STORE_HEADER_SIZE, MS_SYNC);
+    }
+
+    munmap(st->map, st->size);
+    close(st->fd);
+    free(st);
+}
+
+bool store_lookup(store_t *st, const unsigned char *hash, char *category, size_t size, uint32_t *stamp)
+{
+    struct store_record rec;
+    uint32_t idx = slot_index(st, hash);
+
+    for(uint32_t i=0; i<st->slots; i++)
+    {
+        // a record still being rewritten is skipped like a foreign key
+        if(record_read(record(st, idx), &rec))
+        {
+            // empty slot ends the probe chain
+            if(rec.seq==0)
+                return false;
+
+            if(memcmp(rec.hash, hash, MD5_DIGEST_LENGTH)==0 && rec.check==record_check(&rec))
+            {
+                rec.category[STORE_CATEGORY_LEN-1] = 0;
+                strlcpy(category, rec.category, size);
+
+                if(stamp!=NULL)
+                    *stamp = rec.stamp;
+
+                return true;
+            }
+        }
+
+        idx = (idx+1) & (st->slots-1);
+    }
+
+    return false;
+}
+
+bool store_insert(store_t *st, const unsigned char *hash, const char *category, uint32_t stamp, uint32_t oldest)
+{
+    struct store_record *rec, *target = NULL;
+    uint32_t idx = slot_index(st, hash);
+
+    if(!st->writable)
+        return false;
+
+    if(strlen(category)>=STORE_CATEGORY_LEN)
+        wlog(LOG_WARN, "Store category truncated: %s\n", category);
+
+    // only this process writes, records can be read directly. existing key
+    // first, then a stale or damaged record, then the free slot
+    for(uint32_t i=0; i<st->slots; i++)
+    {
+        rec = record(st, idx);
+
+        if(rec->seq==0)
+        {
+            if(target!=NULL)
+                break;
+
+            if(st->count>=(uint64_t)st->slots*STORE_MAX_LOAD/100)
+                return false;
+
+            record_write(rec, hash, category, stamp);
+            st->count++;
+
+            return true;
+        }
+
+        if(rec->check!=record_check(rec))
+        {
+            if(target==NULL)
+                target = rec;
+        }
+        else
+        if(memcmp(rec->hash, hash, MD5_DIGEST_LENGTH)==0)
+        {
+            record_write(rec, hash, category, stamp);
+            return true;
+        }
+        else
+        if(target==NULL && rec->stamp<oldest)
+            target = rec;
+
+        idx = (idx+1) & (st->slots-1);
+    }
+
+    // the slot stays taken, so probe chains through it are kept
+    if(target==NULL)
+        return false;
+
+    record_write(target, hash, category, stamp);
+
+    return true;
+}
+
+bool store_get(store_t *st, uint32_t slot, unsigned char *hash, char *category, size_t size, uint32_t *stamp)
+{
+    struct store_record rec;
+
+    if(slot>=st->slots || !record_read(record(st, slot), &rec))
+        return false;
+
+    if(rec.seq==0 || rec.check!=record_check(&rec))
+        return false;
+
+    rec.category[STORE_CATEGORY_LEN-1] = 0;
+
+    memcpy(hash, rec.hash, MD5_DIGEST_LENGTH);
+    strlcpy(category, rec.category, size);
+
+    if(stamp!=NULL)
+        *stamp = rec.stamp;
+
+    return true;
+}
+
+void store_sync(store_t *st)
+{
+    if(!st->writable)
+        return;
+
+    header_write(st, false);
+    msync(st->map, st->size, MS_ASYNC);
+}
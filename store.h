@@ -0,0 +1,78 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "md5.h"
+
+#ifndef STORE_H
+#define	STORE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define STORE_CATEGORY_LEN 36
+#define STORE_DEFAULT_SLOTS 1048576
+
+// memory mapped classification store, see store.c for the file layout
+typedef struct
+{
+    int fd;
+    bool writable;
+
+    uint32_t slots;
+    uint32_t count;
+    uint64_t generation;
+
+    size_t size;
+    uint8_t *map;
+} store_t;
+
+// writable stores are locked against other writers, slots is only used
+// when the file is created
+store_t *store_open(const char *path, uint32_t slots, bool writable);
+
+void store_close(store_t *st);
+
+bool store_lookup(store_t *st, const unsigned char *hash, char *category, size_t size, uint32_t *stamp);
+
+// insert or update a record, reusing one stamped before oldest. fails when
+// the table is full or the store is read only
+bool store_insert(store_t *st, const unsigned char *hash, const char *category, uint32_t stamp, uint32_t oldest);
+
+// consistent copy of a slot, returns false for empty or damaged ones
+bool store_get(store_t *st, uint32_t slot, unsigned char *hash, char *category, size_t size, uint32_t *stamp);
+
+// publish the header and schedule dirty pages for writeback
+void store_sync(store_t *st);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* STORE_H */
+
@@ -0,0 +1,239 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Lookup throughput of the in-memory classification cache at 1 to N
+ * threads, with an optional writer replacing entries meanwhile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "config.h"
+#include "cache.h"
+#include "domain.h"
+#include "utils.h"
+
+#define BENCH_MAX_THREADS 256
+
+// utils.c logs through the daemon configuration
+config_t config;
+
+struct bench_thread
+{
+    pthread_t thread;
+    uint32_t seed;
+    uint64_t lookups;
+    uint64_t misses;
+};
+
+static struct bench_thread threads[BENCH_MAX_THREADS];
+static uint32_t nkeys = 8000;
+static volatile bool go, stop;
+
+/*
+ * 
+ */
+
+static void usage()
+{
+    fprintf(stderr, "Usage: dnsfilter-cachebench [-t threads] [-s secs] [-k keys] [-w] [-v]\n");
+    exit(EXIT_FAILURE);
+}
+
+static inline uint32_t xorshift(uint32_t *s)
+{
+    *s ^= *s<<13;
+    *s ^= *s>>17;
+    *s ^= *s<<5;
+
+    return *s;
+}
+
+static void key_name(uint32_t n, char *name, size_t len)
+{
+    snprintf(name, len, "host-%06u.bench.example.com", n);
+}
+
+static void *reader(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct cache_t entry;
+    char name[64];
+
+    // start together, thread creation is not part of the measure
+    while(!go)
+        sched_yield();
+
+    while(!stop)
+    {
+        key_name(xorshift(&t->seed)%nkeys, name, sizeof(name));
+
+        if(!cache_lookup(name, &entry))
+            t->misses++;
+
+        t->lookups++;
+    }
+
+    return 0;
+}
+
+// replaces random keys with a new category, about a thousand per second
+static void *writer(void *arg)
+{
+    struct cache_t entry;
+    uint32_t seed = 0x9e3779b9, n;
+    char name[64];
+
+    while(!stop)
+    {
+        n = xorshift(&seed)%nkeys;
+        key_name(n, name, sizeof(name));
+
+        domain_digest(name, entry.hash);
+        entry.category = n&1?"2A":"3B";
+        cache_insert(&entry);
+
+        usleep(1000);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct cache_t entry;
+    pthread_t wthread;
+    uint64_t lookups, misses;
+    double base = 0;
+    uint32_t maxthreads = 32, n;
+    struct timespec start, end;
+    bool writing = false;
+    double elapsed;
+    char name[64];
+    int secs = 2, c;
+
+    config.loglevel = LOG_LVL1;
+
+    while((c = getopt(argc, argv, "t:s:k:wv"))!=-1)
+    {
+        switch(c)
+        {
+            case 't':
+                maxthreads = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                secs = atoi(optarg);
+                break;
+            case 'k':
+                nkeys = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                writing = true;
+                break;
+            case 'v':
+                config.loglevel = LOG_LVL4;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if(maxthreads<1 || maxthreads>BENCH_MAX_THREADS || secs<1 || nkeys<1 || argc!=optind)
+        usage();
+
+    // memory only, the cache table holds every key
+    domain_init();
+    cache_init();
+
+    for(n=0; n<nkeys; n++)
+    {
+        key_name(n, name, sizeof(name));
+
+        domain_digest(name, entry.hash);
+        entry.category = n&1?"3B":"2A";
+        cache_insert(&entry);
+    }
+
+    if(writing && pthread_create(&wthread, NULL, writer, NULL))
+        wquit("writer pthread_create() failed\n");
+
+    fprintf(stdout, "%u keys, %d sec per step, writer %s, %ld cpus\n", nkeys, secs, writing?"on":"off", sysconf(_SC_NPROCESSORS_ONLN));
+
+    for(n=1; n<=maxthreads; n = n<maxthreads && n*2>maxthreads?maxthreads:n*2)
+    {
+        go = stop = false;
+        lookups = misses = 0;
+
+        for(uint32_t i=0; i<n; i++)
+        {
+            threads[i].seed = 2463534242u+i*7919;
+            threads[i].lookups = threads[i].misses = 0;
+
+            if(pthread_create(&threads[i].thread, NULL, reader, &threads[i]))
+                wquit("reader pthread_create() failed\n");
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        go = true;
+
+        sleep(secs);
+        stop = true;
+
+        for(uint32_t i=0; i<n; i++)
+        {
+            pthread_join(threads[i].thread, NULL);
+            lookups += threads[i].lookups;
+            misses += threads[i].misses;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+
+        if(base==0)
+            base = lookups/elapsed;
+
+        fprintf(stdout, "%3u threads: %10.0f lookups/s, %9.0f per thread, %0.2fx of 1 thread, %lu misses\n",
+                n, lookups/elapsed, lookups/elapsed/n, lookups/elapsed/base, (unsigned long)misses);
+
+        if(n==maxthreads)
+            break;
+    }
+
+    stop = true;
+
+    if(writing)
+        pthread_join(wthread, NULL);
+
+    cache_flush();
+
+    return EXIT_SUCCESS;
+}
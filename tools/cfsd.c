@@ -0,0 +1,670 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Stand-in classification server for load tests. Answers the binary UDP
+ * protocol and the HTTP POST ("<license>/<domain>" and the batch form)
+ * from a category file, one "domain category" pair per line, matching a
+ * name or its closest listed parent. Latency, errors and connection resets
+ * can be injected, rates are printed every second.
+ *
+ * Latency is served by sleeping: every HTTP connection has its own thread,
+ * UDP throughput under latency scales with -t.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "proto.h"
+
+#define CFSD_THREADS 4
+#define CFSD_HTTP_PORT 4080
+#define CFSD_BODY_MAX 65536
+
+enum latency_dists
+{
+    LATENCY_NONE,
+    LATENCY_FIXED,      // N
+    LATENCY_UNIFORM,    // MIN-MAX
+    LATENCY_EXP,        // exp:MEAN
+    LATENCY_NORMAL      // normal:MEAN,SD
+};
+
+struct category_map
+{
+    char *domain;
+    char *category;
+};
+
+static struct category_map *map;
+static uint32_t mapmask;
+static uint32_t mapcount;
+
+static const char *fallback;    // category of unlisted domains, NULL fails them
+static const char *license;     // required license, NULL accepts any
+
+static struct sockaddr_in listen_addr;
+static int httpport = CFSD_HTTP_PORT;
+static volatile bool quit;
+
+// fault injection
+static int latency;
+static double latency1, latency2;   // msecs, meaning depends on the distribution
+static double errorrate;            // HTTP 500 or UDP datagram left unanswered
+static double resetrate;            // HTTP connection reset instead of an answer
+
+static __thread unsigned int seed;
+
+static uint64_t datagrams, domains, dropped;
+static uint64_t requests, errors, resets, connections;
+
+/*
+ * 
+ */
+
+static void usage()
+{
+    fprintf(stderr, "Usage: dnsfilter-cfsd [-l addr] [-p udp port] [-H http port] [-t threads] [-d category] [-k license]\n"
+                    "                      [-L latency] [-e error rate] [-r reset rate] categories.txt\n"
+                    "  latency in msecs: N, MIN-MAX, exp:MEAN or normal:MEAN,SD\n"
+                    "  rates are fractions of requests, 0 to 1. port 0 disables a listener\n");
+    exit(EXIT_FAILURE);
+}
+
+static bool parse_latency(const char *spec)
+{
+    if(sscanf(spec, "exp:%lf", &latency1)==1)
+        latency = LATENCY_EXP;
+    else
+    if(sscanf(spec, "normal:%lf,%lf", &latency1, &latency2)==2)
+        latency = LATENCY_NORMAL;
+    else
+    if(sscanf(spec, "%lf-%lf", &latency1, &latency2)==2 && latency2>=latency1)
+        latency = LATENCY_UNIFORM;
+    else
+    if(sscanf(spec, "%lf", &latency1)==1)
+        latency = LATENCY_FIXED;
+    else
+        return false;
+
+    return true;
+}
+
+static double uniform()
+{
+    return (rand_r(&seed)+1.0)/((double)RAND_MAX+2.0);
+}
+
+static bool chance(double rate)
+{
+    return rate>0 && uniform()<rate;
+}
+
+static void inject_latency()
+{
+    struct timespec ts;
+    double ms = 0;
+
+    switch(latency)
+    {
+        case LATENCY_FIXED:
+            ms = latency1;
+            break;
+        case LATENCY_UNIFORM:
+            ms = latency1+(latency2-latency1)*uniform();
+            break;
+        case LATENCY_EXP:
+            ms = -latency1*log(uniform());
+            break;
+        case LATENCY_NORMAL:
+            // box-muller
+            ms = latency1+latency2*sqrt(-2*log(uniform()))*cos(2*M_PI*uniform());
+            break;
+        default:
+            return;
+    }
+
+    if(ms<=0)
+        return;
+
+    ts.tv_sec = ms/1000;
+    ts.tv_nsec = fmod(ms, 1000)*1000000;
+
+    nanosleep(&ts, NULL);
+}
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while(*name)
+        h = (h ^ (unsigned char)tolower(*name++))*16777619u;
+
+    return h;
+}
+
+static void map_add(const char *domain, const char *category)
+{
+    uint32_t idx;
+
+    for(idx = name_hash(domain) & mapmask; map[idx].domain!=NULL; idx = (idx+1) & mapmask)
+    {
+        // later lines win
+        if(!strcasecmp(map[idx].domain, domain))
+        {
+            free(map[idx].category);
+            map[idx].category = strdup(category);
+            return;
+        }
+    }
+
+    map[idx].domain = strdup(domain);
+    map[idx].category = strdup(category);
+    mapcount++;
+}
+
+static const char *map_find(const char *domain)
+{
+    uint32_t idx;
+
+    for(idx = name_hash(domain) & mapmask; map[idx].domain!=NULL; idx = (idx+1) & mapmask)
+    {
+        if(!strcasecmp(map[idx].domain, domain))
+            return map[idx].category;
+    }
+
+    return NULL;
+}
+
+// name or closest listed parent
+static const char *classify(const char *domain)
+{
+    const char *category;
+
+    while(domain!=NULL && *domain)
+    {
+        if((category = map_find(domain))!=NULL)
+            return category;
+
+        if((domain = strchr(domain, '.'))!=NULL)
+            domain++;
+    }
+
+    return fallback;
+}
+
+static void map_load(const char *filename)
+{
+    char line[512], *domain, *category, *save;
+    uint32_t lines = 0, size = 1024;
+    FILE *f;
+
+    if((f = fopen(filename, "r"))==NULL)
+    {
+        fprintf(stderr, "Could not read %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    // size the table for a load factor of one half
+    while(fgets(line, sizeof(line), f)!=NULL)
+        lines++;
+
+    while(size<lines*2)
+        size <<= 1;
+
+    if((map = calloc(size, sizeof(*map)))==NULL)
+    {
+        fprintf(stderr, "Out of memory for %u entries\n", lines);
+        exit(EXIT_FAILURE);
+    }
+
+    mapmask = size-1;
+    rewind(f);
+
+    while(fgets(line, sizeof(line), f)!=NULL)
+    {
+        if((domain = strtok_r(line, " \t,\r\n", &save))==NULL || domain[0]=='#')
+            continue;
+
+        if((category = strtok_r(NULL, " \t,\r\n", &save))==NULL)
+            continue;
+
+        map_add(domain, category);
+    }
+
+    fclose(f);
+}
+
+static void *udp_server(void *arg)
+{
+    struct proto_msg m;
+    struct proto_buf res;
+    struct sockaddr_in sa;
+    socklen_t salen;
+    uint8_t buf[PROTO_DATAGRAM];
+    char domain[256];
+    const char *category;
+    struct timeval tv = { 1, 0 };
+    ssize_t len;
+    int fd, on = 1, status;
+
+    // one socket per thread, the kernel spreads datagrams among them
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0))<0 ||
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))<0 ||
+       bind(fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr))<0)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // wake up now and then to notice quit
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    seed = time(NULL) ^ (uintptr_t)&m;
+
+    while(!quit)
+    {
+        salen = sizeof(sa);
+
+        if((len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&sa, &salen))<0)
+            continue;
+
+        if(!proto_decode(&m, buf, len) || m.type!=PROTO_REQUEST ||
+           (license!=NULL && strcmp(m.license, license)!=0))
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        inject_latency();
+
+        // a lost answer, the client retransmits
+        if(chance(errorrate))
+        {
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        proto_begin(&res, PROTO_RESPONSE, m.id, NULL);
+
+        // a response never outgrows its request by more than a byte per
+        // domain, categories are short
+        while(proto_record(&m, domain, sizeof(domain), &status))
+        {
+            category = classify(domain);
+
+            if(!proto_put(&res, category, PROTO_OK))
+                break;
+        }
+
+        sendto(fd, res.data, res.len, 0, (struct sockaddr *)&sa, salen);
+
+        __atomic_fetch_add(&datagrams, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&domains, res.count, __ATOMIC_RELAXED);
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+// answer a POST body, single or batch form. returns false for a bad query
+static bool http_answer(char *body, char *out, size_t size)
+{
+    const char *category;
+    char *line, *save, *domain;
+    size_t pos = 0;
+
+    out[0] = 0;
+
+    // batch form: license on the first line, then one domain per line
+    if(strchr(body, '\n')!=NULL)
+    {
+        if((line = strtok_r(body, "\r\n", &save))==NULL || (license!=NULL && strcmp(line, license)!=0))
+            return false;
+
+        while((domain = strtok_r(NULL, "\n", &save))!=NULL && pos<size)
+        {
+            domain[strcspn(domain, "\r")] = 0;
+            category = domain[0]?classify(domain):NULL;
+
+            pos += snprintf(out+pos, size-pos, "%s\n", category!=NULL?category:"");
+            __atomic_fetch_add(&domains, 1, __ATOMIC_RELAXED);
+        }
+
+        return pos<size;
+    }
+
+    if((domain = strchr(body, '/'))==NULL || domain==body || !domain[1])
+        return false;
+
+    *domain++ = 0;
+
+    if(license!=NULL && strcmp(body, license)!=0)
+        return false;
+
+    __atomic_fetch_add(&domains, 1, __ATOMIC_RELAXED);
+
+    if((category = classify(domain))!=NULL)
+        snprintf(out, size, "%s", category);
+
+    return true;
+}
+
+static bool http_send(int fd, int code, const char *status, const char *body, bool keepalive)
+{
+    char head[256];
+    size_t len = strlen(body);
+    int n;
+
+    n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n%s\r\n",
+            code, status, len, keepalive?"":"Connection: close\r\n");
+
+    return send(fd, head, n, MSG_NOSIGNAL|(len>0?MSG_MORE:0))==n && (len==0 || send(fd, body, len, MSG_NOSIGNAL)==len);
+}
+
+// idle keep-alive connections wait here, the timeout only checks for quit
+static ssize_t conn_recv(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while((n = recv(fd, buf, len, 0))<0 && (errno==EAGAIN || errno==EINTR) && !quit);
+
+    return n;
+}
+
+// one keep-alive connection, requests are answered in order
+static void *http_conn(void *arg)
+{
+    struct linger rst = { 1, 0 };
+    char *buf, *out, *end, *p, saved;
+    size_t have = 0, need, length;
+    bool keepalive, post, ok;
+    ssize_t n;
+    int fd = (intptr_t)arg;
+
+    seed = time(NULL) ^ fd;
+
+    buf = malloc(CFSD_BODY_MAX+1);
+    out = malloc(CFSD_BODY_MAX);
+
+    while(!quit && buf!=NULL && out!=NULL)
+    {
+        // headers
+        while((end = memmem(buf, have, "\r\n\r\n", 4))==NULL)
+        {
+            if(have>=CFSD_BODY_MAX || (n = conn_recv(fd, buf+have, CFSD_BODY_MAX-have))<=0)
+                goto done;
+
+            have += n;
+        }
+
+        *end = 0;
+        post = !strncmp(buf, "POST ", 5);
+        keepalive = strcasestr(buf, "\nConnection: close")==NULL && strstr(buf, "HTTP/1.0")==NULL;
+        length = (p = strcasestr(buf, "\nContent-Length:"))!=NULL?strtoul(p+16, NULL, 10):0;
+
+        need = (end-buf)+4+length;
+
+        if(need>CFSD_BODY_MAX)
+            goto done;
+
+        // body
+        while(have<need)
+        {
+            if((n = conn_recv(fd, buf+have, CFSD_BODY_MAX-have))<=0)
+                goto done;
+
+            have += n;
+        }
+
+        __atomic_fetch_add(&requests, 1, __ATOMIC_RELAXED);
+
+        inject_latency();
+
+        if(chance(resetrate))
+        {
+            // RST instead of FIN
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &rst, sizeof(rst));
+            __atomic_fetch_add(&resets, 1, __ATOMIC_RELAXED);
+            goto done;
+        }
+
+        if(chance(errorrate))
+        {
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+
+            if(!http_send(fd, 500, "Internal Server Error", "", keepalive))
+                goto done;
+        }
+        else
+        if(post)
+        {
+            p = end+4;
+
+            // the terminator lands on the first byte of a pipelined request
+            saved = p[length];
+            p[length] = 0;
+            ok = http_answer(p, out, CFSD_BODY_MAX);
+            p[length] = saved;
+
+            if(!http_send(fd, 200, "OK", ok?out:"BAD", keepalive))
+                goto done;
+        }
+        else
+        if(!http_send(fd, 200, "OK", "", keepalive))
+            goto done;
+
+        if(!keepalive)
+            break;
+
+        // pipelined leftovers
+        memmove(buf, buf+need, have-need);
+        have -= need;
+    }
+
+done:
+    close(fd);
+    free(buf);
+    free(out);
+
+    __atomic_fetch_sub(&connections, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static void *http_server(void *arg)
+{
+    struct sockaddr_in sa = listen_addr;
+    struct timeval tv = { 1, 0 };
+    pthread_attr_t attr;
+    pthread_t t;
+    int fd, conn, on = 1;
+
+    sa.sin_port = htons(httpport);
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0))<0 ||
+       setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))<0 ||
+       bind(fd, (struct sockaddr *)&sa, sizeof(sa))<0 || listen(fd, 1024)<0)
+    {
+        perror("http socket");
+        exit(EXIT_FAILURE);
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256*1024);
+
+    while(!quit)
+    {
+        if((conn = accept(fd, NULL, NULL))<0)
+            continue;
+
+        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        __atomic_fetch_add(&connections, 1, __ATOMIC_RELAXED);
+
+        if(pthread_create(&t, &attr, http_conn, (void *)(intptr_t)conn))
+        {
+            __atomic_fetch_sub(&connections, 1, __ATOMIC_RELAXED);
+            close(conn);
+        }
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+static void sig_handler(int sig)
+{
+    quit = true;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t *threads, http;
+    uint64_t lastd = 0, lastn = 0, lastr = 0, laste = 0, lastx = 0, d, n, r, e, x;
+    int nthreads = CFSD_THREADS;
+    bool udp = true;
+    int c, i;
+
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_port = htons(PROTO_PORT);
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    while((c = getopt(argc, argv, "l:p:H:t:d:k:L:e:r:"))!=-1)
+    {
+        switch(c)
+        {
+            case 'l':
+                if(inet_pton(AF_INET, optarg, &listen_addr.sin_addr)!=1)
+                    usage();
+                break;
+            case 'p':
+                udp = atoi(optarg)>0;
+                listen_addr.sin_port = htons(atoi(optarg));
+                break;
+            case 'H':
+                httpport = atoi(optarg);
+                break;
+            case 'L':
+                if(!parse_latency(optarg))
+                    usage();
+                break;
+            case 'e':
+                errorrate = atof(optarg);
+                break;
+            case 'r':
+                resetrate = atof(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'd':
+                fallback = optarg;
+                break;
+            case 'k':
+                license = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if(argc-optind!=1 || nthreads<1)
+        usage();
+
+    map_load(argv[optind]);
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if((threads = calloc(nthreads, sizeof(pthread_t)))==NULL)
+        return EXIT_FAILURE;
+
+    for(i=0; udp && i<nthreads; i++)
+        pthread_create(&threads[i], NULL, udp_server, NULL);
+
+    if(httpport>0)
+        pthread_create(&http, NULL, http_server, NULL);
+
+    fprintf(stdout, "Serving %u domains on %s, udp port %d, http port %d\n", mapcount,
+            inet_ntoa(listen_addr.sin_addr), udp?ntohs(listen_addr.sin_port):0, httpport);
+
+    while(!quit)
+    {
+        sleep(1);
+
+        d = __atomic_load_n(&datagrams, __ATOMIC_RELAXED);
+        n = __atomic_load_n(&domains, __ATOMIC_RELAXED);
+        r = __atomic_load_n(&requests, __ATOMIC_RELAXED);
+        e = __atomic_load_n(&errors, __ATOMIC_RELAXED);
+        x = __atomic_load_n(&resets, __ATOMIC_RELAXED);
+
+        if(d!=lastd || r!=lastr)
+            fprintf(stdout, "%lu datagrams/s, %lu http requests/s, %lu domains/s, %lu errors/s, %lu resets/s, %lu connections\n",
+                    (unsigned long)(d-lastd), (unsigned long)(r-lastr), (unsigned long)(n-lastn),
+                    (unsigned long)(e-laste), (unsigned long)(x-lastx), (unsigned long)connections);
+
+        fflush(stdout);
+
+        lastd = d;
+        lastn = n;
+        lastr = r;
+        laste = e;
+        lastx = x;
+    }
+
+    for(i=0; udp && i<nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if(httpport>0)
+        pthread_join(http, NULL);
+
+    fprintf(stdout, "Answered %lu datagrams, %lu http requests, %lu domains, %lu dropped\n",
+            (unsigned long)datagrams, (unsigned long)requests, (unsigned long)domains, (unsigned long)dropped);
+
+    return EXIT_SUCCESS;
+}
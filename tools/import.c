@@ -0,0 +1,405 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Bulk loads a domain,category feed into cache.db and/or a cache store
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "store.h"
+#include "domain.h"
+#include "utils.h"
+
+#define IMPORT_BATCH 100000     // rows per cache.db transaction
+#define IMPORT_PROGRESS 1000000 // rows between progress reports
+#define IMPORT_CATEGORIES 65536
+
+// utils.c logs through the daemon configuration
+config_t config;
+
+// same table cache.c creates
+static const char *schema = "PRAGMA journal_mode=WAL; " \
+                            "CREATE TABLE IF NOT EXISTS cache ( " \
+                            "       id        INTEGER PRIMARY KEY AUTOINCREMENT, " \
+                            "       hash      BLOB NOT NULL, " \
+                            "       category  TEXT NOT NULL, " \
+                            "       stamp     INTEGER NOT NULL); " \
+                            "CREATE UNIQUE INDEX IF NOT EXISTS idx_hash ON cache(hash); " \
+                            "CREATE INDEX IF NOT EXISTS idx_stamp ON cache(stamp);";
+
+static const char *ins = "replace into cache(hash,category,stamp) values(?,?,?)";
+
+// a parsed feed row, categories are interned so sorted builds stay small
+struct import_row
+{
+    unsigned char hash[MD5_DIGEST_LENGTH];
+    uint32_t seq;
+    uint16_t category;
+};
+
+static char *categories[IMPORT_CATEGORIES];
+static uint32_t ncategories;
+
+static sqlite3 *db;
+static sqlite3_stmt *insert;
+static store_t *st;
+
+static uint32_t stamp;
+static int batch = IMPORT_BATCH;
+static uint64_t written, full, pending;
+static struct timespec started;
+
+/*
+ * 
+ */
+
+static void usage()
+{
+    fprintf(stderr, "Usage: dnsfilter-import [-d cache.db] [-m cache.store] [-s slots] [-b rows] [-S] [-r] [-x categories] [-v] [feed.csv]\n");
+    exit(EXIT_FAILURE);
+}
+
+static double elapsed()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec-started.tv_sec)+(now.tv_nsec-started.tv_nsec)/1e9;
+}
+
+static int category_id(const char *name)
+{
+    uint32_t i;
+
+    for(i=0; i<ncategories; i++)
+    {
+        if(!strcmp(categories[i], name))
+            return i;
+    }
+
+    if(ncategories==IMPORT_CATEGORIES)
+        return -1;
+
+    categories[ncategories] = strdup(name);
+
+    return ncategories++;
+}
+
+// strip blanks and quotes around a field
+static char *field_trim(char *s)
+{
+    char *e;
+
+    while(*s==' ' || *s=='"' || *s=='\'')
+        s++;
+
+    for(e = s+strlen(s); e>s && (e[-1]==' ' || e[-1]=='"' || e[-1]=='\'' || e[-1]=='\r' || e[-1]=='\n'); e--);
+    *e = 0;
+
+    return s;
+}
+
+// domain,category or domain<tab>category, anything after a second separator
+// is ignored. returns false for headers, comments and malformed rows
+static bool parse_row(char *line, struct import_row *row)
+{
+    char key[256], *sep, *domain, *category, *end;
+    const char *reg;
+    int id;
+
+    if((sep = strpbrk(line, ",\t"))==NULL || *line=='#')
+        return false;
+
+    *sep++ = 0;
+
+    if((end = strpbrk(sep, ",\t"))!=NULL)
+        *end = 0;
+
+    domain = field_trim(line);
+    category = field_trim(sep);
+
+    if(!*domain || !*category || strchr(domain, '.')==NULL || strlen(category)>=STORE_CATEGORY_LEN)
+        return false;
+
+    // keep the daemon's key: full name, or eTLD+1 with classify_registrable
+    domain_normalize(domain, key, sizeof(key));
+
+    if(config.registrable && !domain_exact(category) && (reg = domain_registrable(key))!=key)
+        memmove(key, reg, strlen(reg)+1);
+
+    if((id = category_id(category))<0)
+        return false;
+
+    domain_digest(key, row->hash);
+    row->category = id;
+
+    return true;
+}
+
+static void progress()
+{
+    double secs = elapsed();
+
+    fprintf(stdout, "%lu rows written, %0.0f rows/s\n", (unsigned long)written, secs>0?written/secs:0.0);
+}
+
+static void db_commit()
+{
+    if(db==NULL || pending==0)
+        return;
+
+    if(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL)!=SQLITE_OK)
+        wquit("Could not commit to cache.db: %s\n", sqlite3_errmsg(db));
+
+    pending = 0;
+}
+
+static void row_write(const struct import_row *row)
+{
+    if(st!=NULL && !store_insert(st, row->hash, categories[row->category], stamp, 0))
+        full++;
+
+    if(db!=NULL)
+    {
+        // one big transaction per batch, short enough not to starve the daemon writer
+        if(pending==0 && sqlite3_exec(db, "BEGIN", NULL, NULL, NULL)!=SQLITE_OK)
+            wquit("Could not write to cache.db: %s\n", sqlite3_errmsg(db));
+
+        sqlite3_bind_blob(insert, 1, row->hash, MD5_DIGEST_LENGTH, SQLITE_STATIC);
+        sqlite3_bind_text(insert, 2, categories[row->category], -1, SQLITE_STATIC);
+        sqlite3_bind_int64(insert, 3, stamp);
+
+        if(sqlite3_step(insert)!=SQLITE_DONE)
+            wquit("Could not write to cache.db: %s\n", sqlite3_errmsg(db));
+
+        sqlite3_reset(insert);
+
+        if(++pending>=batch)
+            db_commit();
+    }
+
+    if(++written%IMPORT_PROGRESS==0)
+        progress();
+}
+
+// hash order, then feed order so the last duplicate wins
+static int row_compare(const void *a, const void *b)
+{
+    const struct import_row *x = a, *y = b;
+    int rc = memcmp(x->hash, y->hash, MD5_DIGEST_LENGTH);
+
+    if(rc==0)
+        rc = x->seq<y->seq?-1:1;
+
+    return rc;
+}
+
+static void db_open(const char *path)
+{
+    if(sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL)!=SQLITE_OK)
+        wquit("Could not open %s: %s\n", path, sqlite3_errmsg(db));
+
+    // the daemon may hold the write lock for one of its own batches
+    sqlite3_busy_timeout(db, 30000);
+
+    if(sqlite3_exec(db, schema, NULL, NULL, NULL)!=SQLITE_OK ||
+       sqlite3_exec(db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL)!=SQLITE_OK ||
+       sqlite3_prepare_v2(db, ins, -1, &insert, NULL)!=SQLITE_OK)
+        wquit("Could not prepare %s: %s\n", path, sqlite3_errmsg(db));
+}
+
+// tell a running daemon its bloom filter misses the new rows
+static void db_close()
+{
+    sqlite3_stmt *stmt;
+    char sql[64];
+    int version = 0;
+
+    db_commit();
+    sqlite3_finalize(insert);
+
+    if(sqlite3_prepare_v2(db, "pragma user_version", -1, &stmt, NULL)==SQLITE_OK)
+    {
+        if(sqlite3_step(stmt)==SQLITE_ROW)
+            version = sqlite3_column_int(stmt, 0);
+
+        sqlite3_finalize(stmt);
+    }
+
+    snprintf(sql, sizeof(sql), "PRAGMA user_version=%d", version+1);
+
+    if(sqlite3_exec(db, sql, NULL, NULL, NULL)!=SQLITE_OK)
+        wlog(LOG_WARN, "Could not flag cache.db as updated: %s\n", sqlite3_errmsg(db));
+
+    sqlite3_close(db);
+}
+
+int main(int argc, char **argv)
+{
+    char line[1024];
+    const char *dbpath = NULL, *storepath = NULL;
+    struct import_row row, *rows = NULL;
+    size_t nrows = 0, alloc = 0, i;
+    uint64_t lines = 0, invalid = 0;
+    uint32_t slots = 0;
+    bool sorted = false;
+    double secs;
+    FILE *in;
+    int c;
+
+    config.loglevel = LOG_LVL1;
+
+    while((c = getopt(argc, argv, "d:m:s:b:Srx:v"))!=-1)
+    {
+        switch(c)
+        {
+            case 'd':
+                dbpath = optarg;
+                break;
+            case 'm':
+                storepath = optarg;
+                break;
+            case 's':
+                slots = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            case 'S':
+                sorted = true;
+                break;
+            case 'r':
+                config.registrable = true;
+                break;
+            case 'x':
+                strlcpy(config.exactcats, optarg, sizeof(config.exactcats));
+                break;
+            case 'v':
+                config.loglevel = LOG_LVL4;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if((dbpath==NULL && storepath==NULL) || argc-optind>1 || batch<=0)
+        usage();
+
+    if(argc-optind==1)
+    {
+        if((in = fopen(argv[optind], "r"))==NULL)
+            wquit("Could not open %s\n", argv[optind]);
+    }
+    else
+        in = stdin;
+
+    domain_init();
+
+    if(dbpath!=NULL)
+        db_open(dbpath);
+
+    // a running daemon holds the writer lock of its store
+    if(storepath!=NULL && (st = store_open(storepath, slots>0?slots:STORE_DEFAULT_SLOTS, true))==NULL)
+        wquit("Could not open store %s, is dnsfilter using it?\n", storepath);
+
+    stamp = time(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    while(fgets(line, sizeof(line), in)!=NULL)
+    {
+        lines++;
+
+        if(!parse_row(line, &row))
+        {
+            invalid++;
+            continue;
+        }
+
+        if(!sorted)
+        {
+            row_write(&row);
+            continue;
+        }
+
+        if(nrows==alloc)
+        {
+            struct import_row *grown;
+
+            alloc = alloc?alloc*2:1048576;
+
+            if((grown = realloc(rows, alloc*sizeof(*rows)))==NULL)
+                wquit("Out of memory after %lu rows, import without -S\n", (unsigned long)nrows);
+
+            rows = grown;
+        }
+
+        row.seq = nrows;
+        rows[nrows++] = row;
+    }
+
+    // sorted builds insert in index order, pages are filled once instead of
+    // being split over and over by random hashes
+    if(sorted)
+    {
+        fprintf(stdout, "Read %lu rows in %0.3f sec, sorting\n", (unsigned long)nrows, elapsed());
+
+        qsort(rows, nrows, sizeof(*rows), row_compare);
+
+        for(i=0; i<nrows; i++)
+        {
+            if(i+1<nrows && !memcmp(rows[i].hash, rows[i+1].hash, MD5_DIGEST_LENGTH))
+                continue;
+
+            row_write(&rows[i]);
+        }
+
+        free(rows);
+    }
+
+    if(db!=NULL)
+        db_close();
+
+    if(st!=NULL)
+        store_close(st);
+
+    secs = elapsed();
+
+    fprintf(stdout, "Imported %lu of %lu rows (%lu invalid, %lu rejected, store full) in %0.3f sec, %0.0f rows/s\n",
+            (unsigned long)written, (unsigned long)lines, (unsigned long)invalid, (unsigned long)full, secs,
+            secs>0?lines/secs:0.0);
+
+    if(in!=stdin)
+        fclose(in);
+
+    return full>0?EXIT_FAILURE:EXIT_SUCCESS;
+}
@@ -0,0 +1,197 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/*
+ * Converts a report.db log table keyed by domain text to the domains dictionary
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "utils.h"
+
+// utils.c logs through the daemon configuration
+config_t config;
+
+// same tables log.c creates, indexes are built once the rows are in
+static const char *schema = "CREATE TABLE IF NOT EXISTS domains (" \
+                            "       id        INTEGER PRIMARY KEY, " \
+                            "       name      TEXT NOT NULL UNIQUE); " \
+                            "CREATE TABLE log_new ( " \
+                            "       id        INTEGER PRIMARY KEY AUTOINCREMENT, " \
+                            "       ipaddr    UNSIGNED INTEGER NOT NULL, " \
+                            "       hitcount  INTEGER DEFAULT 0, " \
+                            "       hitcode   INTEGER DEFAULT 0, " \
+                            "       group_id  INTEGER DEFAULT 0, " \
+                            "       domain_id INTEGER NOT NULL, " \
+                            "       category  TEXT NULL, " \
+                            "       stamp     INTEGER NOT NULL); ";
+
+// sorted names get ascending ids, the dictionary index is filled in order
+static const char *names = "insert or ignore into domains(name) select distinct domain from log order by domain";
+
+static const char *copy = "insert into log_new(id,ipaddr,hitcount,hitcode,group_id,domain_id,category,stamp) " \
+                          "select l.id, l.ipaddr, l.hitcount, l.hitcode, l.group_id, d.id, l.category, l.stamp " \
+                          "from log l join domains d on d.name=l.domain order by l.id";
+
+static const char *swap = "DROP TABLE log; " \
+                          "ALTER TABLE log_new RENAME TO log; " \
+                          "CREATE UNIQUE INDEX idx_log ON log(ipaddr,domain_id); " \
+                          "CREATE INDEX idx_stamp ON log(stamp); " \
+                          "CREATE VIEW IF NOT EXISTS log_view AS " \
+                          "       SELECT l.id, l.ipaddr, l.hitcount, l.hitcode, l.group_id, d.name AS domain, l.category, l.stamp " \
+                          "       FROM log l JOIN domains d ON d.id=l.domain_id; ";
+
+static sqlite3 *db;
+static struct timespec started;
+
+/*
+ * 
+ */
+
+static void usage()
+{
+    fprintf(stderr, "Usage: dnsfilter-migrate [-n] report.db\n");
+    exit(EXIT_FAILURE);
+}
+
+static double elapsed()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec-started.tv_sec)+(now.tv_nsec-started.tv_nsec)/1e9;
+}
+
+// first column of a one row query, -1 when it cant be run
+static int64_t query_int(const char *query)
+{
+    sqlite3_stmt *stmt;
+    int64_t value = -1;
+
+    if(sqlite3_prepare_v2(db, query, -1, &stmt, NULL)!=SQLITE_OK)
+        return -1;
+
+    if(sqlite3_step(stmt)==SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+
+    sqlite3_finalize(stmt);
+
+    return value;
+}
+
+static void db_exec(const char *query, const char *what)
+{
+    if(sqlite3_exec(db, query, NULL, NULL, NULL)!=SQLITE_OK)
+        wquit("Could not %s: %s\n", what, sqlite3_errmsg(db));
+}
+
+// dbstat is an optional sqlite module, sizes are skipped without it
+static void sizes(const char *when)
+{
+    int64_t file = query_int("select page_count*page_size from pragma_page_count, pragma_page_size");
+    int64_t index = query_int("select sum(pgsize) from dbstat where name='idx_log'");
+    int64_t table = query_int("select sum(pgsize) from dbstat where name='log'");
+    int64_t dict = query_int("select sum(pgsize) from dbstat where name in ('domains','sqlite_autoindex_domains_1')");
+
+    fprintf(stdout, "%s: %ld rows, database %ld KB, log %ld KB, idx_log %ld KB, domains %ld KB\n", when,
+            (long)query_int("select count(*) from log"), (long)file/1024, (long)table/1024, (long)index/1024,
+            (long)(dict>0?dict/1024:0));
+}
+
+int main(int argc, char **argv)
+{
+    bool vacuum = true;
+    int64_t rows, domains;
+    double secs;
+    int c;
+
+    config.loglevel = LOG_LVL1;
+
+    while((c = getopt(argc, argv, "n"))!=-1)
+    {
+        switch(c)
+        {
+            case 'n':
+                vacuum = false;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if(argc-optind!=1)
+        usage();
+
+    if(sqlite3_open_v2(argv[optind], &db, SQLITE_OPEN_READWRITE, NULL)!=SQLITE_OK)
+        wquit("Could not open %s: %s\n", argv[optind], sqlite3_errmsg(db));
+
+    if(query_int("select count(*) from pragma_table_info('log') where name='domain'")!=1)
+    {
+        fprintf(stdout, "%s has no old log table, nothing to do\n", argv[optind]);
+        sqlite3_close(db);
+        return EXIT_SUCCESS;
+    }
+
+    sizes("Before");
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // a running dnsfilter keeps statements on the old table, it must be
+    // stopped. the exclusive lock makes sure nothing else writes meanwhile
+    sqlite3_busy_timeout(db, 30000);
+    db_exec("BEGIN EXCLUSIVE", "lock the database, is dnsfilter running?");
+
+    db_exec(schema, "create the new tables");
+    db_exec(names, "fill the domains table");
+    db_exec(copy, "copy the log table");
+
+    rows = sqlite3_changes(db);
+    domains = query_int("select count(*) from domains");
+
+    db_exec(swap, "replace the log table");
+    db_exec("COMMIT", "commit the conversion");
+
+    secs = elapsed();
+
+    fprintf(stdout, "Converted %ld rows, %ld domains in %0.3f sec, %0.0f rows/s\n",
+            (long)rows, (long)domains, secs, secs>0?rows/secs:0.0);
+
+    // the old table pages are only free pages until the file is rebuilt
+    if(vacuum)
+        db_exec("VACUUM", "vacuum the database");
+
+    sizes("After");
+
+    sqlite3_close(db);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+/*
+MIT License
+
+Copyright (c) 2019 Cassiano Martin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Builds a memory mapped cache store from an existing cache.db
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "store.h"
+#include "utils.h"
+
+// utils.c logs through the daemon configuration
+config_t config;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: dnsfilter-mkstore [-s slots] [-v] cache.db cache.store\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    store_t *st;
+    struct timespec start, end;
+    uint32_t slots = 0;
+    uint32_t rows = 0, skipped = 0, full = 0;
+    double secs;
+    int c;
+
+    config.loglevel = LOG_LVL1;
+
+    while((c = getopt(argc, argv, "s:v"))!=-1)
+    {
+        switch(c)
+        {
+            case 's':
+                slots = strtoul(optarg, NULL, 0);
+                break;
+            case 'v':
+                config.loglevel = LOG_LVL4;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if(argc-optind!=2)
+        usage();
+
+    if(sqlite3_open_v2(argv[optind], &db, SQLITE_OPEN_READONLY, NULL)!=SQLITE_OK)
+        wquit("Could not open %s: %s\n", argv[optind], sqlite3_errmsg(db));
+
+    // size the table at twice the current row count if not given
+    if(slots==0)
+    {
+        if(sqlite3_prepare_v2(db, "select count(*) from cache", -1, &stmt, NULL)!=SQLITE_OK)
+            wquit("Could not read %s: %s\n", argv[optind], sqlite3_errmsg(db));
+
+        if(sqlite3_step(stmt)==SQLITE_ROW)
+            slots = sqlite3_column_int(stmt, 0)*2;
+
+        sqlite3_finalize(stmt);
+
+        if(slots<STORE_DEFAULT_SLOTS)
+            slots = STORE_DEFAULT_SLOTS;
+    }
+
+    if((st = store_open(argv[optind+1], slots, true))==NULL)
+        wquit("Could not open store %s\n", argv[optind+1]);
+
+    if(sqlite3_prepare_v2(db, "select hash,category,stamp from cache order by stamp", -1, &stmt, NULL)!=SQLITE_OK)
+        wquit("Could not read %s: %s\n", argv[optind], sqlite3_errmsg(db));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // oldest first, so newer duplicates win
+    while(sqlite3_step(stmt)==SQLITE_ROW)
+    {
+        const void *hash = sqlite3_column_blob(stmt, 0);
+        const char *category = (const char *)sqlite3_column_text(stmt, 1);
+
+        if(hash==NULL || category==NULL || sqlite3_column_bytes(stmt, 0)!=MD5_DIGEST_LENGTH)
+        {
+            skipped++;
+            continue;
+        }
+
+        if(!store_insert(st, hash, category, sqlite3_column_int64(stmt, 2), 0))
+        {
+            full++;
+            continue;
+        }
+
+        rows++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    fprintf(stdout, "Imported %u records (%u invalid, %u rejected, store full) in %0.3f sec, %u of %u slots used\n",
+            rows, skipped, full, secs, st->count, st->slots);
+
+    store_close(st);
+
+    return full>0?EXIT_FAILURE:EXIT_SUCCESS;
+}